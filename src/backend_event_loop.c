@@ -20,29 +20,95 @@
 #include <string.h>
 #include <errno.h>
 #include <time.h>
+#include <unistd.h>
 
 //Remove
 #include <stdio.h>
 
 #include "backend_event_loop.h"
 
-struct backend_event_loop* backend_event_loop_create()
+static int32_t backend_heap_grow(struct backend_event_loop *del);
+
+static uint64_t backend_get_cur_time()
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &tp);
+    return (tp.tv_sec * 1e3) + (tp.tv_nsec / 1e6);
+}
+
+static uint64_t backend_get_cur_time_ns()
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &tp);
+    return (tp.tv_sec * 1000000000ULL) + tp.tv_nsec;
+}
+
+struct backend_event_loop* backend_event_loop_create(uint32_t flags)
 {
     struct backend_event_loop *del = calloc(sizeof(struct backend_event_loop), 1);
 
     if(!del)
         return NULL;
 
+    STAILQ_INIT(&(del->itr_tasks));
+    backend_pool_init(&(del->epoll_pool), sizeof(struct backend_epoll_handle),
+                      BACKEND_POOL_SLAB_OBJS);
+    backend_pool_init(&(del->timeout_pool),
+                      sizeof(struct backend_timeout_handle),
+                      BACKEND_POOL_SLAB_OBJS);
+
     if((del->efd = epoll_create(MAX_EPOLL_EVENTS)) == -1){
         free(del);
         return NULL;
     }
 
-    LIST_INIT(&(del->timeout_list));
+    if (flags & BACKEND_FLAG_TIMER_WHEEL) {
+        //calloc takes care of initializing the slots (LIST_INIT is NULL)
+        del->timer_wheel = calloc(sizeof(struct backend_timer_wheel), 1);
+
+        if (!del->timer_wheel) {
+            close(del->efd);
+            free(del);
+            return NULL;
+        }
+
+        del->timer_wheel->cur_tick = backend_get_cur_time();
+    } else if (backend_heap_grow(del)) {
+        close(del->efd);
+        free(del);
+        return NULL;
+    }
+
+    del->events = calloc(sizeof(struct epoll_event), MAX_EPOLL_EVENTS);
+
+    if (!del->events) {
+        free(del->timer_wheel);
+        free(del->timeout_heap);
+        close(del->efd);
+        free(del);
+        return NULL;
+    }
+
+    del->events_size = MAX_EPOLL_EVENTS;
+    del->stats.events_size = del->events_size;
 
     return del;
 }
 
+void backend_event_loop_destroy(struct backend_event_loop *del)
+{
+    close(del->efd);
+    free(del->events);
+    free(del->timeout_heap);
+    free(del->timer_wheel);
+    free(del->prof);
+    backend_pool_destroy(&(del->epoll_pool));
+    backend_pool_destroy(&(del->timeout_pool));
+    free(del);
+}
+
 void backend_configure_epoll_handle(struct backend_epoll_handle *handle,
 		void *ptr, int fd, backend_epoll_cb cb)
 {
@@ -52,18 +118,25 @@ void backend_configure_epoll_handle(struct backend_epoll_handle *handle,
 }
 
 struct backend_epoll_handle* backend_create_epoll_handle(
-        void *ptr, int fd, backend_epoll_cb cb, uint8_t libusb_fd){
-    struct backend_epoll_handle *handle =
-        calloc(sizeof(struct backend_epoll_handle), 1);
+        struct backend_event_loop *del, void *ptr, int fd, backend_epoll_cb cb,
+        uint8_t libusb_fd){
+    struct backend_epoll_handle *handle = backend_pool_alloc(&(del->epoll_pool));
 
-    if(handle != NULL)
-		backend_configure_epoll_handle(handle, ptr, fd, cb);
+    if (handle == NULL)
+        return NULL;
 
+    backend_configure_epoll_handle(handle, ptr, fd, cb);
     handle->libusb_fd = libusb_fd;
 
     return handle;
 }
 
+void backend_free_epoll_handle(struct backend_event_loop *del,
+                               struct backend_epoll_handle *handle)
+{
+    backend_pool_free(&(del->epoll_pool), handle);
+}
+
 int32_t backend_event_loop_update(struct backend_event_loop *del, uint32_t events,
         int32_t op, int32_t fd, void *ptr)
 {
@@ -77,48 +150,322 @@ int32_t backend_event_loop_update(struct backend_event_loop *del, uint32_t event
 
 static void backend_print_timeouts(struct backend_event_loop *del)
 {
-    struct backend_timeout_handle *itr = del->timeout_list.lh_first;
+    uint32_t i;
+
+    for (i = 0; i < del->timeout_heap_len; i++)
+        printf("%lu\n", del->timeout_heap[i]->timeout_clock);
 
-    while (itr != NULL) {
-        printf("%lu\n", itr->timeout_clock);
-        itr = itr->timeout_next.le_next;
-    }
     printf("\n");
 }
 
-void backend_insert_timeout(struct backend_event_loop *del,
-                            struct backend_timeout_handle *handle)
+//Last point in time where the timeout can be run. The heap is ordered on the
+//deadline, while the timeout can be run from timeout_clock
+static inline uint64_t backend_timeout_deadline(
+        struct backend_timeout_handle *handle)
 {
-    struct backend_timeout_handle *itr = del->timeout_list.lh_first, *prev_itr;
+    return handle->timeout_clock + handle->slack;
+}
 
-    if (itr == NULL ||
-        handle->timeout_clock < itr->timeout_clock) {
-        LIST_INSERT_HEAD(&(del->timeout_list), handle, timeout_next);
-        return;
-    } 
+static inline void backend_heap_set(struct backend_event_loop *del,
+                                    uint32_t idx,
+                                    struct backend_timeout_handle *handle)
+{
+    del->timeout_heap[idx] = handle;
+    handle->heap_idx = idx + 1;
+}
+
+static void backend_heap_sift_up(struct backend_event_loop *del, uint32_t idx)
+{
+    struct backend_timeout_handle *handle = del->timeout_heap[idx];
+    uint32_t parent;
+
+    while (idx) {
+        parent = (idx - 1) / 2;
+
+        if (backend_timeout_deadline(del->timeout_heap[parent]) <=
+            backend_timeout_deadline(handle))
+            break;
 
-    //Move to a separate insert function
-    for (; itr != NULL; itr = itr->timeout_next.le_next) {
-        if (handle->timeout_clock < itr->timeout_clock)
+        backend_heap_set(del, idx, del->timeout_heap[parent]);
+        idx = parent;
+    }
+
+    backend_heap_set(del, idx, handle);
+}
+
+static void backend_heap_sift_down(struct backend_event_loop *del, uint32_t idx)
+{
+    struct backend_timeout_handle *handle = del->timeout_heap[idx];
+    uint32_t child;
+
+    while ((child = (2 * idx) + 1) < del->timeout_heap_len) {
+        if (child + 1 < del->timeout_heap_len &&
+            backend_timeout_deadline(del->timeout_heap[child + 1]) <
+            backend_timeout_deadline(del->timeout_heap[child]))
+            child++;
+
+        if (backend_timeout_deadline(handle) <=
+            backend_timeout_deadline(del->timeout_heap[child]))
             break;
 
-        prev_itr = itr;
+        backend_heap_set(del, idx, del->timeout_heap[child]);
+        idx = child;
     }
 
-    LIST_INSERT_AFTER(prev_itr, handle, timeout_next);
+    backend_heap_set(del, idx, handle);
+}
+
+static int32_t backend_heap_grow(struct backend_event_loop *del)
+{
+    uint32_t new_size = del->timeout_heap_size ?
+                        del->timeout_heap_size * 2 : BACKEND_TIMEOUT_HEAP_SIZE;
+    struct backend_timeout_handle **new_heap =
+        realloc(del->timeout_heap, new_size * sizeof(*new_heap));
+
+    if (!new_heap)
+        return -1;
+
+    del->timeout_heap = new_heap;
+    del->timeout_heap_size = new_size;
+
+    return 0;
+}
+
+static int32_t backend_heap_insert(struct backend_event_loop *del,
+                                   struct backend_timeout_handle *handle)
+{
+    uint32_t idx;
+
+    //Timer is already active, move it to its new position
+    if (handle->heap_idx) {
+        idx = handle->heap_idx - 1;
+
+        if (idx && backend_timeout_deadline(handle) <
+            backend_timeout_deadline(del->timeout_heap[(idx - 1) / 2]))
+            backend_heap_sift_up(del, idx);
+        else
+            backend_heap_sift_down(del, idx);
+
+        return 0;
+    }
+
+    if (del->timeout_heap_len == del->timeout_heap_size &&
+        backend_heap_grow(del))
+        return -1;
+
+    del->timeout_heap[del->timeout_heap_len] = handle;
+    backend_heap_sift_up(del, del->timeout_heap_len++);
+
+    return 0;
+}
+
+static void backend_heap_delete(struct backend_event_loop *del,
+                                struct backend_timeout_handle *timeout)
+{
+    uint32_t idx = timeout->heap_idx - 1;
+
+    timeout->heap_idx = 0;
+
+    //Move the last element into the hole and restore heap property. The last
+    //element can both be smaller (different subtree) or larger than the one
+    //we remove
+    if (idx != --del->timeout_heap_len) {
+        backend_heap_set(del, idx, del->timeout_heap[del->timeout_heap_len]);
+
+        if (idx && backend_timeout_deadline(del->timeout_heap[idx]) <
+            backend_timeout_deadline(del->timeout_heap[(idx - 1) / 2]))
+            backend_heap_sift_up(del, idx);
+        else
+            backend_heap_sift_down(del, idx);
+    }
+}
+
+//A timeout is stored in the level where the distance to the timeout fits, and
+//in the slot given by the bits of timeout_clock for that level. Timeouts in
+//level > 0 are cascaded (re-inserted) when the wheel reaches the start of their
+//slot, and will then end up in a lower level. If the timeout has slack, expiry
+//is rounded up to the largest power of two that fits inside the slack. Timeouts
+//with overlapping windows then share a tick (and often a slot in higher levels)
+static void backend_wheel_insert(struct backend_timer_wheel *wheel,
+                                 struct backend_timeout_handle *handle)
+{
+    uint64_t expires = handle->timeout_clock, delta, gran;
+    uint8_t level = 0, slot;
+
+    if (handle->slack) {
+        gran = 1ULL << (63 - __builtin_clzll((uint64_t) handle->slack + 1));
+        expires = (expires + gran - 1) & ~(gran - 1);
+    }
+
+    if (expires < wheel->cur_tick)
+        expires = wheel->cur_tick;
+
+    delta = expires - wheel->cur_tick;
+
+    while (level < BACKEND_WHEEL_LEVELS - 1 &&
+           delta >= (1ULL << (BACKEND_WHEEL_BITS * (level + 1))))
+        level++;
+
+    if (delta >= (1ULL << (BACKEND_WHEEL_BITS * BACKEND_WHEEL_LEVELS)))
+        expires = wheel->cur_tick +
+                  (1ULL << (BACKEND_WHEEL_BITS * BACKEND_WHEEL_LEVELS)) - 1;
+
+    slot = (expires >> (BACKEND_WHEEL_BITS * level)) & BACKEND_WHEEL_MASK;
+
+    handle->wheel_level = level;
+    handle->wheel_slot = slot;
+    LIST_INSERT_HEAD(&(wheel->slots[level][slot]), handle, wheel_next);
+    wheel->bitmap[level] |= (1ULL << slot);
+}
+
+static void backend_wheel_delete(struct backend_timer_wheel *wheel,
+                                 struct backend_timeout_handle *timeout)
+{
+    LIST_REMOVE(timeout, wheel_next);
+    timeout->wheel_next.le_next = NULL;
+    timeout->wheel_next.le_prev = NULL;
+
+    if (LIST_EMPTY(&(wheel->slots[timeout->wheel_level][timeout->wheel_slot])))
+        wheel->bitmap[timeout->wheel_level] &= ~(1ULL << timeout->wheel_slot);
+}
+
+//Return the next tick where the wheel has work to do, either expiring the
+//timeouts in a level 0 slot or cascading a slot in a higher level. The search
+//is done by rotating the bitmap of each level, so that bit 0 is the first slot
+//which will be processed
+static uint64_t backend_wheel_next_tick(struct backend_timer_wheel *wheel)
+{
+    uint64_t next_tick = UINT64_MAX, base, tick, bitmap;
+    uint8_t level, shift, idx;
+
+    for (level = 0; level < BACKEND_WHEEL_LEVELS; level++) {
+        if (!wheel->bitmap[level])
+            continue;
+
+        //First slot at this level which starts at or after cur_tick
+        shift = BACKEND_WHEEL_BITS * level;
+        base = (wheel->cur_tick + (1ULL << shift) - 1) >> shift;
+        idx = base & BACKEND_WHEEL_MASK;
+
+        bitmap = wheel->bitmap[level] >> idx;
+        if (idx)
+            bitmap |= wheel->bitmap[level] << (BACKEND_WHEEL_SLOTS - idx);
+
+        tick = (base + __builtin_ctzll(bitmap)) << shift;
+
+        if (tick < next_tick)
+            next_tick = tick;
+    }
+
+    return next_tick;
+}
+
+static void backend_wheel_cascade(struct backend_timer_wheel *wheel)
+{
+    struct backend_timeout_slot slot;
+    struct backend_timeout_handle *timeout;
+    uint8_t level, shift, idx;
+
+    for (level = 1; level < BACKEND_WHEEL_LEVELS; level++) {
+        shift = BACKEND_WHEEL_BITS * level;
+
+        if (wheel->cur_tick & ((1ULL << shift) - 1))
+            break;
+
+        idx = (wheel->cur_tick >> shift) & BACKEND_WHEEL_MASK;
+
+        if (!(wheel->bitmap[level] & (1ULL << idx)))
+            continue;
+
+        //Move the timeouts to a temporary list first, a re-inserted timeout
+        //never ends up in the slot we are cascading, but we want to be sure
+        slot.lh_first = wheel->slots[level][idx].lh_first;
+        slot.lh_first->wheel_next.le_prev = &(slot.lh_first);
+        LIST_INIT(&(wheel->slots[level][idx]));
+        wheel->bitmap[level] &= ~(1ULL << idx);
+
+        while (!LIST_EMPTY(&slot)) {
+            timeout = LIST_FIRST(&slot);
+            LIST_REMOVE(timeout, wheel_next);
+            backend_wheel_insert(wheel, timeout);
+        }
+    }
+}
+
+int32_t backend_insert_timeout(struct backend_event_loop *del,
+                               struct backend_timeout_handle *handle)
+{
+    handle->del = del;
+
+    if (!del->timer_wheel)
+        return backend_heap_insert(del, handle);
+
+    if (handle->wheel_next.le_prev)
+        backend_wheel_delete(del->timer_wheel, handle);
+
+    backend_wheel_insert(del->timer_wheel, handle);
+
+    return 0;
 }
 
 void backend_delete_timeout(struct backend_timeout_handle *timeout)
 {
-    //Timer is not active
-    if (!timeout->timeout_next.le_next &&
-        !timeout->timeout_next.le_prev) {
-        return;
+    if (timeout->heap_idx)
+        backend_heap_delete(timeout->del, timeout);
+    else if (timeout->wheel_next.le_prev)
+        backend_wheel_delete(timeout->del->timer_wheel, timeout);
+}
+
+void backend_timeout_set_slack(struct backend_timeout_handle *timeout,
+                               uint32_t slack)
+{
+    timeout->slack = slack;
+
+    if (backend_timeout_is_active(timeout))
+        backend_insert_timeout(timeout->del, timeout);
+}
+
+bool backend_timeout_is_active(struct backend_timeout_handle *timeout)
+{
+    return timeout->heap_idx || timeout->wheel_next.le_prev;
+}
+
+//Get the clock of the first timeout that will expire. Returns false if there
+//are no active timeouts. For the wheel, this might also be the time of the
+//next cascade, which is never later than the timeouts it contains. For the
+//heap, this is the earliest deadline so that we sleep as long as slack allows
+static bool backend_get_next_timeout(struct backend_event_loop *del,
+                                     uint64_t *next_clock)
+{
+    if (del->timer_wheel) {
+        *next_clock = backend_wheel_next_tick(del->timer_wheel);
+        return *next_clock != UINT64_MAX;
     }
 
-    LIST_REMOVE(timeout, timeout_next);
-    timeout->timeout_next.le_next = NULL;
-    timeout->timeout_next.le_prev = NULL;
+    if (!del->timeout_heap_len)
+        return false;
+
+    *next_clock = backend_timeout_deadline(del->timeout_heap[0]);
+    return true;
+}
+
+int32_t backend_event_loop_init_timeout(struct backend_event_loop *del,
+                                        struct backend_timeout_handle *handle,
+                                        uint64_t timeout_clock,
+                                        backend_timeout_cb timeout_cb,
+                                        void *ptr, uint32_t intvl)
+{
+    handle->timeout_clock = timeout_clock;
+    handle->cb = timeout_cb;
+    handle->data = ptr;
+    handle->intvl = intvl;
+    handle->auto_free = false;
+    handle->del = del;
+
+    if (timeout_clock)
+        return backend_insert_timeout(del, handle);
+
+    return 0;
 }
 
 struct backend_timeout_handle* backend_event_loop_add_timeout(
@@ -126,89 +473,420 @@ struct backend_timeout_handle* backend_event_loop_add_timeout(
         backend_timeout_cb timeout_cb, void *ptr, uint32_t intvl,
         bool free_after_use)
 {
-    //In an improved version, handle can be passed as argument so that it is up
-    //to application how to allocate it
     struct backend_timeout_handle *handle =
-        calloc(sizeof(struct backend_timeout_handle), 1);
+        backend_pool_alloc(&(del->timeout_pool));
 
     if (!handle)
         return NULL;
 
-    handle->timeout_clock = timeout_clock;
-    handle->cb = timeout_cb;
-    handle->data = ptr;
-    handle->intvl = intvl;
+    if (backend_event_loop_init_timeout(del, handle, timeout_clock, timeout_cb,
+                                        ptr, intvl)) {
+        backend_pool_free(&(del->timeout_pool), handle);
+        return NULL;
+    }
+
     handle->auto_free = free_after_use;
 
-    if (timeout_clock) {
-        backend_insert_timeout(del, handle);
+    return handle;
+}
+
+void backend_event_loop_free_timeout(struct backend_event_loop *del,
+                                     struct backend_timeout_handle *timeout)
+{
+    if (backend_timeout_is_active(timeout))
+        backend_delete_timeout(timeout);
+
+    backend_pool_free(&(del->timeout_pool), timeout);
+}
+
+static struct backend_cb_prof_table* backend_prof_get_table(
+        struct backend_event_loop *del)
+{
+    if (!del->prof)
+        del->prof = calloc(sizeof(struct backend_cb_prof_table), 1);
+
+    return del->prof;
+}
+
+//Find the entry of cb, and insert it if it is not in the table. Returns NULL if
+//the table is full
+static struct backend_cb_prof* backend_prof_get_entry(
+        struct backend_cb_prof_table *table, void *cb)
+{
+    uint32_t idx = ((uintptr_t) cb >> 2) * 2654435761U, i;
+    struct backend_cb_prof *entry;
+
+    for (i = 0; i < BACKEND_PROF_MAX_CB; i++) {
+        entry = &(table->entries[(idx + i) % BACKEND_PROF_MAX_CB]);
+
+        if (entry->cb == cb)
+            return entry;
+
+        if (!entry->cb) {
+            entry->cb = cb;
+            return entry;
+        }
     }
 
-    return handle;
+    return NULL;
+}
+
+static uint32_t backend_prof_bucket(uint64_t value)
+{
+    uint32_t exp, bucket;
+
+    if (value < BACKEND_PROF_SUB_BUCKETS)
+        return value;
+
+    exp = 63 - __builtin_clzll(value);
+    bucket = ((exp - BACKEND_PROF_SUB_BITS + 1) << BACKEND_PROF_SUB_BITS) +
+             ((value >> (exp - BACKEND_PROF_SUB_BITS)) &
+              (BACKEND_PROF_SUB_BUCKETS - 1));
+
+    return bucket < BACKEND_PROF_BUCKETS ? bucket : BACKEND_PROF_BUCKETS - 1;
+}
+
+//First value stored in bucket
+static uint64_t backend_prof_bucket_start(uint32_t bucket)
+{
+    uint32_t exp;
+
+    if (bucket < BACKEND_PROF_SUB_BUCKETS)
+        return bucket;
+
+    exp = (bucket >> BACKEND_PROF_SUB_BITS) + BACKEND_PROF_SUB_BITS - 1;
+
+    return ((uint64_t) (BACKEND_PROF_SUB_BUCKETS +
+                        (bucket & (BACKEND_PROF_SUB_BUCKETS - 1)))) <<
+           (exp - BACKEND_PROF_SUB_BITS);
+}
+
+int32_t backend_event_loop_enable_profiling(struct backend_event_loop *del,
+                                            uint32_t budget_ms,
+                                            backend_slow_cb slow_cb,
+                                            void *ptr)
+{
+    struct backend_cb_prof_table *table = backend_prof_get_table(del);
+
+    if (!table)
+        return -1;
+
+    table->budget_ns = budget_ms * 1000000ULL;
+    table->slow_cb = slow_cb;
+    table->slow_data = ptr;
+    table->enabled = 1;
+
+    return 0;
+}
+
+void backend_event_loop_set_cb_name(struct backend_event_loop *del, void *cb,
+                                    const char *name)
+{
+    struct backend_cb_prof_table *table = backend_prof_get_table(del);
+    struct backend_cb_prof *entry;
+
+    if (!table || !(entry = backend_prof_get_entry(table, cb)))
+        return;
+
+    entry->name = name;
+}
+
+uint64_t backend_cb_prof_percentile(const struct backend_cb_prof *prof,
+                                    uint8_t pct)
+{
+    uint64_t target = (prof->count * pct + 99) / 100, seen = 0;
+    uint32_t i;
+
+    if (!prof->count)
+        return 0;
+
+    for (i = 0; i < BACKEND_PROF_BUCKETS - 1; i++) {
+        seen += prof->hist[i];
+
+        if (seen >= target)
+            return backend_prof_bucket_start(i + 1) - 1;
+    }
+
+    return prof->max_ns / 1000;
+}
+
+static inline uint64_t backend_prof_start(struct backend_event_loop *del)
+{
+    return (del->prof && del->prof->enabled) ? backend_get_cur_time_ns() : 0;
+}
+
+static void backend_prof_end(struct backend_event_loop *del, void *cb,
+                             uint8_t type, uint64_t start)
+{
+    struct backend_cb_prof_table *table = del->prof;
+    struct backend_cb_prof *entry;
+    uint64_t duration;
+
+    if (!start)
+        return;
+
+    duration = backend_get_cur_time_ns() - start;
+
+    if (!(entry = backend_prof_get_entry(table, cb))) {
+        table->dropped++;
+        return;
+    }
+
+    entry->type = type;
+    entry->count++;
+    entry->total_ns += duration;
+    entry->hist[backend_prof_bucket(duration / 1000)]++;
+
+    if (duration > entry->max_ns)
+        entry->max_ns = duration;
+
+    if (table->budget_ns && duration > table->budget_ns) {
+        entry->over_budget++;
+
+        if (table->slow_cb)
+            table->slow_cb(table->slow_data, entry->name, cb, duration);
+    }
+}
+
+void backend_configure_itr_task(struct backend_itr_task *task,
+                                backend_itr_cb cb, void *ptr)
+{
+    task->cb = cb;
+    task->data = ptr;
+    task->queued = false;
+}
+
+void backend_event_loop_post_task(struct backend_event_loop *del,
+                                  struct backend_itr_task *task)
+{
+    if (task->queued)
+        return;
+
+    task->queued = true;
+    task->seq = del->task_seq++;
+    STAILQ_INSERT_TAIL(&(del->itr_tasks), task, task_next);
+}
+
+void backend_event_loop_cancel_task(struct backend_event_loop *del,
+                                    struct backend_itr_task *task)
+{
+    if (!task->queued)
+        return;
+
+    STAILQ_REMOVE(&(del->itr_tasks), task, backend_itr_task, task_next);
+    task->queued = false;
+}
+
+//Run the tasks that were queued when we started draining. A task can post
+//itself (or other tasks) again, those are left for the next iteration so that
+//a task that keeps re-posting itself can not starve the rest of the loop
+static void backend_event_loop_run_tasks(struct backend_event_loop *del)
+{
+    struct backend_itr_task *task;
+    uint32_t end_seq = del->task_seq;
+    backend_itr_cb cb;
+    uint64_t prof_start;
+
+    while ((task = STAILQ_FIRST(&(del->itr_tasks))) &&
+           (int32_t) (task->seq - end_seq) < 0) {
+        STAILQ_REMOVE_HEAD(&(del->itr_tasks), task_next);
+        task->queued = false;
+        cb = task->cb;
+        prof_start = backend_prof_start(del);
+        cb(task->data);
+        backend_prof_end(del, (void*) cb, BACKEND_CB_TASK, prof_start);
+    }
+}
+
+//last_clock is the timeout_clock of the previous timeout run in this wakeup,
+//UINT64_MAX if this is the first. It is only used for statistics
+static void backend_event_loop_fire_timeout(struct backend_event_loop *del,
+                                            struct backend_timeout_handle *timeout,
+                                            uint64_t cur_time,
+                                            uint64_t *last_clock)
+{
+    backend_timeout_cb cb = timeout->cb;
+    uint64_t prof_start;
+
+    if (*last_clock == UINT64_MAX)
+        del->stats.timer_wakeups++;
+    else if (timeout->slack && timeout->timeout_clock != *last_clock)
+        del->stats.wakeups_saved++;
+
+    *last_clock = timeout->timeout_clock;
+    del->stats.timers_run++;
+
+    //Remove and execute timeout
+    backend_delete_timeout(timeout);
+    prof_start = backend_prof_start(del);
+    cb(timeout->data);
+    backend_prof_end(del, (void*) cb, BACKEND_CB_TIMEOUT, prof_start);
+
+    //Rearm timer or free memory if we are done. The callback might have
+    //rearmed the timer itself, respect the value it chose
+    if (timeout->intvl) {
+        if (!backend_timeout_is_active(timeout)) {
+            timeout->timeout_clock = cur_time + timeout->intvl;
+
+            //Only fails if the heap could not be grown, the timer is then lost
+            if (backend_insert_timeout(del, timeout))
+                fprintf(stderr, "Failed to rearm periodic timeout\n");
+        }
+    } else if (timeout->auto_free && !backend_timeout_is_active(timeout)) {
+        backend_pool_free(&(del->timeout_pool), timeout);
+    }
+}
+
+static void backend_wheel_run(struct backend_event_loop *del, uint64_t cur_time,
+                              uint64_t *last_clock)
+{
+    struct backend_timer_wheel *wheel = del->timer_wheel;
+    struct backend_timeout_slot *slot;
+    uint64_t next_tick;
+
+    //Jump directly between the ticks where there is something to do, an idle
+    //wheel should not cost one iteration per ms
+    while (wheel->cur_tick <= cur_time) {
+        next_tick = backend_wheel_next_tick(wheel);
+
+        if (next_tick > cur_time) {
+            wheel->cur_tick = cur_time + 1;
+            break;
+        }
+
+        wheel->cur_tick = next_tick;
+        backend_wheel_cascade(wheel);
+
+        slot = &(wheel->slots[0][wheel->cur_tick & BACKEND_WHEEL_MASK]);
+
+        while (!LIST_EMPTY(slot))
+            backend_event_loop_fire_timeout(del, LIST_FIRST(slot), cur_time,
+                                            last_clock);
+
+        wheel->cur_tick++;
+    }
 }
 
 static void backend_event_loop_run_timers(struct backend_event_loop *del)
 {
-    struct backend_timeout_handle *timeout = del->timeout_list.lh_first;
     struct backend_timeout_handle *cur_timeout;
-    struct timespec tp;
-    uint64_t cur_time;
+    uint64_t cur_time = backend_get_cur_time();
+    uint64_t last_clock = UINT64_MAX;
 
-    clock_gettime(CLOCK_MONOTONIC_RAW, &tp);
-    cur_time = (tp.tv_sec * 1e3) + (tp.tv_nsec / 1e6);
-
-    while (timeout != NULL) {
-        if (timeout->timeout_clock <= cur_time) {
-            cur_timeout = timeout;
-            timeout = timeout->timeout_next.le_next;
-
-            //Remove and execute timeout
-            backend_delete_timeout(cur_timeout);
-            cur_timeout->cb(cur_timeout->data);
-
-            //Rearm timer or free memory if we are done
-            if (cur_timeout->intvl) {
-                cur_timeout->timeout_clock = cur_time + cur_timeout->intvl;
-                backend_insert_timeout(del, cur_timeout);
-            } else if (cur_timeout->auto_free) {
-                free(cur_timeout);
-            }
-        } else {
+    if (del->timer_wheel) {
+        backend_wheel_run(del, cur_time, &last_clock);
+        return;
+    }
+
+    //Run every timeout that has reached its timeout_clock, not only the ones
+    //that have reached their deadline. This is where the batching happens, the
+    //heap is ordered on deadline so we stop at the first timeout with the
+    //earliest deadline that is not yet ready
+    while (del->timeout_heap_len) {
+        cur_timeout = del->timeout_heap[0];
+
+        if (cur_timeout->timeout_clock > cur_time)
             break;
-        }
+
+        backend_event_loop_fire_timeout(del, cur_timeout, cur_time,
+                                        &last_clock);
+    }
+}
+
+void backend_event_loop_get_stats(struct backend_event_loop *del,
+                                  struct backend_event_loop_stats *stats)
+{
+    memcpy(stats, &(del->stats), sizeof(struct backend_event_loop_stats));
+}
+
+static void backend_event_loop_resize_events(struct backend_event_loop *del,
+                                             uint32_t new_size)
+{
+    struct epoll_event *new_events = realloc(del->events,
+                                             new_size * sizeof(*new_events));
+
+    //Keep the old array if realloc fails, it is still valid
+    if (!new_events)
+        return;
+
+    del->events = new_events;
+    del->events_size = new_size;
+    del->stats.events_size = new_size;
+}
+
+//Grow the event array when epoll_wait filled it, since there might be more
+//events waiting. Shrink it again when it has been mostly unused for a while, a
+//single burst should not make us keep a large array forever. Must not be called
+//while del->events is being processed
+static void backend_event_loop_adapt_events(struct backend_event_loop *del,
+                                            uint32_t nfds)
+{
+    if (nfds == del->events_size) {
+        del->events_low_itr = 0;
+        del->stats.full_waits++;
+
+        if (del->events_size < BACKEND_EPOLL_EVENTS_MAX)
+            backend_event_loop_resize_events(del, del->events_size * 2 >
+                    BACKEND_EPOLL_EVENTS_MAX ? BACKEND_EPOLL_EVENTS_MAX :
+                    del->events_size * 2);
+    } else if (del->events_size > MAX_EPOLL_EVENTS &&
+               nfds < del->events_size / 4) {
+        if (++del->events_low_itr < BACKEND_EPOLL_SHRINK_ITR)
+            return;
+
+        del->events_low_itr = 0;
+        backend_event_loop_resize_events(del, del->events_size / 2 <
+                MAX_EPOLL_EVENTS ? MAX_EPOLL_EVENTS : del->events_size / 2);
+    } else {
+        del->events_low_itr = 0;
     }
 }
 
 void backend_event_loop_run(struct backend_event_loop *del)
 {
     struct backend_epoll_handle *cur_handle, *usb_handle = NULL;
-    struct epoll_event events[MAX_EPOLL_EVENTS];
+    struct epoll_event *events;
+    backend_epoll_cb cb;
     int nfds, i, sleep_time;
 
-    struct timespec tp;
-    uint64_t cur_time;
-    struct backend_timeout_handle *timeout;
+    uint64_t cur_time, next_clock, wait_start, dispatch_start, prof_start;
+    bool timeout;
 
     while(1){
         usb_handle = NULL;
-        timeout = del->timeout_list.lh_first;
-        clock_gettime(CLOCK_MONOTONIC_RAW, &tp);
-        cur_time = (tp.tv_sec * 1e3) + (tp.tv_nsec / 1e6);
-       
-        if (timeout != NULL) {
-            if (cur_time > timeout->timeout_clock)
+        timeout = backend_get_next_timeout(del, &next_clock);
+        cur_time = backend_get_cur_time();
+
+        //Tasks that were posted by the tasks of the previous iteration are
+        //waiting, do not sleep
+        if (!STAILQ_EMPTY(&(del->itr_tasks))) {
+            sleep_time = 0;
+        } else if (timeout) {
+            if (cur_time > next_clock)
                 sleep_time = 0;
             else
-                sleep_time = timeout->timeout_clock - cur_time;
+                sleep_time = next_clock - cur_time;
         } else {
             sleep_time = -1;
         }
 
-		nfds = epoll_wait(del->efd, events, MAX_EPOLL_EVENTS, sleep_time);
+        events = del->events;
+        wait_start = backend_get_cur_time_ns();
+		nfds = epoll_wait(del->efd, events, del->events_size, sleep_time);
+        dispatch_start = backend_get_cur_time_ns();
 
 		if (nfds < 0)
 			continue;
 
+        del->stats.iterations++;
+        del->stats.events += nfds;
+        del->stats.last_events = nfds;
+        del->stats.last_wait_ns = dispatch_start - wait_start;
+        del->stats.wait_ns += del->stats.last_wait_ns;
+
+        if (nfds > del->stats.max_events)
+            del->stats.max_events = nfds;
+
         //TODO: Make sure the order of processing is safe wrt event caching and
         //so on. I can't think of any problems right now, since we will not for
         //example free a device in the internal libusb_list. So a USB event will
@@ -217,7 +895,7 @@ void backend_event_loop_run(struct backend_event_loop *del)
 
         //No callbacks have been called between last timeout check and here, so
         //I can recycle timeout value
-        if (timeout != NULL)
+        if (timeout)
             backend_event_loop_run_timers(del);
 
         for(i=0; i<nfds; i++) {
@@ -227,17 +905,27 @@ void backend_event_loop_run(struct backend_event_loop *del)
                 usb_handle = cur_handle;
                 continue;
             } else {
-                cur_handle->cb(cur_handle->data, cur_handle->fd, events[i].events);
+                cb = cur_handle->cb;
+                prof_start = backend_prof_start(del);
+                cb(cur_handle->data, cur_handle->fd, events[i].events);
+                backend_prof_end(del, (void*) cb, BACKEND_CB_FD, prof_start);
             }
         }
 
         //We should only run usb_handle once per loop. Keeping it here makes it
         //easier also when I remove descriptors
-        if (usb_handle)
+        if (usb_handle) {
+            prof_start = backend_prof_start(del);
             usb_handle->cb(usb_handle->data, usb_handle->fd, 0);
-
-        if (del->itr_cb != NULL) {
-            del->itr_cb(del->itr_data);
+            backend_prof_end(del, (void*) usb_handle->cb, BACKEND_CB_FD,
+                             prof_start);
         }
+
+        backend_event_loop_run_tasks(del);
+
+        del->stats.last_dispatch_ns = backend_get_cur_time_ns() - dispatch_start;
+        del->stats.dispatch_ns += del->stats.last_dispatch_ns;
+
+        backend_event_loop_adapt_events(del, nfds);
     }
 }
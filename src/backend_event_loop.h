@@ -18,9 +18,47 @@
 #define BACKEND_EVENT_LOOP_H
 
 #include <sys/queue.h>
+#include <stdint.h>
 #include <stdbool.h>
 
+#include "backend_pool.h"
+
+struct epoll_event;
+
+//Initial size of the array passed to epoll_wait. The array is doubled (up to
+//BACKEND_EPOLL_EVENTS_MAX) when a wait fills it, and halved again after
+//BACKEND_EPOLL_SHRINK_ITR iterations in a row where less than a quarter is used
 #define MAX_EPOLL_EVENTS 10
+#define BACKEND_EPOLL_EVENTS_MAX 320
+#define BACKEND_EPOLL_SHRINK_ITR 128
+//Initial number of slots in the timeout heap, heap doubles when full
+#define BACKEND_TIMEOUT_HEAP_SIZE 64
+
+//The timing wheel has BACKEND_WHEEL_LEVELS levels with 64 slots each. A tick is
+//one ms, so level 0 covers 64 ms, level 1 ~4 sec, level 2 ~4 min and so on. Six
+//levels cover ~2 years, timeouts further away are clamped and re-filed
+#define BACKEND_WHEEL_BITS 6
+#define BACKEND_WHEEL_SLOTS (1 << BACKEND_WHEEL_BITS)
+#define BACKEND_WHEEL_MASK (BACKEND_WHEEL_SLOTS - 1)
+#define BACKEND_WHEEL_LEVELS 6
+
+//Flags for backend_event_loop_create(). Default is to use the timeout heap
+#define BACKEND_FLAG_TIMER_WHEEL 0x01
+
+//Callback profiling. Every callback run by the loop is timed and the duration
+//is stored in a log-linear (HDR-style) histogram of us. Values below
+//BACKEND_PROF_SUB_BUCKETS get their own bucket, after that every power of two
+//is split into BACKEND_PROF_SUB_BUCKETS buckets (~25% precision). The last
+//bucket also contains everything that is larger (>2 min)
+#define BACKEND_PROF_SUB_BITS 2
+#define BACKEND_PROF_SUB_BUCKETS (1 << BACKEND_PROF_SUB_BITS)
+#define BACKEND_PROF_BUCKETS 108
+//Max. number of distinct callbacks that are profiled
+#define BACKEND_PROF_MAX_CB 32
+
+#define BACKEND_CB_FD      0
+#define BACKEND_CB_TIMEOUT 1
+#define BACKEND_CB_TASK    2
 
 //Any resource used by the callback is stored in the implementing "class".
 //Assume one separate callback function per type of event
@@ -29,6 +67,10 @@
 typedef void(*backend_epoll_cb)(void *ptr, int32_t fd, uint32_t events);
 typedef void(*backend_timeout_cb)(void *ptr);
 typedef backend_timeout_cb backend_itr_cb;
+//Called after a callback has used more than the budget. name is NULL if no
+//name has been registered for the callback
+typedef void(*backend_slow_cb)(void *ptr, const char *name, void *cb,
+                               uint64_t duration_ns);
 
 struct backend_epoll_handle{
     void *data;
@@ -43,52 +85,216 @@ struct backend_epoll_handle{
 };
 
 //timeout_clock is first timeout in wallclock (ms), intvl is frequency after
-//that. Set to 0 if no repeat is needed
+//that. Set to 0 if no repeat is needed. slack (ms) is how much later than
+//timeout_clock the timeout is allowed to fire, timeouts whose windows overlap
+//are then run in the same wakeup. heap_idx is the position of the handle
+//in the timeout heap + 1, so that 0 means that the timeout is not active. When
+//the timing wheel is used, wheel_next is used instead of heap_idx. del is set
+//when the timeout is inserted and is needed to delete the timeout
 struct backend_timeout_handle{
     uint64_t timeout_clock;
     backend_timeout_cb cb;
-    LIST_ENTRY(backend_timeout_handle) timeout_next;
-    uint32_t intvl;
+    struct backend_event_loop *del;
     void *data;
+    LIST_ENTRY(backend_timeout_handle) wheel_next;
+    uint32_t heap_idx;
+    uint32_t intvl;
+    uint32_t slack;
+    uint8_t wheel_level;
+    uint8_t wheel_slot;
     bool auto_free;
 };
 
+LIST_HEAD(backend_timeout_slot, backend_timeout_handle);
+
+//Deferred work that is run after the file descriptors have been handled in an
+//iteration of the event loop. The task is embedded in the struct of the owner,
+//so posting a task never allocates. A task can only be queued once, posting an
+//already queued task is a no-op. seq is used to make sure that tasks posted
+//while the queue is drained are run in the next iteration
+struct backend_itr_task{
+    backend_itr_cb cb;
+    void *data;
+    STAILQ_ENTRY(backend_itr_task) task_next;
+    uint32_t seq;
+    bool queued;
+};
+
+STAILQ_HEAD(backend_task_queue, backend_itr_task);
+
+//Hashed hierarchical timing wheel. bitmap contains one bit per non-empty slot,
+//so that we can find the next timeout without walking the slots. cur_tick is
+//the next tick (ms) to be processed
+struct backend_timer_wheel{
+    struct backend_timeout_slot slots[BACKEND_WHEEL_LEVELS][BACKEND_WHEEL_SLOTS];
+    uint64_t bitmap[BACKEND_WHEEL_LEVELS];
+    uint64_t cur_tick;
+};
+
+//Counters for the event loop. Durations are in ns, the last_* values are for
+//the most recent iteration. timer_wakeups is the number of wakeups where at
+//least one timeout was run. wakeups_saved is an estimate of how many wakeups we
+//avoided thanks to slack, i.e., timeouts with slack that ran together with a
+//timeout with a different timeout_clock
+struct backend_event_loop_stats{
+    uint64_t iterations;
+    uint64_t events;
+    uint64_t full_waits;
+    uint64_t wait_ns;
+    uint64_t dispatch_ns;
+    uint64_t last_wait_ns;
+    uint64_t last_dispatch_ns;
+    uint64_t timer_wakeups;
+    uint64_t timers_run;
+    uint64_t wakeups_saved;
+    uint32_t last_events;
+    uint32_t max_events;
+    uint32_t events_size;
+};
+
+//Statistics for one callback. cb is the key, NULL means unused
+struct backend_cb_prof{
+    void *cb;
+    const char *name;
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t over_budget;
+    uint32_t hist[BACKEND_PROF_BUCKETS];
+    uint8_t type;
+};
+
+//Open addressing table of callbacks, keyed on callback address. Profiling is
+//only done when enabled is set, but names can be registered before
+struct backend_cb_prof_table{
+    struct backend_cb_prof entries[BACKEND_PROF_MAX_CB];
+    backend_slow_cb slow_cb;
+    void *slow_data;
+    uint64_t budget_ns;
+    uint64_t dropped;
+    uint8_t enabled;
+};
+
+//By default, timeouts are stored in a binary min-heap ordered on timeout_clock.
+//Every handle knows its own index, so insert, delete and rearm are all
+//O(log n). If timer_wheel is set, timeouts are stored in the wheel instead and
+//arm/cancel is O(1)
 struct backend_event_loop{
     int32_t efd;
-    LIST_HEAD(timeout, backend_timeout_handle) timeout_list;
-    backend_itr_cb itr_cb;
-    void *itr_data;
+    struct epoll_event *events;
+    struct backend_timeout_handle **timeout_heap;
+    struct backend_timer_wheel *timer_wheel;
+    struct backend_event_loop_stats stats;
+    struct backend_cb_prof_table *prof;
+    struct backend_task_queue itr_tasks;
+    struct backend_pool epoll_pool;
+    struct backend_pool timeout_pool;
+    uint32_t events_size;
+    uint32_t events_low_itr;
+    uint32_t timeout_heap_len;
+    uint32_t timeout_heap_size;
+    uint32_t task_seq;
 };
 
-//Create an backend_event_loop struct
-//TODO: Currently, allocations are made from heap. Add support for using
-//deciding how the struct should be allocated. This also applies to
-//backend_create_epoll_handle()
-struct backend_event_loop* backend_event_loop_create();
+//Create an backend_event_loop struct. flags is a combination of the
+//BACKEND_FLAG_* values. Epoll and timeout handles created by the loop are
+//allocated from pools owned by the loop
+struct backend_event_loop* backend_event_loop_create(uint32_t flags);
+
+//Free del and everything allocated by it. Handles from the pools are invalid
+//after this. File descriptors added to the loop are not closed
+void backend_event_loop_destroy(struct backend_event_loop *del);
 
 //Update file descriptor + ptr to efd in events according to op
 int32_t backend_event_loop_update(struct backend_event_loop *del, uint32_t events,
         int32_t op, int32_t fd, void *ptr);
 
-//For when we need to manually need to handle our timeouts
-void backend_insert_timeout(struct backend_event_loop *del,
-                            struct backend_timeout_handle *handle);
+//For when we need to manually need to handle our timeouts. Inserting a
+//timeout that is already active moves it to the new timeout_clock (rearm).
+//Insert returns 0 on success and -1 if the heap could not be grown
+int32_t backend_insert_timeout(struct backend_event_loop *del,
+                               struct backend_timeout_handle *handle);
 void backend_delete_timeout(struct backend_timeout_handle *timeout);
 
-//Add a timeout which is controlled by main loop
+//Set the slack of a timeout (ms). If the timeout is active, it is moved
+//according to the new slack
+void backend_timeout_set_slack(struct backend_timeout_handle *timeout,
+                               uint32_t slack);
+
+//Returns true if timeout is currently waiting to expire
+bool backend_timeout_is_active(struct backend_timeout_handle *timeout);
+
+//Add a timeout which is controlled by main loop. The handle is allocated from
+//the timeout pool of del. If free_after_use is set, the handle is returned to
+//the pool after the timeout has fired (unless it was rearmed)
 struct backend_timeout_handle* backend_event_loop_add_timeout(
         struct backend_event_loop *del, uint64_t timeout_clock,
         backend_timeout_cb timeout_cb, void *ptr,
         uint32_t intvl, bool free_after_use);
 
+//Same as add_timeout, but handle is provided (and owned) by the caller. The
+//timeout is only inserted if timeout_clock is non-zero. Returns the same as
+//backend_insert_timeout()
+int32_t backend_event_loop_init_timeout(struct backend_event_loop *del,
+                                        struct backend_timeout_handle *handle,
+                                        uint64_t timeout_clock,
+                                        backend_timeout_cb timeout_cb,
+                                        void *ptr, uint32_t intvl);
+
+//Delete (if active) and return a handle created by add_timeout to the pool
+void backend_event_loop_free_timeout(struct backend_event_loop *del,
+                                     struct backend_timeout_handle *timeout);
+
+//Fill task with cb and ptr. Must be called before the task is posted
+void backend_configure_itr_task(struct backend_itr_task *task,
+                                backend_itr_cb cb, void *ptr);
+
+//Queue task to be run at the end of the current iteration of the event loop.
+//Tasks are run in the order they were posted. If a task is posted from a task,
+//it is run in the next iteration (the loop will not sleep in between)
+void backend_event_loop_post_task(struct backend_event_loop *del,
+                                  struct backend_itr_task *task);
+
+//Remove task from the queue, if it is queued
+void backend_event_loop_cancel_task(struct backend_event_loop *del,
+                                    struct backend_itr_task *task);
+
+//Copy the current counters of the event loop into stats
+void backend_event_loop_get_stats(struct backend_event_loop *del,
+                                  struct backend_event_loop_stats *stats);
+
+//Start profiling callbacks. If budget_ms is > 0, slow_cb is called every time
+//a callback runs for longer than the budget. Returns 0 on success, -1 if the
+//profiling table could not be allocated
+int32_t backend_event_loop_enable_profiling(struct backend_event_loop *del,
+                                            uint32_t budget_ms,
+                                            backend_slow_cb slow_cb,
+                                            void *ptr);
+
+//Register a human readable name for a callback (the function address). name
+//must stay valid for as long as the event loop exists
+void backend_event_loop_set_cb_name(struct backend_event_loop *del, void *cb,
+                                    const char *name);
+
+//Return the upper limit (in us) of the bucket that contains the pct
+//percentile of prof
+uint64_t backend_cb_prof_percentile(const struct backend_cb_prof *prof,
+                                    uint8_t pct);
+
 //Fill handle with ptr, fd, and cb. Used by create_epoll_handle and can be used
 //by applications that use a different allocater for handle
 void backend_configure_epoll_handle(struct backend_epoll_handle *handle,
 		void *ptr, int fd, backend_epoll_cb cb);
 
-//Create (allocate) a new epoll handle and return it
-struct backend_epoll_handle* backend_create_epoll_handle(void *ptr, int fd,
-        backend_epoll_cb cb, uint8_t libusb_fd);
+//Create (allocate from the pool of del) a new epoll handle and return it
+struct backend_epoll_handle* backend_create_epoll_handle(
+        struct backend_event_loop *del, void *ptr, int fd, backend_epoll_cb cb,
+        uint8_t libusb_fd);
+
+//Return a handle created by create_epoll_handle to the pool. The fd must have
+//been removed from the loop first
+void backend_free_epoll_handle(struct backend_event_loop *del,
+                               struct backend_epoll_handle *handle);
 
 //Run event loop described by efd. Let it be up to the user how efd shall be
 //stored
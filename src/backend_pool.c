@@ -0,0 +1,98 @@
+/*
+ * Copyright 2015 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Usb Monitor. Usb Monitor is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * Usb Montior is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Usb Monitor. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "backend_pool.h"
+
+void backend_pool_init(struct backend_pool *pool, size_t obj_size,
+                       uint32_t objs_per_slab)
+{
+    memset(pool, 0, sizeof(struct backend_pool));
+
+    //A free object stores the pointer to the next free object, and the
+    //objects must be aligned in the slab
+    if (obj_size < sizeof(void*))
+        obj_size = sizeof(void*);
+
+    pool->obj_size = (obj_size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+    pool->objs_per_slab = objs_per_slab ? objs_per_slab : 1;
+}
+
+void backend_pool_destroy(struct backend_pool *pool)
+{
+    struct backend_pool_slab *slab;
+
+    while ((slab = pool->slabs)) {
+        pool->slabs = slab->next;
+        free(slab);
+    }
+
+    pool->free_list = NULL;
+    pool->num_slabs = 0;
+    pool->num_used = 0;
+}
+
+static int32_t backend_pool_grow(struct backend_pool *pool)
+{
+    struct backend_pool_slab *slab;
+    uint8_t *obj;
+    uint32_t i;
+
+    //The header is the size of a pointer, so objects stay aligned
+    slab = malloc(sizeof(struct backend_pool_slab) +
+                  (pool->obj_size * pool->objs_per_slab));
+
+    if (!slab)
+        return -1;
+
+    slab->next = pool->slabs;
+    pool->slabs = slab;
+    pool->num_slabs++;
+
+    obj = (uint8_t*) (slab + 1);
+
+    for (i = 0; i < pool->objs_per_slab; i++) {
+        *((void**) obj) = pool->free_list;
+        pool->free_list = obj;
+        obj += pool->obj_size;
+    }
+
+    return 0;
+}
+
+void* backend_pool_alloc(struct backend_pool *pool)
+{
+    void *obj;
+
+    if (!pool->free_list && backend_pool_grow(pool))
+        return NULL;
+
+    obj = pool->free_list;
+    pool->free_list = *((void**) obj);
+    pool->num_used++;
+
+    memset(obj, 0, pool->obj_size);
+    return obj;
+}
+
+void backend_pool_free(struct backend_pool *pool, void *obj)
+{
+    *((void**) obj) = pool->free_list;
+    pool->free_list = obj;
+    pool->num_used--;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright 2015 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Usb Monitor. Usb Monitor is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * Usb Montior is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Usb Monitor. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef BACKEND_POOL_H
+#define BACKEND_POOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+//Number of objects in each slab, a new slab is allocated when the pool is empty
+#define BACKEND_POOL_SLAB_OBJS 32
+
+//A slab is a header followed by objs_per_slab objects
+struct backend_pool_slab{
+    struct backend_pool_slab *next;
+};
+
+//Pool of fixed size objects. Free objects are kept in a list that is stored
+//inside the objects themselves. Memory is allocated one slab at a time and is
+//never given back before the pool is destroyed, so once the pool has grown to
+//the peak number of objects, alloc/free never touches the heap
+struct backend_pool{
+    struct backend_pool_slab *slabs;
+    void *free_list;
+    size_t obj_size;
+    uint32_t objs_per_slab;
+    uint32_t num_slabs;
+    uint32_t num_used;
+};
+
+void backend_pool_init(struct backend_pool *pool, size_t obj_size,
+                       uint32_t objs_per_slab);
+
+//Free all slabs. Objects from the pool are invalid after this
+void backend_pool_destroy(struct backend_pool *pool);
+
+//Get a zeroed object from the pool, NULL if a new slab could not be allocated
+void* backend_pool_alloc(struct backend_pool *pool);
+
+//Return object to pool. obj must have been allocated from the same pool
+void backend_pool_free(struct backend_pool *pool, void *obj);
+#endif
@@ -0,0 +1,150 @@
+/*
+ * Copyright 2015 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Usb Monitor. Usb Monitor is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * Usb Montior is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Usb Monitor. If not, see http://www.gnu.org/licenses/.
+ */
+
+
+//Benchmark of port path lookups with usb_monitor_hash, compared to scanning a
+//list of paths with memcmp (how usb_monitor_lists_find_port_path() used to
+//work). The paths are bus + four levels of 7-port hubs, and are looked up in
+//random order. Prints the average cost of a lookup in ns
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+#include "../usb_monitor_hash.h"
+
+#define BENCH_PATH_LEN 5
+#define BENCH_HUB_PORTS 7
+#define BENCH_LOOKUPS 1000000
+//Every scan lookup walks half of the list, so the scan does fewer
+#define BENCH_SCAN_LOOKUPS 10000
+
+static const uint32_t bench_num_ports[] = {10, 100, 1000, 10000, 50000};
+
+static uint64_t bench_rand_state = 88172645463325252ULL;
+
+//xorshift64, so that every run uses the same paths
+static uint64_t bench_rand()
+{
+    bench_rand_state ^= bench_rand_state << 13;
+    bench_rand_state ^= bench_rand_state >> 7;
+    bench_rand_state ^= bench_rand_state << 17;
+    return bench_rand_state;
+}
+
+static uint64_t bench_get_time_ns()
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &tp);
+    return (tp.tv_sec * 1000000000ULL) + tp.tv_nsec;
+}
+
+//Port number i is i in base BENCH_HUB_PORTS, one digit per hub level
+static void bench_fill_path(uint32_t i, uint8_t *path)
+{
+    uint32_t ports_per_bus = 1, j;
+
+    for (j = 1; j < BENCH_PATH_LEN; j++)
+        ports_per_bus *= BENCH_HUB_PORTS;
+
+    path[0] = 1 + (i / ports_per_bus);
+
+    for (j = BENCH_PATH_LEN - 1; j > 0; j--) {
+        path[j] = 1 + (i % BENCH_HUB_PORTS);
+        i /= BENCH_HUB_PORTS;
+    }
+}
+
+//Same packing as usb_monitor_lists_path_key()
+static uint64_t bench_path_key(const uint8_t *path)
+{
+    uint64_t key = 0;
+
+    memcpy(&key, path, BENCH_PATH_LEN);
+    return key;
+}
+
+static void bench_lookup(uint32_t num_ports)
+{
+    struct usb_monitor_hash hash;
+    uint8_t (*paths)[BENCH_PATH_LEN] = calloc(num_ports, BENCH_PATH_LEN);
+    uint32_t *order = calloc(BENCH_LOOKUPS, sizeof(uint32_t));
+    uint64_t start, hash_ns, scan_ns;
+    uint32_t i, j, found = 0;
+
+    if (!paths || !order || usb_monitor_hash_init(&hash)) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < num_ports; i++) {
+        bench_fill_path(i, paths[i]);
+
+        //Value is never dereferenced, it only has to be non-NULL
+        if (usb_monitor_hash_insert(&hash, bench_path_key(paths[i]),
+                                    paths[i])) {
+            fprintf(stderr, "Failed to insert path\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (i = 0; i < BENCH_LOOKUPS; i++)
+        order[i] = bench_rand() % num_ports;
+
+    start = bench_get_time_ns();
+    for (i = 0; i < BENCH_LOOKUPS; i++)
+        found += usb_monitor_hash_find(&hash,
+                                       bench_path_key(paths[order[i]])) != NULL;
+    hash_ns = bench_get_time_ns() - start;
+
+    start = bench_get_time_ns();
+    for (i = 0; i < BENCH_SCAN_LOOKUPS; i++) {
+        for (j = 0; j < num_ports; j++) {
+            if (!memcmp(paths[j], paths[order[i]], BENCH_PATH_LEN)) {
+                found++;
+                break;
+            }
+        }
+    }
+    scan_ns = bench_get_time_ns() - start;
+
+    if (found != BENCH_LOOKUPS + BENCH_SCAN_LOOKUPS) {
+        fprintf(stderr, "Lookup failed\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%7u %10.1f %12.1f\n", num_ports,
+           (double) hash_ns / BENCH_LOOKUPS,
+           (double) scan_ns / BENCH_SCAN_LOOKUPS);
+
+    usb_monitor_hash_destroy(&hash);
+    free(order);
+    free(paths);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t i;
+
+    printf("%7s %10s %12s\n", "ports", "hash_ns", "scan_ns");
+
+    for (i = 0; i < sizeof(bench_num_ports) / sizeof(bench_num_ports[0]); i++)
+        bench_lookup(bench_num_ports[i]);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,269 @@
+/*
+ * Copyright 2015 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Usb Monitor. Usb Monitor is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * Usb Montior is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Usb Monitor. If not, see http://www.gnu.org/licenses/.
+ */
+
+
+//Benchmark of scanning the port list, the way usb_helpers_reset_all_ports()
+//does, with struct usb_port compared to the field order usb_port had before
+//the hot fields were moved to the start of the struct. The old layout has the
+//same fields, but keeps the baseline order with the fields that were added
+//later placed before the list link. Ports are stored in one array, like the
+//ports of a hub, and are linked either in array order or in random order
+//(ports are added as hubs and devices show up). Prints the average cost of
+//visiting a port in ns
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "../usb_monitor.h"
+
+#define BENCH_NUM_PORTS 10000
+#define BENCH_SCANS 1000
+
+struct bench_port_old {
+    struct usb_hub *parent;
+    struct usb_monitor_ctx *ctx;
+    libusb_device *dev;
+    libusb_device_handle *dev_handle;
+    union usb_path path[MAX_NUM_PATHS];
+    print_port output;
+    update_port update;
+    handle_timeout timeout;
+    struct backend_timeout_handle timeout_handle;
+    struct {
+        uint16_t vid;
+        uint16_t pid;
+    } vp;
+    uint8_t status;
+    uint8_t enabled;
+    uint8_t pwr_state;
+    uint8_t msg_mode;
+    uint8_t path_len[MAX_NUM_PATHS];
+    uint8_t num_retrans;
+    uint8_t ping_cnt;
+    uint8_t port_num;
+    uint8_t port_type;
+    uint8_t ping_buf[LIBUSB_CONTROL_SETUP_SIZE + 2];
+    struct libusb_transfer *ping_transfer;
+    TAILQ_ENTRY(bench_port_old) ping_next;
+    TAILQ_ENTRY(bench_port_old) handle_next;
+    uint64_t sysfs_urbnum;
+    uint64_t ping_submit_us;
+    uint32_t rtt_last_us;
+    uint32_t rtt_ewma_us;
+    uint16_t rtt_hist[USB_RTT_BUCKETS];
+    uint64_t restart_after_ms;
+    uint64_t backoff_mark_ms;
+    uint32_t ping_interval_ms;
+    uint32_t ping_max_interval_ms;
+    uint32_t ping_cur_interval_ms;
+    uint32_t ping_timeout_ms;
+    int32_t sysfs_fd[USB_SYSFS_MAX_FDS];
+    uint8_t ping_state;
+    uint8_t probe_type;
+    uint8_t num_restarts;
+    uint8_t retrans_limit;
+    LIST_ENTRY(bench_port_old) port_next;
+};
+
+LIST_HEAD(bench_old_list, bench_port_old);
+
+//The old layout must have the same fields as struct usb_port, otherwise the
+//comparison is meaningless. A field that is renamed, removed or changes size
+//breaks the build here, and a new field changes the size of struct usb_port
+#define BENCH_SAME_FIELD(field) \
+    _Static_assert(sizeof(((struct bench_port_old*) 0)->field) == \
+                   sizeof(((struct usb_port*) 0)->field), #field)
+
+BENCH_SAME_FIELD(parent); BENCH_SAME_FIELD(ctx); BENCH_SAME_FIELD(dev);
+BENCH_SAME_FIELD(dev_handle); BENCH_SAME_FIELD(path); BENCH_SAME_FIELD(output);
+BENCH_SAME_FIELD(update); BENCH_SAME_FIELD(timeout);
+BENCH_SAME_FIELD(timeout_handle); BENCH_SAME_FIELD(vp);
+BENCH_SAME_FIELD(status); BENCH_SAME_FIELD(enabled);
+BENCH_SAME_FIELD(pwr_state); BENCH_SAME_FIELD(msg_mode);
+BENCH_SAME_FIELD(path_len); BENCH_SAME_FIELD(num_retrans);
+BENCH_SAME_FIELD(ping_cnt); BENCH_SAME_FIELD(port_num);
+BENCH_SAME_FIELD(port_type); BENCH_SAME_FIELD(ping_buf);
+BENCH_SAME_FIELD(ping_transfer); BENCH_SAME_FIELD(ping_next);
+BENCH_SAME_FIELD(handle_next); BENCH_SAME_FIELD(sysfs_urbnum);
+BENCH_SAME_FIELD(ping_submit_us); BENCH_SAME_FIELD(rtt_last_us);
+BENCH_SAME_FIELD(rtt_ewma_us); BENCH_SAME_FIELD(rtt_hist);
+BENCH_SAME_FIELD(restart_after_ms); BENCH_SAME_FIELD(backoff_mark_ms);
+BENCH_SAME_FIELD(ping_interval_ms); BENCH_SAME_FIELD(ping_max_interval_ms);
+BENCH_SAME_FIELD(ping_cur_interval_ms); BENCH_SAME_FIELD(ping_timeout_ms);
+BENCH_SAME_FIELD(sysfs_fd); BENCH_SAME_FIELD(ping_state);
+BENCH_SAME_FIELD(probe_type); BENCH_SAME_FIELD(num_restarts);
+BENCH_SAME_FIELD(retrans_limit); BENCH_SAME_FIELD(port_next);
+
+_Static_assert(sizeof(struct bench_port_old) == sizeof(struct usb_port),
+               "bench_port_old is out of sync with struct usb_port");
+
+//The hot fields must stay within the first two cache lines on 64-bit
+_Static_assert(sizeof(void*) != 8 ||
+               offsetof(struct usb_port, path_len) + MAX_NUM_PATHS <= 128,
+               "hot fields of struct usb_port do not fit in 128 bytes");
+
+static uint64_t bench_rand_state = 88172645463325252ULL;
+
+//xorshift64, so that every run uses the same order and port states
+static uint64_t bench_rand()
+{
+    bench_rand_state ^= bench_rand_state << 13;
+    bench_rand_state ^= bench_rand_state >> 7;
+    bench_rand_state ^= bench_rand_state << 17;
+    return bench_rand_state;
+}
+
+static uint64_t bench_get_time_ns()
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &tp);
+    return (tp.tv_sec * 1000000000ULL) + tp.tv_nsec;
+}
+
+//Insert order of the ports, a random permutation of the indexes if shuffle is
+//set. The list is built with LIST_INSERT_HEAD, so the order is reversed
+static uint32_t *bench_get_order(uint32_t num_ports, uint8_t shuffle)
+{
+    uint32_t *order = calloc(num_ports, sizeof(uint32_t));
+    uint32_t i, j, tmp;
+
+    if (!order) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < num_ports; i++)
+        order[i] = num_ports - i - 1;
+
+    for (i = num_ports - 1; shuffle && i > 0; i--) {
+        j = bench_rand() % (i + 1);
+        tmp = order[i];
+        order[i] = order[j];
+        order[j] = tmp;
+    }
+
+    return order;
+}
+
+//Same checks as usb_helpers_reset_all_ports(), the timer is checked as well
+//since most port operations start by checking/deleting the port timeout
+#define BENCH_SCAN(list, field, count) \
+    do { \
+        count = 0; \
+        LIST_FOREACH(itr, list, field) { \
+            if (itr->msg_mode == RESET || !itr->enabled || \
+                itr->msg_mode == PROBE) \
+                continue; \
+            if (itr->status == PORT_NO_DEV_CONNECTED && \
+                !backend_timeout_is_active(&(itr->timeout_handle))) \
+                count++; \
+        } \
+    } while (0)
+
+static void bench_print(const char *layout, uint8_t shuffle, size_t size,
+                        size_t hot_start, size_t hot_end, uint64_t scan_ns,
+                        uint32_t num_ports, uint32_t count)
+{
+    printf("%6s %6s %6zu %10zu %10.2f %8u\n", layout,
+           shuffle ? "random" : "array", size, hot_end - hot_start,
+           (double) scan_ns / ((uint64_t) BENCH_SCANS * num_ports), count);
+}
+
+static void bench_scan(uint32_t num_ports, uint8_t shuffle)
+{
+    struct bench_port_old *old_ports = calloc(num_ports,
+                                              sizeof(struct bench_port_old));
+    struct usb_port *new_ports = calloc(num_ports, sizeof(struct usb_port));
+    uint32_t *order = bench_get_order(num_ports, shuffle);
+    struct bench_old_list old_list;
+    LIST_HEAD(ports, usb_port) new_list;
+    uint64_t start, scan_ns;
+    uint32_t i, j, count = 0;
+
+    if (!old_ports || !new_ports) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        exit(EXIT_FAILURE);
+    }
+
+    LIST_INIT(&old_list);
+    LIST_INIT(&new_list);
+
+    //Same state in both arrays. Most ports are enabled and connected
+    for (i = 0; i < num_ports; i++) {
+        j = order[i];
+        old_ports[j].enabled = new_ports[j].enabled = bench_rand() % 16 != 0;
+        old_ports[j].status = new_ports[j].status = bench_rand() % 4 != 0;
+        old_ports[j].msg_mode = new_ports[j].msg_mode = bench_rand() % 2 ?
+                                                        PING : IDLE;
+        LIST_INSERT_HEAD(&old_list, &(old_ports[j]), port_next);
+        LIST_INSERT_HEAD(&new_list, &(new_ports[j]), port_next);
+    }
+
+    {
+        struct bench_port_old *itr;
+
+        start = bench_get_time_ns();
+        for (i = 0; i < BENCH_SCANS; i++)
+            BENCH_SCAN(&old_list, port_next, count);
+        scan_ns = bench_get_time_ns() - start;
+
+        bench_print("old", shuffle, sizeof(struct bench_port_old),
+                    offsetof(struct bench_port_old, timeout_handle),
+                    offsetof(struct bench_port_old, port_next) +
+                    sizeof(old_ports[0].port_next), scan_ns, num_ports,
+                    count);
+    }
+
+    {
+        struct usb_port *itr;
+
+        start = bench_get_time_ns();
+        for (i = 0; i < BENCH_SCANS; i++)
+            BENCH_SCAN(&new_list, port_next, count);
+        scan_ns = bench_get_time_ns() - start;
+
+        bench_print("new", shuffle, sizeof(struct usb_port), 0,
+                    offsetof(struct usb_port, port_num), scan_ns, num_ports,
+                    count);
+    }
+
+    free(order);
+    free(new_ports);
+    free(old_ports);
+}
+
+int main(int argc, char *argv[])
+{
+    uint32_t num_ports = BENCH_NUM_PORTS;
+
+    if (argc > 1)
+        num_ports = atoi(argv[1]);
+
+    if (!num_ports) {
+        fprintf(stderr, "Number of ports must be > 0\n");
+        exit(EXIT_FAILURE);
+    }
+
+    printf("%6s %6s %6s %10s %10s %8s\n", "layout", "order", "size",
+           "hot_bytes", "ns/port", "matches");
+    bench_scan(num_ports, 0);
+    bench_scan(num_ports, 1);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,221 @@
+/*
+ * Copyright 2015 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Usb Monitor. Usb Monitor is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * Usb Montior is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Usb Monitor. If not, see http://www.gnu.org/licenses/.
+ */
+
+
+//Micro-benchmark of the event loop timeouts. n timeouts are inserted with
+//random timeout_clocks, then rearmed (moved further into the future) and at
+//last cancelled. Prints the average cost of each operation in ns, for the heap,
+//the timing wheel and the sorted list that the event loop used to have
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <time.h>
+#include <sys/queue.h>
+
+#include "../backend_event_loop.h"
+
+#define BENCH_REARMS 100000
+//Every rearm walks half the list, so the list does fewer
+#define BENCH_LIST_REARMS 1000
+//Timeouts are spread over the next ten minutes
+#define BENCH_SPREAD_MS 600000
+
+static uint64_t bench_rand_state = 88172645463325252ULL;
+
+//xorshift64, so that every run uses the same timeouts
+static uint64_t bench_rand()
+{
+    bench_rand_state ^= bench_rand_state << 13;
+    bench_rand_state ^= bench_rand_state >> 7;
+    bench_rand_state ^= bench_rand_state << 17;
+    return bench_rand_state;
+}
+
+static uint64_t bench_get_time_ns()
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &tp);
+    return (tp.tv_sec * 1000000000ULL) + tp.tv_nsec;
+}
+
+static void bench_timeout_cb(void *ptr)
+{
+}
+
+static uint64_t bench_get_time_ms()
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &tp);
+    return (tp.tv_sec * 1000ULL) + (tp.tv_nsec / 1000000);
+}
+
+static void bench_print(const char *name, uint32_t num_timers,
+                        uint64_t insert_ns, uint64_t rearm_ns,
+                        uint32_t num_rearms, uint64_t cancel_ns)
+{
+    printf("%-6s %7u %10.1f %10.1f %10.1f\n", name, num_timers,
+           (double) insert_ns / num_timers, (double) rearm_ns / num_rearms,
+           (double) cancel_ns / num_timers);
+}
+
+//The timeout list as it was before the heap, sorted on timeout_clock
+struct bench_list_timeout {
+    uint64_t timeout_clock;
+    LIST_ENTRY(bench_list_timeout) timeout_next;
+};
+
+LIST_HEAD(bench_list, bench_list_timeout);
+
+static void bench_list_insert(struct bench_list *list,
+                              struct bench_list_timeout *handle)
+{
+    struct bench_list_timeout *itr = LIST_FIRST(list), *prev_itr = NULL;
+
+    if (itr == NULL || handle->timeout_clock < itr->timeout_clock) {
+        LIST_INSERT_HEAD(list, handle, timeout_next);
+        return;
+    }
+
+    for (; itr != NULL; itr = LIST_NEXT(itr, timeout_next)) {
+        if (handle->timeout_clock < itr->timeout_clock)
+            break;
+
+        prev_itr = itr;
+    }
+
+    LIST_INSERT_AFTER(prev_itr, handle, timeout_next);
+}
+
+static void bench_list(uint32_t num_timers)
+{
+    struct bench_list list;
+    struct bench_list_timeout *handles;
+    uint64_t now_ms = bench_get_time_ms(), start, insert_ns, rearm_ns;
+    uint64_t cancel_ns;
+    uint32_t i;
+
+    LIST_INIT(&list);
+    handles = calloc(sizeof(struct bench_list_timeout), num_timers);
+
+    if (!handles) {
+        fprintf(stderr, "Failed to allocate timeouts\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < num_timers; i++)
+        handles[i].timeout_clock = now_ms + 1 +
+                                   (bench_rand() % BENCH_SPREAD_MS);
+
+    start = bench_get_time_ns();
+    for (i = 0; i < num_timers; i++)
+        bench_list_insert(&list, &(handles[i]));
+    insert_ns = bench_get_time_ns() - start;
+
+    start = bench_get_time_ns();
+    for (i = 0; i < BENCH_LIST_REARMS; i++) {
+        LIST_REMOVE(&(handles[i % num_timers]), timeout_next);
+        handles[i % num_timers].timeout_clock += BENCH_SPREAD_MS / 2;
+        bench_list_insert(&list, &(handles[i % num_timers]));
+    }
+    rearm_ns = bench_get_time_ns() - start;
+
+    start = bench_get_time_ns();
+    for (i = 0; i < num_timers; i++)
+        LIST_REMOVE(&(handles[i]), timeout_next);
+    cancel_ns = bench_get_time_ns() - start;
+
+    bench_print("list", num_timers, insert_ns, rearm_ns, BENCH_LIST_REARMS,
+                cancel_ns);
+    free(handles);
+}
+
+static void bench_loop(const char *name, uint32_t flags, uint32_t num_timers)
+{
+    struct backend_event_loop *del = backend_event_loop_create(flags);
+    struct backend_timeout_handle *handles;
+    uint64_t now_ms = bench_get_time_ms(), start, insert_ns, rearm_ns;
+    uint64_t cancel_ns;
+    uint32_t i;
+
+    handles = calloc(sizeof(struct backend_timeout_handle), num_timers);
+
+    if (!del || !handles) {
+        fprintf(stderr, "Failed to allocate event loop or timeouts\n");
+        exit(EXIT_FAILURE);
+    }
+
+    for (i = 0; i < num_timers; i++) {
+        handles[i].cb = bench_timeout_cb;
+        handles[i].timeout_clock = now_ms + 1 +
+                                   (bench_rand() % BENCH_SPREAD_MS);
+    }
+
+    start = bench_get_time_ns();
+    for (i = 0; i < num_timers; i++)
+        backend_insert_timeout(del, &(handles[i]));
+    insert_ns = bench_get_time_ns() - start;
+
+    //A rearm moves an active timeout, like when a port timer is restarted
+    start = bench_get_time_ns();
+    for (i = 0; i < BENCH_REARMS; i++) {
+        handles[i % num_timers].timeout_clock += BENCH_SPREAD_MS / 2;
+        backend_insert_timeout(del, &(handles[i % num_timers]));
+    }
+    rearm_ns = bench_get_time_ns() - start;
+
+    start = bench_get_time_ns();
+    for (i = 0; i < num_timers; i++)
+        backend_delete_timeout(&(handles[i]));
+    cancel_ns = bench_get_time_ns() - start;
+
+    bench_print(name, num_timers, insert_ns, rearm_ns, BENCH_REARMS,
+                cancel_ns);
+    backend_event_loop_destroy(del);
+    free(handles);
+}
+
+static void bench_all(uint32_t num_timers)
+{
+    bench_list(num_timers);
+    bench_loop("heap", 0, num_timers);
+    bench_loop("wheel", BACKEND_FLAG_TIMER_WHEEL, num_timers);
+}
+
+//Without arguments, all timer types are compared at 1k, 10k and 100k timers
+int main(int argc, char *argv[])
+{
+    uint32_t num_timers = 0;
+
+    if (argc > 1 && !(num_timers = atoi(argv[1]))) {
+        fprintf(stderr, "Usage: %s [num. timers]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+
+    printf("%-6s %7s %10s %10s %10s\n", "type", "timers", "insert_ns",
+           "rearm_ns", "cancel_ns");
+
+    if (num_timers) {
+        bench_all(num_timers);
+    } else {
+        bench_all(1000);
+        bench_all(10000);
+        bench_all(100000);
+    }
+
+    return EXIT_SUCCESS;
+}
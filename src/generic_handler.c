@@ -25,6 +25,7 @@
 #include "usb_logging.h"
 #include "usb_helpers.h"
 #include "usb_monitor_lists.h"
+#include "usb_monitor_callbacks.h"
 
 static void generic_print_port(struct usb_port *port)
 {
@@ -65,10 +66,10 @@ static int32_t generic_update_port(struct usb_port *port, uint8_t cmd)
 	uint8_t request;
 
     gport->msg_mode = RESET;
+    usb_helpers_dequeue_ping(port);
 
 	//Timeout guard
-	if (gport->timeout_next.le_next != NULL ||
-        gport->timeout_next.le_prev != NULL)
+	if (usb_monitor_lists_is_timeout_active((struct usb_port*) gport))
             usb_monitor_lists_del_timeout((struct usb_port*) gport);
 
     transfer = libusb_alloc_transfer(0);
@@ -110,10 +111,12 @@ static int32_t generic_update_port(struct usb_port *port, uint8_t cmd)
     if (libusb_submit_transfer(transfer)) {
         USB_DEBUG_PRINT(gport->ctx->logfile, "Failed to submit generic reset\n");
         libusb_free_transfer(transfer);
-        libusb_release_interface(gport->dev_handle, 0);
-        libusb_close(gport->dev_handle);
-        gport->dev_handle = NULL;
+
+        if (gport->dev_handle)
+            usb_helpers_close_handle((struct usb_port*) gport);
         usb_helpers_start_timeout((struct usb_port*) gport, DEFAULT_TIMEOUT_SEC);
+    } else {
+        usb_monitor_update_libusb_timeout(gport->ctx);
     }
 
     return 0;
@@ -216,8 +219,6 @@ static void generic_del_device(libusb_context *ctx, libusb_device *device,
     struct usb_monitor_ctx *usbmon_ctx = user_data;
     struct generic_hub *ghub = (struct generic_hub*)
                                usb_monitor_lists_find_hub(usbmon_ctx, device);
-    struct generic_port *gport = (struct generic_port*) (ghub + 1);
-    uint8_t i = 0;
 
     if (ghub == NULL) {
         USB_DEBUG_PRINT(usbmon_ctx->logfile, "Generic hub not on list\n");
@@ -226,17 +227,11 @@ static void generic_del_device(libusb_context *ctx, libusb_device *device,
 
     USB_DEBUG_PRINT(usbmon_ctx->logfile, "Will remove generic hub\n");
 
+    usb_monitor_lists_del_hub(usbmon_ctx, (struct usb_hub*) ghub);
+    usb_monitor_lists_del_hub_ports(usbmon_ctx, (struct usb_hub*) ghub);
     libusb_close(ghub->hub_handle);
     libusb_unref_device(ghub->hub_dev);
 
-    while (i < ghub->num_ports) {
-        usb_helpers_release_port((struct usb_port*) gport);
-        usb_monitor_lists_del_port((struct usb_port*) gport);
-        gport = gport + 1;
-        ++i;
-    }
-
-    usb_monitor_lists_del_hub((struct usb_hub*) ghub);
     free(ghub);
 }
 
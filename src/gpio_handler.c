@@ -104,6 +104,7 @@ static int32_t gpio_update_port(struct usb_port *port, uint8_t cmd)
         //Set msg_mode to IDLE in case we interrupt a RESET. This way we make
         //sure that we can, in worst case, recover using timeout
         gport->msg_mode = IDLE;
+        usb_helpers_dequeue_ping(port);
         return 0;
     }
 
@@ -113,13 +114,13 @@ static int32_t gpio_update_port(struct usb_port *port, uint8_t cmd)
         return 0;
 
     gport->msg_mode = RESET;
+    usb_helpers_dequeue_ping(port);
 
     //Guard agains async reset requests. This guard is also needed for the
     //scenario where we are waiting to ping and device is reset. Then we will
     //still be in timeout list, but also reset. Since we then re-add port to
     //timeout (there is no USB timer), we create infinite loop and that is that
-    if (gport->timeout_next.le_next != NULL ||
-        gport->timeout_next.le_prev != NULL)
+    if (usb_monitor_lists_is_timeout_active((struct usb_port*) gport))
             usb_monitor_lists_del_timeout((struct usb_port*) gport);
 
     //POWER_OFF is 0, so then we should switch on port
@@ -333,7 +334,7 @@ static struct json_object* gpio_create_mapping_json(struct usb_monitor_ctx *ctx)
         json_object_object_add(obj_port, "path", obj_paths);
 
         for (i = 0; i < MAX_NUM_PATHS; i++) {
-            if (!itr->path[i]) {
+            if (!itr->path_len[i]) {
                 break;
             }
 
@@ -738,9 +739,8 @@ int32_t gpio_handler_start_probe(struct usb_monitor_ctx *ctx,
 static void gpio_handler_swap_port_info(struct usb_port *port_match,
                                         struct usb_port *port_probe)
 {
-    char *path_tmp[MAX_NUM_PATHS] = {0};
-    uint8_t path_len_tmp[MAX_NUM_PATHS] = {0};
-    uint8_t i;
+    union usb_path path_tmp[MAX_NUM_PATHS];
+    uint8_t path_len_tmp[MAX_NUM_PATHS];
     struct usb_monitor_ctx *ctx = port_match->ctx;
 
     USB_DEBUG_PRINT_SYSLOG(ctx, LOG_INFO, "Will swap path mapping "
@@ -751,37 +751,15 @@ static void gpio_handler_swap_port_info(struct usb_port *port_match,
     gpio_print_port(port_probe);
     USB_DEBUG_PRINT_SYSLOG(ctx, LOG_INFO, "\n");
 
-    //Move from the port we matched on to temporary, and NULL original
-    for (i = 0; i < MAX_NUM_PATHS; i++) {
-        if (!port_match->path[i]) {
-            break;
-        }
+    //Paths are stored in the ports, so swap the complete path arrays
+    memcpy(path_tmp, port_match->path, sizeof(path_tmp));
+    memcpy(path_len_tmp, port_match->path_len, sizeof(path_len_tmp));
 
-        path_tmp[i] = port_match->path[i];
-        path_len_tmp[i] = port_match->path_len[i];
-        port_match->path[i] = NULL;
-    }
+    memcpy(port_match->path, port_probe->path, sizeof(path_tmp));
+    memcpy(port_match->path_len, port_probe->path_len, sizeof(path_len_tmp));
 
-    //Move from port we probed and to the port we matched on
-    for (i = 0; i < MAX_NUM_PATHS; i++) {
-        if (!port_probe->path[i]) {
-            break;
-        }
-
-        port_match->path[i] = port_probe->path[i];
-        port_match->path_len[i] = port_probe->path_len[i];
-        port_probe->path[i] = NULL;
-    }
-
-    //Move the mapping from the port we matched on and to the port we probe
-    for (i = 0; i < MAX_NUM_PATHS; i++) {
-        if (!path_tmp[i]) {
-            break;
-        }
-
-        port_probe->path[i] = path_tmp[i];
-        port_probe->path_len[i] = path_len_tmp[i];
-    }
+    memcpy(port_probe->path, path_tmp, sizeof(path_tmp));
+    memcpy(port_probe->path_len, path_len_tmp, sizeof(path_len_tmp));
 
     //Also need to copy/reset the information about the current device
     port_probe->vp.vid = port_match->vp.vid;
@@ -792,6 +770,10 @@ static void gpio_handler_swap_port_info(struct usb_port *port_match,
     port_match->vp.vid = port_match->vp.pid = port_match->status = 0;
     port_match->dev = NULL;
 
+    //The ports have swapped paths, so the path hash must be updated
+    usb_monitor_lists_index_port(ctx, port_match);
+    usb_monitor_lists_index_port(ctx, port_probe);
+
     USB_DEBUG_PRINT_SYSLOG(ctx, LOG_INFO, "Will swap path mapping "
                            "(after)\n");
     USB_DEBUG_PRINT_SYSLOG(ctx, LOG_INFO, "Port (match):\n");
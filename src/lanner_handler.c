@@ -51,6 +51,7 @@ static int32_t lanner_update_port(struct usb_port *port, uint8_t cmd)
     if (cmd == CMD_RESTART) {
         l_port->restart_cmd = CMD_DISABLE;
         l_port->msg_mode = RESET;
+        usb_helpers_dequeue_ping(port);
     }
 
     //"Register" this port with the shared structure
@@ -61,13 +62,13 @@ static int32_t lanner_update_port(struct usb_port *port, uint8_t cmd)
     l_shared->mcu_state = LANNER_MCU_PENDING;
 
     //So far, the only thing we do when the private timer expires is to call
-    //start_mcu_update(), and the same applies to itr-callback. Thus, if timer
-    //is running, there is no need to start the itr callback. One case where
+    //start_mcu_update(), and the same applies to the itr task. Thus, if timer
+    //is running, there is no need to post the itr task. One case where
     //this can happen, is if network-listener requests two reboots very close
     //together and something causes opening the MCU to fail
-    if (!l_shared->mcu_timeout_handle->timeout_next.le_next &&
-        !l_shared->mcu_timeout_handle->timeout_next.le_prev) {
-        usb_monitor_start_itr_cb(l_port->ctx);
+    if (!backend_timeout_is_active(l_shared->mcu_timeout_handle)) {
+        backend_event_loop_post_task(l_port->ctx->event_loop,
+                                     &(l_shared->mcu_task));
     }
 
     return 0;
@@ -236,12 +237,14 @@ static void lanner_flush_mcu(struct lanner_shared *l_shared)
 
 static void lanner_handler_cleanup_shared(struct lanner_shared *l_shared)
 {
+    struct backend_event_loop *del = l_shared->ctx->event_loop;
+
     if (l_shared->mcu_timeout_handle) {
-        free(l_shared->mcu_timeout_handle);
+        backend_event_loop_free_timeout(del, l_shared->mcu_timeout_handle);
     }
 
     if (l_shared->mcu_epoll_handle) {
-        free(l_shared->mcu_epoll_handle);
+        backend_free_epoll_handle(del, l_shared->mcu_epoll_handle);
     }
 
     if (l_shared->mcu_fd) {
@@ -458,7 +461,8 @@ static void lanner_handler_ok_reply(struct lanner_shared *l_shared)
 
     if (!l_shared->pending_ports_mask) {
         l_shared->mcu_state = LANNER_MCU_UPDATE_DONE;
-        usb_monitor_start_itr_cb(l_port->ctx);
+        backend_event_loop_post_task(l_port->ctx->event_loop,
+                                     &(l_shared->mcu_task));
     } else {
         lanner_handler_start_private_timer(l_shared, LANNER_HANDLER_RESTART_MS);
     }
@@ -667,8 +671,9 @@ static void lanner_handler_start_mcu_update(struct usb_monitor_ctx *ctx)
     }
 }
 
-void lanner_handler_itr_cb(struct usb_monitor_ctx *ctx)
+static void lanner_handler_itr_cb(void *ptr)
 {
+    struct usb_monitor_ctx *ctx = ptr;
     struct lanner_shared *l_shared = ctx->mcu_info;
 
     if (l_shared->mcu_state == LANNER_MCU_UPDATE_DONE) {
@@ -716,13 +721,15 @@ uint8_t lanner_handler_parse_json(struct usb_monitor_ctx *ctx,
     l_shared->ctx = ctx;
     l_shared->mcu_state = LANNER_MCU_IDLE;
     l_shared->mcu_path = mcu_path;
+    backend_configure_itr_task(&(l_shared->mcu_task), lanner_handler_itr_cb, ctx);
 
     if ((l_shared->lock_fd = open(mcu_lock_path, O_RDONLY)) < 0) {
         lanner_handler_cleanup_shared(l_shared);
         return 1;
     }
 
-    if (!(l_shared->mcu_epoll_handle = backend_create_epoll_handle(ctx,
+    if (!(l_shared->mcu_epoll_handle = backend_create_epoll_handle(ctx->event_loop,
+                                                                   ctx,
                                                                    0,
                                                                    lanner_handler_event_cb,
                                                                    0))) {
@@ -740,6 +747,14 @@ uint8_t lanner_handler_parse_json(struct usb_monitor_ctx *ctx,
         return 1;
     }
 
+    backend_event_loop_set_cb_name(ctx->event_loop,
+                                   (void*) lanner_handler_event_cb, "lanner_mcu");
+    backend_event_loop_set_cb_name(ctx->event_loop,
+                                   (void*) lanner_handle_private_timeout,
+                                   "lanner_timeout");
+    backend_event_loop_set_cb_name(ctx->event_loop,
+                                   (void*) lanner_handler_itr_cb, "lanner_task");
+
     USB_DEBUG_PRINT_SYSLOG(ctx, LOG_INFO, "Lanner shared info. Path: %s\n",
                            l_shared->mcu_path);
 
@@ -38,6 +38,8 @@ struct lanner_shared {
     char *mcu_path;
     struct backend_epoll_handle *mcu_epoll_handle;
     struct backend_timeout_handle *mcu_timeout_handle;
+    //Posted when the MCU should be opened, or closed after an update
+    struct backend_itr_task mcu_task;
 
     int mcu_fd;
     int lock_fd;
@@ -68,8 +70,6 @@ struct lanner_port {
 
 struct json_object;
 
-void lanner_handler_itr_cb(struct usb_monitor_ctx *ctx);
-
 uint8_t lanner_handler_parse_json(struct usb_monitor_ctx *ctx,
                                   struct json_object *json,
                                   const char *mcu_path,
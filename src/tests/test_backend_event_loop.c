@@ -0,0 +1,636 @@
+/*
+ * Copyright 2015 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Usb Monitor. Usb Monitor is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * Usb Montior is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Usb Monitor. If not, see http://www.gnu.org/licenses/.
+ */
+
+
+//Tests for backend_event_loop. The implementation is included and
+//clock_gettime() replaced by a clock that only moves when the test says so, so
+//that the timers can be run deterministically without sleeping
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t test_now_ms;
+
+static int test_clock_gettime(clockid_t clk_id, struct timespec *tp)
+{
+    tp->tv_sec = test_now_ms / 1000;
+    tp->tv_nsec = (test_now_ms % 1000) * 1000000;
+    return 0;
+}
+
+#define clock_gettime test_clock_gettime
+#include "../backend_event_loop.c"
+#undef clock_gettime
+
+#define TEST_CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                    #cond); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+#define TEST_NUM_TIMERS 1000
+//Timeouts in the ordering test are spread over this many ms
+#define TEST_SPREAD_MS 10000
+//The ordering test moves the clock this many ms between each run
+#define TEST_STEP_MS 7
+
+//Every timeout that fires is logged, so that the order and the time of the
+//firing can be checked afterwards
+struct test_timer {
+    struct backend_timeout_handle handle;
+    uint64_t fired_ms;
+    uint32_t fired;
+};
+
+static struct test_timer test_timers[TEST_NUM_TIMERS];
+static struct test_timer *test_fire_log[TEST_NUM_TIMERS * 2];
+static uint32_t test_fire_len;
+
+static uint64_t test_rand_state = 88172645463325252ULL;
+
+static uint64_t test_rand()
+{
+    test_rand_state ^= test_rand_state << 13;
+    test_rand_state ^= test_rand_state >> 7;
+    test_rand_state ^= test_rand_state << 17;
+    return test_rand_state;
+}
+
+static void test_timeout_cb(void *ptr)
+{
+    struct test_timer *timer = ptr;
+
+    timer->fired++;
+    timer->fired_ms = test_now_ms;
+    test_fire_log[test_fire_len++] = timer;
+}
+
+//The clock is set before the loop is created, the wheel starts at that tick
+static struct backend_event_loop* test_create(uint32_t flags, uint64_t now_ms)
+{
+    struct backend_event_loop *del;
+
+    test_now_ms = now_ms;
+    test_fire_len = 0;
+    memset(test_timers, 0, sizeof(test_timers));
+
+    del = backend_event_loop_create(flags);
+    TEST_CHECK(del);
+
+    return del;
+}
+
+static void test_add(struct backend_event_loop *del, uint32_t idx,
+                     uint64_t timeout_clock, uint32_t slack, uint32_t intvl)
+{
+    struct backend_timeout_handle *handle = &(test_timers[idx].handle);
+
+    handle->slack = slack;
+    TEST_CHECK(!backend_event_loop_init_timeout(del, handle, timeout_clock,
+                                                test_timeout_cb,
+                                                &(test_timers[idx]), intvl));
+}
+
+static void test_run_at(struct backend_event_loop *del, uint64_t now_ms)
+{
+    test_now_ms = now_ms;
+    backend_event_loop_run_timers(del);
+}
+
+//Every parent must have a deadline that is not later than its children, and
+//every handle must know its own position
+static void test_check_heap(struct backend_event_loop *del)
+{
+    uint32_t i;
+
+    for (i = 0; i < del->timeout_heap_len; i++) {
+        TEST_CHECK(del->timeout_heap[i]->heap_idx == i + 1);
+
+        if (i)
+            TEST_CHECK(backend_timeout_deadline(del->timeout_heap[(i - 1) / 2])
+                       <= backend_timeout_deadline(del->timeout_heap[i]));
+    }
+}
+
+//Timeouts with random clocks must fire once, in the first run after their
+//clock and in order of timeout_clock
+static void test_order(uint32_t flags)
+{
+    struct backend_event_loop *del = test_create(flags, 1000);
+    uint64_t now_ms;
+    uint32_t i;
+
+    for (i = 0; i < TEST_NUM_TIMERS; i++)
+        test_add(del, i, 1001 + (test_rand() % TEST_SPREAD_MS), 0, 0);
+
+    if (!del->timer_wheel)
+        test_check_heap(del);
+
+    for (now_ms = 1000; now_ms < 1001 + TEST_SPREAD_MS + TEST_STEP_MS;
+         now_ms += TEST_STEP_MS)
+        test_run_at(del, now_ms);
+
+    TEST_CHECK(test_fire_len == TEST_NUM_TIMERS);
+
+    for (i = 0; i < TEST_NUM_TIMERS; i++) {
+        TEST_CHECK(test_timers[i].fired == 1);
+        TEST_CHECK(test_timers[i].fired_ms >=
+                   test_timers[i].handle.timeout_clock);
+        TEST_CHECK(test_timers[i].fired_ms <
+                   test_timers[i].handle.timeout_clock + TEST_STEP_MS);
+        TEST_CHECK(!backend_timeout_is_active(&(test_timers[i].handle)));
+
+        if (i)
+            TEST_CHECK(test_fire_log[i - 1]->handle.timeout_clock <=
+                       test_fire_log[i]->handle.timeout_clock);
+    }
+
+    backend_event_loop_destroy(del);
+}
+
+//Timeouts with the same clock all fire in the same run, after the earlier one
+//and before none of the later ones
+static void test_equal_deadline(uint32_t flags)
+{
+    struct backend_event_loop *del = test_create(flags, 0);
+    uint32_t i;
+
+    test_add(del, 0, 499, 0, 0);
+    for (i = 1; i <= 10; i++)
+        test_add(del, i, 500, 0, 0);
+    test_add(del, 11, 501, 0, 0);
+
+    test_run_at(del, 499);
+    TEST_CHECK(test_fire_len == 1 && test_fire_log[0] == &(test_timers[0]));
+
+    test_run_at(del, 500);
+    TEST_CHECK(test_fire_len == 11);
+
+    for (i = 1; i <= 10; i++)
+        TEST_CHECK(test_timers[i].fired == 1 &&
+                   test_timers[i].fired_ms == 500);
+
+    TEST_CHECK(!test_timers[11].fired);
+    test_run_at(del, 501);
+    TEST_CHECK(test_timers[11].fired == 1 && test_fire_len == 12);
+
+    backend_event_loop_destroy(del);
+}
+
+//Delete and rearm handles from the middle of the heap. The heap must stay
+//valid and the deleted handles must never fire
+static void test_delete_mid()
+{
+    struct backend_event_loop *del = test_create(0, 0);
+    struct backend_timeout_handle *handle;
+    uint8_t deleted[100] = {0};
+    uint32_t i, num_deleted = 0;
+
+    for (i = 0; i < 100; i++)
+        test_add(del, i, 1 + (test_rand() % 1000), 0, 0);
+
+    for (i = 0; i < 30; i++) {
+        handle = del->timeout_heap[del->timeout_heap_len / 2];
+        backend_delete_timeout(handle);
+        TEST_CHECK(!handle->heap_idx);
+        deleted[(struct test_timer*) handle - test_timers] = 1;
+        TEST_CHECK(del->timeout_heap_len == 99 - num_deleted);
+        num_deleted++;
+        test_check_heap(del);
+
+        //Move another handle both towards the root and towards the leaves
+        handle = del->timeout_heap[del->timeout_heap_len / 3];
+        handle->timeout_clock = (i & 1) ? 1 + (i % 5) : 2000 + i;
+        TEST_CHECK(!backend_insert_timeout(del, handle));
+        test_check_heap(del);
+    }
+
+    test_run_at(del, 5000);
+    TEST_CHECK(test_fire_len == 100 - num_deleted);
+
+    for (i = 0; i < 100; i++)
+        TEST_CHECK(test_timers[i].fired == !deleted[i]);
+
+    backend_event_loop_destroy(del);
+}
+
+//Timeouts that start in every level of the wheel must cascade down and fire
+//on their exact tick, not one tick earlier
+static void test_wheel_cascade()
+{
+    const uint64_t start = 1000;
+    const uint64_t deltas[] = {5, 63, 64, 4095, 4096, 262143, 262144,
+                               5 * 3600 * 1000ULL, 30 * 24 * 3600 * 1000ULL};
+    const uint8_t levels[] = {0, 0, 1, 1, 2, 2, 3, 4, 5};
+    const uint32_t num_deltas = sizeof(deltas) / sizeof(deltas[0]);
+    struct backend_event_loop *del = test_create(BACKEND_FLAG_TIMER_WHEEL,
+                                                 start);
+    uint32_t i;
+
+    for (i = 0; i < num_deltas; i++) {
+        test_add(del, i, start + deltas[i], 0, 0);
+        TEST_CHECK(test_timers[i].handle.wheel_level == levels[i]);
+    }
+
+    for (i = 0; i < num_deltas; i++) {
+        test_run_at(del, start + deltas[i] - 1);
+        TEST_CHECK(test_fire_len == i);
+
+        test_run_at(del, start + deltas[i]);
+        TEST_CHECK(test_fire_len == i + 1);
+        TEST_CHECK(test_fire_log[i] == &(test_timers[i]));
+        TEST_CHECK(test_timers[i].fired_ms == start + deltas[i]);
+    }
+
+    backend_event_loop_destroy(del);
+}
+
+//The wheel rounds the expiry up to the largest power of two that fits in the
+//slack, so that timeouts with overlapping windows share a tick. The heap sleeps
+//until the earliest deadline and then runs everything that is ready
+static void test_slack()
+{
+    struct backend_event_loop *del = test_create(BACKEND_FLAG_TIMER_WHEEL,
+                                                 1000);
+    struct backend_event_loop_stats stats;
+    uint64_t next_clock;
+
+    //Granularity 16 and 8, both round up to 1008
+    test_add(del, 0, 1001, 15, 0);
+    test_add(del, 1, 1005, 7, 0);
+    //No slack, fires on its own tick
+    test_add(del, 2, 1003, 0, 0);
+
+    TEST_CHECK(backend_get_next_timeout(del, &next_clock) &&
+               next_clock == 1003);
+    test_run_at(del, 1003);
+    TEST_CHECK(test_fire_len == 1 && test_timers[2].fired);
+
+    TEST_CHECK(backend_get_next_timeout(del, &next_clock) &&
+               next_clock == 1008);
+    test_run_at(del, 1007);
+    TEST_CHECK(test_fire_len == 1);
+    test_run_at(del, 1008);
+    TEST_CHECK(test_fire_len == 3);
+    TEST_CHECK(test_timers[0].fired_ms == 1008 &&
+               test_timers[1].fired_ms == 1008);
+
+    backend_event_loop_get_stats(del, &stats);
+    TEST_CHECK(stats.timer_wakeups == 2 && stats.wakeups_saved == 1);
+    backend_event_loop_destroy(del);
+
+    del = test_create(0, 0);
+    test_add(del, 0, 100, 50, 0);
+    test_add(del, 1, 120, 0, 0);
+    test_check_heap(del);
+
+    TEST_CHECK(backend_get_next_timeout(del, &next_clock) &&
+               next_clock == 120);
+    test_run_at(del, 120);
+    TEST_CHECK(test_fire_len == 2);
+    TEST_CHECK(!backend_get_next_timeout(del, &next_clock));
+
+    backend_event_loop_get_stats(del, &stats);
+    TEST_CHECK(stats.timer_wakeups == 1 && stats.wakeups_saved == 1);
+    backend_event_loop_destroy(del);
+}
+
+//After a long gap without runs (e.g., the machine was suspended), every
+//timeout that expired fires once in a single run, in order, and periodic
+//timeouts are rearmed relative to the current time instead of firing once for
+//every missed interval
+static void test_idle_gap(uint32_t flags)
+{
+    struct backend_event_loop *del = test_create(flags, 0);
+    const uint64_t gap_ms = 3 * 3600 * 1000ULL;
+    uint32_t i;
+
+    test_add(del, 0, 100, 0, 100);
+    test_add(del, 1, 150, 0, 0);
+    test_add(del, 2, 5000, 0, 0);
+    test_add(del, 3, 300000, 0, 0);
+    test_add(del, 4, 2 * 3600 * 1000ULL, 0, 0);
+
+    test_run_at(del, gap_ms);
+    TEST_CHECK(test_fire_len == 5);
+
+    for (i = 0; i < 5; i++) {
+        TEST_CHECK(test_timers[i].fired == 1);
+        TEST_CHECK(test_fire_log[i] == &(test_timers[i]));
+    }
+
+    TEST_CHECK(backend_timeout_is_active(&(test_timers[0].handle)));
+    TEST_CHECK(test_timers[0].handle.timeout_clock == gap_ms + 100);
+
+    test_run_at(del, gap_ms + 99);
+    TEST_CHECK(test_timers[0].fired == 1);
+    test_run_at(del, gap_ms + 100);
+    TEST_CHECK(test_timers[0].fired == 2);
+    TEST_CHECK(test_timers[0].handle.timeout_clock == gap_ms + 200);
+
+    backend_event_loop_destroy(del);
+}
+
+//Changing the slack of an active timeout must move it, both in the heap (new
+//deadline) and in the wheel (new rounding)
+static void test_set_slack(uint32_t flags)
+{
+    struct backend_event_loop *del = test_create(flags, 1000);
+    uint64_t next_clock;
+
+    test_add(del, 0, 1001, 0, 0);
+    TEST_CHECK(backend_get_next_timeout(del, &next_clock) &&
+               next_clock == 1001);
+
+    backend_timeout_set_slack(&(test_timers[0].handle), 15);
+    TEST_CHECK(backend_timeout_is_active(&(test_timers[0].handle)));
+    TEST_CHECK(backend_get_next_timeout(del, &next_clock));
+    TEST_CHECK(next_clock == (del->timer_wheel ? 1008 : 1016));
+
+    test_run_at(del, next_clock);
+    TEST_CHECK(test_fire_len == 1);
+
+    //Not active, only the slack is updated
+    backend_timeout_set_slack(&(test_timers[0].handle), 0);
+    TEST_CHECK(!backend_timeout_is_active(&(test_timers[0].handle)));
+    TEST_CHECK(!backend_get_next_timeout(del, &next_clock));
+
+    backend_event_loop_destroy(del);
+}
+
+//Tasks are logged in the order they run
+struct test_task {
+    struct backend_itr_task task;
+    struct backend_event_loop *del;
+    uint32_t runs;
+    uint8_t repost;
+};
+
+static struct test_task *test_task_log[16];
+static uint32_t test_task_len;
+
+static void test_task_cb(void *ptr)
+{
+    struct test_task *task = ptr;
+
+    task->runs++;
+    test_task_log[test_task_len++] = task;
+
+    if (task->repost)
+        backend_event_loop_post_task(task->del, &(task->task));
+}
+
+//Tasks run once per post in the order they were posted, posting a queued task
+//is a no-op and a task that re-posts itself is left for the next iteration.
+//Tasks are run with task_seq close to wrapping, so that the comparison of
+//sequence numbers must handle the wrap
+static void test_tasks()
+{
+    struct backend_event_loop *del = test_create(0, 0);
+    struct test_task tasks[4];
+    uint32_t i;
+
+    memset(tasks, 0, sizeof(tasks));
+    del->task_seq = UINT32_MAX - 2;
+
+    for (i = 0; i < 4; i++) {
+        backend_configure_itr_task(&(tasks[i].task), test_task_cb,
+                                   &(tasks[i]));
+        tasks[i].del = del;
+    }
+
+    backend_event_loop_post_task(del, &(tasks[2].task));
+    backend_event_loop_post_task(del, &(tasks[0].task));
+    backend_event_loop_post_task(del, &(tasks[2].task));
+    backend_event_loop_post_task(del, &(tasks[1].task));
+    backend_event_loop_post_task(del, &(tasks[3].task));
+    backend_event_loop_cancel_task(del, &(tasks[3].task));
+    TEST_CHECK(!tasks[3].task.queued);
+
+    tasks[0].repost = 1;
+    backend_event_loop_run_tasks(del);
+
+    TEST_CHECK(test_task_len == 3);
+    TEST_CHECK(test_task_log[0] == &(tasks[2]) &&
+               test_task_log[1] == &(tasks[0]) &&
+               test_task_log[2] == &(tasks[1]));
+    TEST_CHECK(!tasks[3].runs);
+
+    //Only the re-posted task is left
+    TEST_CHECK(tasks[0].task.queued);
+    tasks[0].repost = 0;
+    backend_event_loop_run_tasks(del);
+    TEST_CHECK(test_task_len == 4 && test_task_log[3] == &(tasks[0]));
+    TEST_CHECK(STAILQ_EMPTY(&(del->itr_tasks)));
+
+    backend_event_loop_run_tasks(del);
+    TEST_CHECK(test_task_len == 4);
+
+    backend_event_loop_destroy(del);
+}
+
+//The event array doubles every time a wait fills it, up to the max. It is only
+//halved after BACKEND_EPOLL_SHRINK_ITR waits in a row that use less than a
+//quarter of it, and never below the initial size
+static void test_adapt_events()
+{
+    struct backend_event_loop *del = test_create(0, 0);
+    uint32_t i, size = MAX_EPOLL_EVENTS, num_full = 0;
+
+    TEST_CHECK(del->events_size == MAX_EPOLL_EVENTS);
+
+    while (size < BACKEND_EPOLL_EVENTS_MAX) {
+        backend_event_loop_adapt_events(del, del->events_size);
+        size *= 2;
+        num_full++;
+        TEST_CHECK(del->events_size == size);
+        TEST_CHECK(del->stats.events_size == size);
+    }
+
+    //Full at max size, counted but not grown
+    backend_event_loop_adapt_events(del, del->events_size);
+    TEST_CHECK(del->events_size == BACKEND_EPOLL_EVENTS_MAX);
+    TEST_CHECK(del->stats.full_waits == num_full + 1);
+
+    //A wait that uses more than a quarter restarts the count
+    for (i = 0; i < BACKEND_EPOLL_SHRINK_ITR - 1; i++)
+        backend_event_loop_adapt_events(del, 1);
+    backend_event_loop_adapt_events(del, del->events_size / 2);
+
+    for (i = 0; i < BACKEND_EPOLL_SHRINK_ITR - 1; i++)
+        backend_event_loop_adapt_events(del, 1);
+    TEST_CHECK(del->events_size == BACKEND_EPOLL_EVENTS_MAX);
+    backend_event_loop_adapt_events(del, 1);
+    TEST_CHECK(del->events_size == BACKEND_EPOLL_EVENTS_MAX / 2);
+
+    //Shrinks step by step, the array must stay usable
+    for (i = 0; i < 16 * BACKEND_EPOLL_SHRINK_ITR; i++)
+        backend_event_loop_adapt_events(del, 0);
+    TEST_CHECK(del->events_size == MAX_EPOLL_EVENTS);
+    memset(del->events, 0, del->events_size * sizeof(struct epoll_event));
+
+    backend_event_loop_destroy(del);
+}
+
+static uint32_t test_slow_calls;
+static uint64_t test_slow_ns;
+static const char *test_slow_name;
+
+static void test_slow_cb(void *ptr, const char *name, void *cb,
+                         uint64_t duration_ns)
+{
+    test_slow_calls++;
+    test_slow_ns = duration_ns;
+    test_slow_name = name;
+}
+
+//Takes 10 ms on the test clock
+static void test_busy_cb(void *ptr)
+{
+    test_now_ms += 10;
+}
+
+//Every value must be inside its bucket, percentiles must be the upper bound of
+//the bucket that contains the percentile, and callbacks that run over budget
+//must be reported
+static void test_profiling()
+{
+    struct backend_event_loop *del = test_create(0, 0);
+    struct backend_cb_prof prof, *entry;
+    struct backend_timeout_handle handle;
+    uint64_t value, p;
+    uint32_t bucket, i;
+
+    for (i = 0; i < BACKEND_PROF_SUB_BUCKETS; i++)
+        TEST_CHECK(backend_prof_bucket(i) == i);
+
+    for (value = 1; value < 100000000; value += 1 + value / 7) {
+        bucket = backend_prof_bucket(value);
+        TEST_CHECK(bucket < BACKEND_PROF_BUCKETS - 1);
+        TEST_CHECK(backend_prof_bucket_start(bucket) <= value);
+        TEST_CHECK(backend_prof_bucket_start(bucket + 1) > value);
+    }
+
+    TEST_CHECK(backend_prof_bucket(UINT64_MAX) == BACKEND_PROF_BUCKETS - 1);
+
+    //90 values of 10 us and 10 of 1000 us
+    memset(&prof, 0, sizeof(prof));
+    TEST_CHECK(backend_cb_prof_percentile(&prof, 50) == 0);
+    prof.count = 100;
+    prof.max_ns = 1000 * 1000;
+    prof.hist[backend_prof_bucket(10)] = 90;
+    prof.hist[backend_prof_bucket(1000)] = 10;
+
+    p = backend_cb_prof_percentile(&prof, 50);
+    TEST_CHECK(p >= 10 && p < 10 * 5 / 4);
+    p = backend_cb_prof_percentile(&prof, 90);
+    TEST_CHECK(p >= 10 && p < 10 * 5 / 4);
+    p = backend_cb_prof_percentile(&prof, 91);
+    TEST_CHECK(p >= 1000 && p < 1000 * 5 / 4);
+    p = backend_cb_prof_percentile(&prof, 100);
+    TEST_CHECK(p >= 1000 && p < 1000 * 5 / 4);
+
+    //Budget of 5 ms, the callback takes 10 ms
+    memset(&handle, 0, sizeof(handle));
+    backend_event_loop_set_cb_name(del, (void*) test_busy_cb, "busy");
+    TEST_CHECK(!backend_event_loop_enable_profiling(del, 5, test_slow_cb,
+                                                    NULL));
+    TEST_CHECK(!backend_event_loop_init_timeout(del, &handle, 100,
+                                                test_busy_cb, NULL, 0));
+    test_run_at(del, 100);
+
+    entry = backend_prof_get_entry(del->prof, (void*) test_busy_cb);
+    TEST_CHECK(entry->count == 1 && entry->over_budget == 1);
+    TEST_CHECK(entry->type == BACKEND_CB_TIMEOUT);
+    TEST_CHECK(entry->max_ns == 10000000);
+    TEST_CHECK(entry->hist[backend_prof_bucket(10000)] == 1);
+    TEST_CHECK(test_slow_calls == 1 && test_slow_ns == 10000000);
+    TEST_CHECK(test_slow_name && !strcmp(test_slow_name, "busy"));
+
+    backend_event_loop_destroy(del);
+}
+
+//Handles allocated by the loop come from the pools. Timeouts with auto_free go
+//back to the pool when they have run, unless the callback rearmed them
+static void test_handle_pool()
+{
+    struct backend_event_loop *del = test_create(0, 0);
+    struct backend_timeout_handle *timeout, *timeout2;
+    struct backend_epoll_handle *handle;
+
+    handle = backend_create_epoll_handle(del, NULL, 3, NULL, 1);
+    TEST_CHECK(handle && handle->fd == 3 && handle->libusb_fd == 1);
+    TEST_CHECK(del->epoll_pool.num_used == 1);
+    backend_free_epoll_handle(del, handle);
+    TEST_CHECK(!del->epoll_pool.num_used);
+    TEST_CHECK(backend_create_epoll_handle(del, NULL, 4, NULL, 0) == handle);
+
+    timeout = backend_event_loop_add_timeout(del, 10, test_timeout_cb,
+                                             &(test_timers[0]), 0, true);
+    timeout2 = backend_event_loop_add_timeout(del, 20, test_timeout_cb,
+                                              &(test_timers[1]), 0, false);
+    TEST_CHECK(timeout && timeout2);
+    TEST_CHECK(del->timeout_pool.num_used == 2);
+
+    test_run_at(del, 20);
+    TEST_CHECK(test_fire_len == 2);
+    TEST_CHECK(del->timeout_pool.num_used == 1);
+
+    //The freed handle is the next one handed out
+    TEST_CHECK(backend_event_loop_add_timeout(del, 0, test_timeout_cb, NULL,
+                                              0, false) == timeout);
+    backend_event_loop_free_timeout(del, timeout2);
+    TEST_CHECK(del->timeout_pool.num_used == 1);
+
+    backend_event_loop_destroy(del);
+}
+
+int main(int argc, char *argv[])
+{
+    test_order(0);
+    test_order(BACKEND_FLAG_TIMER_WHEEL);
+    printf("order: OK\n");
+    test_equal_deadline(0);
+    test_equal_deadline(BACKEND_FLAG_TIMER_WHEEL);
+    printf("equal_deadline: OK\n");
+    test_delete_mid();
+    printf("delete_mid: OK\n");
+    test_wheel_cascade();
+    printf("wheel_cascade: OK\n");
+    test_slack();
+    printf("slack: OK\n");
+    test_idle_gap(0);
+    test_idle_gap(BACKEND_FLAG_TIMER_WHEEL);
+    printf("idle_gap: OK\n");
+    test_set_slack(0);
+    test_set_slack(BACKEND_FLAG_TIMER_WHEEL);
+    printf("set_slack: OK\n");
+    test_tasks();
+    printf("tasks: OK\n");
+    test_adapt_events();
+    printf("adapt_events: OK\n");
+    test_profiling();
+    printf("profiling: OK\n");
+    test_handle_pool();
+    printf("handle_pool: OK\n");
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,139 @@
+/*
+ * Copyright 2015 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Usb Monitor. Usb Monitor is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * Usb Montior is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Usb Monitor. If not, see http://www.gnu.org/licenses/.
+ */
+
+
+//Tests for backend_pool
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../backend_pool.c"
+
+#define TEST_CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                    #cond); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+#define TEST_NUM_OBJS (BACKEND_POOL_SLAB_OBJS * 3)
+
+//Odd size, so that the rounding to pointer alignment is needed
+struct test_obj {
+    uint8_t data[13];
+};
+
+//Objects are rounded up to pointer size, and can always hold the free pointer
+static void test_init()
+{
+    struct backend_pool pool;
+
+    backend_pool_init(&pool, sizeof(struct test_obj), BACKEND_POOL_SLAB_OBJS);
+    TEST_CHECK(pool.obj_size == 16);
+    TEST_CHECK(!pool.slabs && !pool.free_list && !pool.num_used);
+
+    backend_pool_init(&pool, 1, 0);
+    TEST_CHECK(pool.obj_size == sizeof(void*));
+    TEST_CHECK(pool.objs_per_slab == 1);
+}
+
+//Slabs are only allocated when the free list is empty, objects are aligned,
+//zeroed and do not overlap
+static void test_alloc()
+{
+    struct backend_pool pool;
+    struct test_obj *objs[TEST_NUM_OBJS];
+    uint8_t *start;
+    uint32_t i, j;
+
+    backend_pool_init(&pool, sizeof(struct test_obj), BACKEND_POOL_SLAB_OBJS);
+
+    for (i = 0; i < TEST_NUM_OBJS; i++) {
+        objs[i] = backend_pool_alloc(&pool);
+        TEST_CHECK(objs[i]);
+        TEST_CHECK(!((uintptr_t) objs[i] & (sizeof(void*) - 1)));
+        TEST_CHECK(pool.num_slabs == i / BACKEND_POOL_SLAB_OBJS + 1);
+        TEST_CHECK(pool.num_used == i + 1);
+
+        for (j = 0; j < sizeof(objs[i]->data); j++)
+            TEST_CHECK(!objs[i]->data[j]);
+
+        memset(objs[i]->data, 0xff, sizeof(objs[i]->data));
+    }
+
+    for (i = 0; i < TEST_NUM_OBJS; i++) {
+        start = (uint8_t*) objs[i];
+
+        for (j = i + 1; j < TEST_NUM_OBJS; j++)
+            TEST_CHECK(start + pool.obj_size <= (uint8_t*) objs[j] ||
+                       (uint8_t*) objs[j] + pool.obj_size <= start);
+    }
+
+    backend_pool_destroy(&pool);
+    TEST_CHECK(!pool.slabs && !pool.free_list);
+    TEST_CHECK(!pool.num_slabs && !pool.num_used);
+}
+
+//Freed objects are reused (last freed first) and the pool does not grow as
+//long as the number of objects in use stays below the peak
+static void test_reuse()
+{
+    struct backend_pool pool;
+    struct test_obj *objs[TEST_NUM_OBJS], *obj;
+    uint32_t i, round;
+
+    backend_pool_init(&pool, sizeof(struct test_obj), BACKEND_POOL_SLAB_OBJS);
+
+    for (i = 0; i < TEST_NUM_OBJS; i++)
+        objs[i] = backend_pool_alloc(&pool);
+
+    TEST_CHECK(pool.num_slabs == 3);
+
+    for (round = 0; round < 100; round++) {
+        for (i = 0; i < TEST_NUM_OBJS; i += 2) {
+            memset(objs[i]->data, 0xff, sizeof(objs[i]->data));
+            backend_pool_free(&pool, objs[i]);
+        }
+
+        TEST_CHECK(pool.num_used == TEST_NUM_OBJS / 2);
+
+        for (i = TEST_NUM_OBJS; i >= 2; i -= 2) {
+            obj = backend_pool_alloc(&pool);
+            TEST_CHECK(obj == objs[i - 2]);
+            TEST_CHECK(!obj->data[0] && !obj->data[12]);
+        }
+
+        TEST_CHECK(pool.num_used == TEST_NUM_OBJS);
+        TEST_CHECK(pool.num_slabs == 3);
+    }
+
+    backend_pool_destroy(&pool);
+}
+
+int main(int argc, char *argv[])
+{
+    test_init();
+    printf("init: OK\n");
+    test_alloc();
+    printf("alloc: OK\n");
+    test_reuse();
+    printf("reuse: OK\n");
+
+    return EXIT_SUCCESS;
+}
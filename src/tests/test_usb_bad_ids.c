@@ -0,0 +1,354 @@
+/*
+ * Copyright 2015 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Usb Monitor. Usb Monitor is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * Usb Montior is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Usb Monitor. If not, see http://www.gnu.org/licenses/.
+ */
+
+//Tests for the bad device ID matcher. Tables are built like the parser in
+//usb_monitor.c does it, and then matched against ports with different paths
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../usb_bad_ids.c"
+
+#define TEST_CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                    #cond); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+//Paths are written as strings of digits, "312" is the path 3-1.2
+struct test_entry {
+    uint16_t vid;
+    uint16_t pid_min;
+    uint16_t pid_max;
+    const char *path;
+    uint8_t restart;
+};
+
+static void test_set_path(union usb_path *path, uint8_t *path_len,
+                          const char *str)
+{
+    memset(path, 0, sizeof(*path));
+
+    for (*path_len = 0; str && str[*path_len]; (*path_len)++)
+        path->bytes[*path_len] = str[*path_len] - '0';
+}
+
+static void test_create(struct usb_monitor_ctx *ctx,
+                        const struct test_entry *entries, uint32_t num_entries)
+{
+    struct usb_bad_device *bad_dev;
+    uint32_t i;
+
+    memset(ctx, 0, sizeof(*ctx));
+    usb_path_tree_init(&(ctx->bad_id_tree));
+    TEST_CHECK((ctx->bad_device_ids = calloc(num_entries,
+                                             sizeof(*bad_dev))) != NULL);
+
+    for (i = 0; i < num_entries; i++) {
+        bad_dev = &(ctx->bad_device_ids[i]);
+        bad_dev->vid = entries[i].vid;
+        bad_dev->pid_min = entries[i].pid_min;
+        bad_dev->pid_max = entries[i].pid_max;
+        bad_dev->restart = entries[i].restart;
+        test_set_path(&(bad_dev->path), &(bad_dev->path_len), entries[i].path);
+    }
+
+    ctx->num_bad_device_ids = num_entries;
+    TEST_CHECK(!usb_bad_ids_index(ctx));
+}
+
+static void test_destroy(struct usb_monitor_ctx *ctx)
+{
+    usb_path_tree_destroy(&(ctx->bad_id_tree));
+    free(ctx->bad_device_ids);
+}
+
+//Return the matching entry for a device vid:pid on a port with path, and
+//optionally a second path (path2)
+static struct usb_bad_device* test_match(struct usb_monitor_ctx *ctx,
+                                         uint16_t vid, uint16_t pid,
+                                         const char *path, const char *path2)
+{
+    struct usb_port port;
+
+    memset(&port, 0, sizeof(port));
+    port.vp.vid = vid;
+    port.vp.pid = pid;
+    test_set_path(&(port.path[0]), &(port.path_len[0]), path);
+
+    if (path2)
+        test_set_path(&(port.path[1]), &(port.path_len[1]), path2);
+
+    return usb_bad_ids_match(ctx, &port);
+}
+
+//Return 1 if a device vid:pid on a port with path is restarted
+static uint8_t test_restart(struct usb_monitor_ctx *ctx, uint16_t vid,
+                            uint16_t pid, const char *path)
+{
+    struct usb_bad_device *match = test_match(ctx, vid, pid, path, NULL);
+
+    return match && match->restart;
+}
+
+static void test_pid_ranges(void)
+{
+    struct usb_monitor_ctx ctx;
+    const struct test_entry entries[] = {
+        {0x1199, 0x9000, 0x90ff, NULL, 1},
+        {0x12d1, 0x1506, 0x1506, NULL, 1},
+        {0x1199, 0x68c0, 0x68c0, NULL, 1},
+    };
+
+    test_create(&ctx, entries, 3);
+    TEST_CHECK(ctx.num_global_bad_ids == 3);
+
+    //Both ends of the range are included
+    TEST_CHECK(!test_restart(&ctx, 0x1199, 0x8fff, "1"));
+    TEST_CHECK(test_restart(&ctx, 0x1199, 0x9000, "1"));
+    TEST_CHECK(test_restart(&ctx, 0x1199, 0x9042, "1"));
+    TEST_CHECK(test_restart(&ctx, 0x1199, 0x90ff, "1"));
+    TEST_CHECK(!test_restart(&ctx, 0x1199, 0x9100, "1"));
+
+    //A single pid is a range of one
+    TEST_CHECK(test_restart(&ctx, 0x1199, 0x68c0, "1"));
+    TEST_CHECK(!test_restart(&ctx, 0x1199, 0x68bf, "1"));
+    TEST_CHECK(!test_restart(&ctx, 0x1199, 0x68c1, "1"));
+    TEST_CHECK(test_restart(&ctx, 0x12d1, 0x1506, "1"));
+
+    //pid ranges only apply to their own vid
+    TEST_CHECK(!test_restart(&ctx, 0x12d1, 0x9000, "1"));
+    TEST_CHECK(!test_restart(&ctx, 0x1198, 0x9000, "1"));
+    TEST_CHECK(!test_restart(&ctx, 0x119a, 0x68c0, "1"));
+
+    test_destroy(&ctx);
+}
+
+static void test_wildcards(void)
+{
+    struct usb_monitor_ctx ctx;
+    const struct test_entry entries[] = {
+        //No pid
+        {0x1199, 0, UINT16_MAX, NULL, 1},
+        //No vid and no pid, everything under 2
+        {0, 0, UINT16_MAX, "2", 1},
+        //No vid, a pid range under 3
+        {0, 0x0100, 0x01ff, "3", 1},
+        //vid entries win over any vid entries for the same path
+        {0x05c6, 0, UINT16_MAX, "3", 0},
+    };
+
+    test_create(&ctx, entries, 4);
+
+    TEST_CHECK(test_restart(&ctx, 0x1199, 0, "1"));
+    TEST_CHECK(test_restart(&ctx, 0x1199, 0x1234, "1"));
+    TEST_CHECK(test_restart(&ctx, 0x1199, UINT16_MAX, "1"));
+    TEST_CHECK(!test_restart(&ctx, 0x1198, 0x1234, "1"));
+
+    TEST_CHECK(test_restart(&ctx, 0x1234, 0x5678, "2"));
+    TEST_CHECK(test_restart(&ctx, UINT16_MAX, UINT16_MAX, "21"));
+    TEST_CHECK(!test_restart(&ctx, 0x1234, 0x5678, "1"));
+
+    TEST_CHECK(test_restart(&ctx, 0x1234, 0x0100, "31"));
+    TEST_CHECK(test_restart(&ctx, 0x1234, 0x01ff, "3"));
+    TEST_CHECK(!test_restart(&ctx, 0x1234, 0x0200, "3"));
+    TEST_CHECK(!test_restart(&ctx, 0x05c6, 0x0150, "3"));
+    TEST_CHECK(test_match(&ctx, 0x05c6, 0x0150, "3", NULL)->vid == 0x05c6);
+
+    //The global entry still applies under 3, no entry for 3 contains it
+    TEST_CHECK(test_restart(&ctx, 0x1199, 0x0200, "3"));
+
+    test_destroy(&ctx);
+}
+
+static void test_path_precedence(void)
+{
+    struct usb_monitor_ctx ctx;
+    const struct test_entry entries[] = {
+        {0x1e0e, 0, UINT16_MAX, NULL, 1},
+        {0x1e0e, 0, UINT16_MAX, "31", 0},
+        {0x1e0e, 0x9001, 0x9001, "312", 1},
+        //A path entry for another vid does not hide the global entry
+        {0x2c7c, 0x0125, 0x0125, "4", 1},
+    };
+    struct usb_bad_device *match;
+
+    test_create(&ctx, entries, 4);
+    TEST_CHECK(ctx.num_global_bad_ids == 1);
+
+    TEST_CHECK(test_restart(&ctx, 0x1e0e, 0x9001, "1"));
+    TEST_CHECK(test_restart(&ctx, 0x1e0e, 0x9001, "3"));
+    TEST_CHECK(test_restart(&ctx, 0x1e0e, 0x9001, "32"));
+
+    //restart false under 31 exempts the ports from the global entry
+    TEST_CHECK(!test_restart(&ctx, 0x1e0e, 0x9001, "31"));
+    TEST_CHECK(!test_restart(&ctx, 0x1e0e, 0x9001, "311"));
+    TEST_CHECK(test_match(&ctx, 0x1e0e, 0x9001, "311", NULL)->path_len == 2);
+
+    //Except for pid 0x9001 under 312, the longest path wins
+    TEST_CHECK(test_restart(&ctx, 0x1e0e, 0x9001, "312"));
+    TEST_CHECK(test_restart(&ctx, 0x1e0e, 0x9001, "3121"));
+    TEST_CHECK(!test_restart(&ctx, 0x1e0e, 0x9002, "312"));
+
+    TEST_CHECK(test_restart(&ctx, 0x1e0e, 0x9001, "4"));
+    TEST_CHECK(test_restart(&ctx, 0x2c7c, 0x0125, "41"));
+    TEST_CHECK(!test_restart(&ctx, 0x2c7c, 0x0125, "5"));
+
+    //With two paths, the longest path that matches wins, independent of the
+    //order of the paths
+    match = test_match(&ctx, 0x1e0e, 0x9001, "312", "31");
+    TEST_CHECK(match && match->path_len == 3 && match->restart);
+    match = test_match(&ctx, 0x1e0e, 0x9001, "31", "312");
+    TEST_CHECK(match && match->path_len == 3 && match->restart);
+    match = test_match(&ctx, 0x1e0e, 0x9001, "1", "311");
+    TEST_CHECK(match && match->path_len == 2 && !match->restart);
+
+    test_destroy(&ctx);
+}
+
+static void test_search_edges(void)
+{
+    struct usb_monitor_ctx ctx;
+    //Given out of order, the table is sorted when it is indexed
+    const struct test_entry entries[] = {
+        {0x2000, 0x0010, 0x0020, NULL, 1},
+        {UINT16_MAX, 0xfff0, UINT16_MAX, NULL, 1},
+        {0x2000, 0x0000, 0x0005, NULL, 1},
+        {0x0001, 0x0000, 0x0000, NULL, 1},
+        //Overlapping ranges, the one with the lowest pid_min decides
+        {0x3000, 0x0100, 0x0300, NULL, 0},
+        {0x3000, 0x0050, 0x0200, NULL, 1},
+        {0x3000, 0x0080, 0x0100, NULL, 0},
+        {0x2000, 0x0018, 0x0030, NULL, 1},
+    };
+    struct usb_bad_device *match;
+    uint32_t i;
+
+    test_create(&ctx, entries, 8);
+
+    for (i = 1; i < ctx.num_bad_device_ids; i++)
+        TEST_CHECK(usb_bad_ids_cmp(&(ctx.bad_device_ids[i - 1]),
+                                   &(ctx.bad_device_ids[i])) < 0);
+
+    //First and last entry of the table
+    TEST_CHECK(test_match(&ctx, 0x0001, 0, "1", NULL) ==
+               &(ctx.bad_device_ids[0]));
+    TEST_CHECK(!test_restart(&ctx, 0x0001, 1, "1"));
+    TEST_CHECK(!test_restart(&ctx, 0x0000, 0, "1"));
+    TEST_CHECK(test_match(&ctx, UINT16_MAX, UINT16_MAX, "1", NULL) ==
+               &(ctx.bad_device_ids[ctx.num_bad_device_ids - 1]));
+    TEST_CHECK(test_restart(&ctx, UINT16_MAX, 0xfff0, "1"));
+    TEST_CHECK(!test_restart(&ctx, UINT16_MAX, 0xffef, "1"));
+    TEST_CHECK(!test_restart(&ctx, UINT16_MAX - 1, UINT16_MAX, "1"));
+
+    //Several ranges for one vid, with a gap and an overlap
+    TEST_CHECK(test_restart(&ctx, 0x2000, 0x0000, "1"));
+    TEST_CHECK(test_restart(&ctx, 0x2000, 0x0005, "1"));
+    TEST_CHECK(!test_restart(&ctx, 0x2000, 0x0006, "1"));
+    TEST_CHECK(!test_restart(&ctx, 0x2000, 0x000f, "1"));
+    TEST_CHECK(test_restart(&ctx, 0x2000, 0x0010, "1"));
+    TEST_CHECK(test_restart(&ctx, 0x2000, 0x001c, "1"));
+    TEST_CHECK(test_restart(&ctx, 0x2000, 0x0030, "1"));
+    TEST_CHECK(!test_restart(&ctx, 0x2000, 0x0031, "1"));
+
+    match = test_match(&ctx, 0x2000, 0x001c, "1", NULL);
+    TEST_CHECK(match->pid_min == 0x0010);
+    match = test_match(&ctx, 0x2000, 0x0025, "1", NULL);
+    TEST_CHECK(match->pid_min == 0x0018);
+
+    TEST_CHECK(!test_restart(&ctx, 0x3000, 0x004f, "1"));
+    TEST_CHECK(test_restart(&ctx, 0x3000, 0x0050, "1"));
+    TEST_CHECK(test_restart(&ctx, 0x3000, 0x0090, "1"));
+    TEST_CHECK(test_restart(&ctx, 0x3000, 0x0200, "1"));
+    TEST_CHECK(!test_restart(&ctx, 0x3000, 0x0201, "1"));
+    TEST_CHECK(!test_restart(&ctx, 0x3000, 0x0300, "1"));
+    TEST_CHECK(!test_restart(&ctx, 0x3000, 0x0301, "1"));
+    TEST_CHECK(!test_match(&ctx, 0x3000, 0x0301, "1", NULL));
+
+    test_destroy(&ctx);
+}
+
+//Compare with a linear scan of a random table, the scan uses the same rules
+//as usb_bad_ids_match() for entries without path
+static void test_random(void)
+{
+    struct usb_monitor_ctx ctx;
+    struct test_entry entries[64];
+    struct usb_bad_device *match, *expected;
+    uint64_t seed = 0x9e3779b97f4a7c15ULL;
+    uint32_t i, j;
+    uint16_t vid, pid, tmp;
+
+    for (i = 0; i < 64; i++) {
+        seed ^= seed << 13;
+        seed ^= seed >> 7;
+        seed ^= seed << 17;
+
+        entries[i].vid = 1 + (seed % 8);
+        entries[i].pid_min = (seed >> 8) % 64;
+        entries[i].pid_max = (seed >> 16) % 64;
+        entries[i].path = NULL;
+        entries[i].restart = (seed >> 24) & 1;
+
+        if (entries[i].pid_min > entries[i].pid_max) {
+            tmp = entries[i].pid_min;
+            entries[i].pid_min = entries[i].pid_max;
+            entries[i].pid_max = tmp;
+        }
+    }
+
+    test_create(&ctx, entries, 64);
+
+    for (vid = 0; vid < 10; vid++) {
+        for (pid = 0; pid < 66; pid++) {
+            expected = NULL;
+
+            for (j = 0; j < ctx.num_bad_device_ids; j++) {
+                if (ctx.bad_device_ids[j].vid == vid &&
+                    ctx.bad_device_ids[j].pid_min <= pid &&
+                    ctx.bad_device_ids[j].pid_max >= pid) {
+                    expected = &(ctx.bad_device_ids[j]);
+                    break;
+                }
+            }
+
+            match = test_match(&ctx, vid, pid, "1", NULL);
+            TEST_CHECK(match == expected);
+        }
+    }
+
+    test_destroy(&ctx);
+}
+
+int main(int argc, char *argv[])
+{
+    test_pid_ranges();
+    printf("pid_ranges: OK\n");
+    test_wildcards();
+    printf("wildcards: OK\n");
+    test_path_precedence();
+    printf("path_precedence: OK\n");
+    test_search_edges();
+    printf("search_edges: OK\n");
+    test_random();
+    printf("random: OK\n");
+
+    return EXIT_SUCCESS;
+}
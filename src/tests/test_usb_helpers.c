@@ -0,0 +1,1035 @@
+/*
+ * Copyright 2015 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Usb Monitor. Usb Monitor is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * Usb Montior is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Usb Monitor. If not, see http://www.gnu.org/licenses/.
+ */
+
+//Tests for the ping and restart logic in usb_helpers. The implementation is
+//included, with clock_gettime() and random() replaced by values the test
+//controls. libusb and the lists are replaced by the minimal stubs at the top of
+//this file, so that pings can be submitted and completed by the test
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+
+static uint64_t test_now_us;
+static long test_random_value;
+
+static int test_clock_gettime(clockid_t clk_id, struct timespec *tp)
+{
+    tp->tv_sec = test_now_us / 1000000;
+    tp->tv_nsec = (test_now_us % 1000000) * 1000;
+    return 0;
+}
+
+static long test_random(void)
+{
+    return test_random_value;
+}
+
+#define clock_gettime test_clock_gettime
+#define random test_random
+#include "../usb_helpers.c"
+#undef random
+#undef clock_gettime
+
+#define TEST_CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                    #cond); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+#define TEST_NOW_MS (test_now_us / 1000)
+
+//libusb, only what usb_helpers uses. Handles are never dereferenced
+static uint32_t test_num_opens, test_num_submits;
+static int test_submit_retval;
+
+int libusb_open(libusb_device *dev, libusb_device_handle **dev_handle)
+{
+    *dev_handle = (libusb_device_handle*) dev;
+    test_num_opens++;
+    return 0;
+}
+
+void libusb_close(libusb_device_handle *dev_handle)
+{
+}
+
+struct libusb_transfer *libusb_alloc_transfer(int iso_packets)
+{
+    return calloc(1, sizeof(struct libusb_transfer));
+}
+
+void libusb_free_transfer(struct libusb_transfer *transfer)
+{
+    free(transfer);
+}
+
+int libusb_submit_transfer(struct libusb_transfer *transfer)
+{
+    test_num_submits++;
+    return test_submit_retval;
+}
+
+int libusb_cancel_transfer(struct libusb_transfer *transfer)
+{
+    return 0;
+}
+
+int libusb_release_interface(libusb_device_handle *dev_handle,
+                             int interface_number)
+{
+    return 0;
+}
+
+int libusb_control_transfer(libusb_device_handle *dev_handle,
+                            uint8_t request_type, uint8_t bRequest,
+                            uint16_t wValue, uint16_t wIndex,
+                            unsigned char *data, uint16_t wLength,
+                            unsigned int timeout)
+{
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+const char *libusb_error_name(int errcode)
+{
+    return "test";
+}
+
+ssize_t libusb_get_device_list(libusb_context *ctx, libusb_device ***list)
+{
+    return LIBUSB_ERROR_NOT_SUPPORTED;
+}
+
+void libusb_free_device_list(libusb_device **list, int unref_devices)
+{
+}
+
+uint8_t libusb_get_bus_number(libusb_device *dev)
+{
+    return 1;
+}
+
+int libusb_get_port_numbers(libusb_device *dev, uint8_t *port_numbers,
+                            int port_numbers_len)
+{
+    port_numbers[0] = 1;
+    return 1;
+}
+
+int libusb_get_device_descriptor(libusb_device *dev,
+                                 struct libusb_device_descriptor *desc)
+{
+    memset(desc, 0, sizeof(*desc));
+    return 0;
+}
+
+void libusb_unref_device(libusb_device *dev)
+{
+}
+
+void libusb_lock_events(libusb_context *ctx)
+{
+}
+
+void libusb_unlock_events(libusb_context *ctx)
+{
+}
+
+//The rest of usb_monitor. Timeouts are not run by an event loop, the test
+//reads timeout_clock of the port instead
+static uint32_t test_num_timeouts;
+
+void usb_monitor_lists_add_port(struct usb_monitor_ctx *ctx,
+                                struct usb_port *port)
+{
+}
+
+void usb_monitor_lists_index_port(struct usb_monitor_ctx *ctx,
+                                  struct usb_port *port)
+{
+}
+
+uint32_t usb_monitor_lists_foreach_port_path(struct usb_monitor_ctx *ctx,
+                                             uint8_t *prefix,
+                                             uint8_t prefix_len,
+                                             usb_path_tree_cb cb, void *data)
+{
+    return 0;
+}
+
+void usb_monitor_lists_add_timeout(struct usb_monitor_ctx *ctx,
+                                   struct usb_port *port)
+{
+    test_num_timeouts++;
+}
+
+void usb_monitor_lists_del_timeout(struct usb_port *port)
+{
+}
+
+uint8_t usb_monitor_lists_is_timeout_active(struct usb_port *port)
+{
+    return 0;
+}
+
+int usb_monitor_cb(libusb_context *ctx, libusb_device *device,
+                   libusb_hotplug_event event, void *user_data)
+{
+    return 0;
+}
+
+void usb_monitor_update_libusb_timeout(struct usb_monitor_ctx *ctx)
+{
+}
+
+void backend_event_loop_post_task(struct backend_event_loop *del,
+                                  struct backend_itr_task *task)
+{
+}
+
+static void test_output(struct usb_port *port)
+{
+}
+
+static uint32_t test_num_restarts;
+
+static int32_t test_update(struct usb_port *port, uint8_t cmd)
+{
+    test_num_restarts += cmd == CMD_RESTART;
+    return 0;
+}
+
+static void test_init_ctx(struct usb_monitor_ctx *ctx)
+{
+    memset(ctx, 0, sizeof(*ctx));
+
+    //Failed pings are logged
+    TEST_CHECK((ctx->logfile = fopen("/dev/null", "w")) != NULL);
+    TAILQ_INIT(&(ctx->ping_queue));
+    TAILQ_INIT(&(ctx->handle_lru));
+    usb_path_tree_init(&(ctx->probe_rule_tree));
+    usb_path_tree_init(&(ctx->ping_rule_tree));
+    usb_path_tree_init(&(ctx->bad_id_tree));
+}
+
+static void test_destroy_ctx(struct usb_monitor_ctx *ctx)
+{
+    usb_path_tree_destroy(&(ctx->ping_rule_tree));
+    usb_path_tree_destroy(&(ctx->probe_rule_tree));
+    usb_path_tree_destroy(&(ctx->bad_id_tree));
+    fclose(ctx->logfile);
+}
+
+//path is a string of digits, "312" is the path 3-1.2
+static void test_init_port(struct usb_monitor_ctx *ctx, struct usb_port *port,
+                           const char *path)
+{
+    char path_bytes[USB_PATH_MAX];
+    uint8_t path_len;
+
+    for (path_len = 0; path[path_len]; path_len++)
+        path_bytes[path_len] = path[path_len] - '0';
+
+    memset(port, 0, sizeof(*port));
+    TEST_CHECK(!usb_helpers_configure_port(port, ctx, path_bytes, path_len, 1,
+                                           NULL));
+    port->output = test_output;
+    port->update = test_update;
+    port->msg_mode = PING;
+    port->status = PORT_DEV_CONNECTED;
+    port->ping_interval_ms = port->ping_cur_interval_ms = 5000;
+    port->ping_max_interval_ms = 5000;
+    port->ping_timeout_ms = 1000;
+    port->retrans_limit = 2;
+}
+
+//Milliseconds from now until the port timeout expires
+static uint64_t test_timeout_in(struct usb_port *port)
+{
+    return port->timeout_handle.timeout_clock - TEST_NOW_MS;
+}
+
+static void test_jitter(void)
+{
+    struct usb_monitor_ctx ctx;
+    struct usb_port port;
+
+    test_init_ctx(&ctx);
+    test_init_port(&ctx, &port, "12");
+    test_now_us = 1000000000ULL;
+
+    //+/- 10%, both ends included
+    test_random_value = 0;
+    TEST_CHECK(usb_helpers_add_jitter(1000) == 900);
+    test_random_value = 100;
+    TEST_CHECK(usb_helpers_add_jitter(1000) == 1000);
+    test_random_value = 200;
+    TEST_CHECK(usb_helpers_add_jitter(1000) == 1100);
+    test_random_value = 201;
+    TEST_CHECK(usb_helpers_add_jitter(1000) == 900);
+
+    //Too short to be moved
+    TEST_CHECK(usb_helpers_add_jitter(9) == 9);
+    TEST_CHECK(usb_helpers_add_jitter(0) == 0);
+
+    //Pings are jittered
+    test_random_value = 0;
+    usb_helpers_start_ping_timeout(&port, 5000, 0);
+    TEST_CHECK(test_timeout_in(&port) == 4500);
+    test_random_value = 1000;
+    usb_helpers_start_ping_timeout(&port, 5000, 0);
+    TEST_CHECK(test_timeout_in(&port) == 5500);
+
+    //The steps of a reset are exact, no matter what random() returns
+    for (test_random_value = 0; test_random_value < 2000;
+         test_random_value += 999) {
+        usb_helpers_start_timeout(&port, 3);
+        TEST_CHECK(test_timeout_in(&port) == 3000);
+        usb_helpers_start_timeout(&port, DEFAULT_TIMEOUT_SEC);
+        TEST_CHECK(test_timeout_in(&port) == DEFAULT_TIMEOUT_SEC * 1000);
+    }
+
+    test_destroy_ctx(&ctx);
+}
+
+static void test_phase(void)
+{
+    struct usb_monitor_ctx ctx;
+    struct usb_port port, sibling;
+    uint32_t phase, sibling_phase;
+
+    test_init_ctx(&ctx);
+    test_init_port(&ctx, &port, "12");
+    test_init_port(&ctx, &sibling, "13");
+    test_now_us = 2000000000ULL;
+
+    //Middle of the jitter range, so that only the phase moves the timeout
+    test_random_value = 1000;
+
+    phase = usb_monitor_hash_scale(port.path[0].key, port.ping_interval_ms);
+    TEST_CHECK(phase < port.ping_interval_ms);
+    usb_helpers_start_ping_timeout(&port, 10000, 1);
+    TEST_CHECK(test_timeout_in(&port) == 10000 + phase);
+
+    //The phase of a port is always the same
+    test_now_us += 123456;
+    usb_helpers_start_ping_timeout(&port, 10000, 1);
+    TEST_CHECK(test_timeout_in(&port) == 10000 + phase);
+
+    //Neighbours are not pinged at the same time
+    sibling_phase = usb_monitor_hash_scale(sibling.path[0].key,
+                                           sibling.ping_interval_ms);
+    TEST_CHECK(sibling_phase != phase);
+    usb_helpers_start_ping_timeout(&sibling, 10000, 1);
+    TEST_CHECK(test_timeout_in(&sibling) == 10000 + sibling_phase);
+
+    //The phase follows the ping interval of the port
+    port.ping_interval_ms = 100;
+    usb_helpers_start_ping_timeout(&port, 10000, 1);
+    TEST_CHECK(test_timeout_in(&port) >= 10000 &&
+               test_timeout_in(&port) < 10100);
+
+    //Only the first ping gets a phase
+    usb_helpers_start_ping_timeout(&port, 10000, 0);
+    TEST_CHECK(test_timeout_in(&port) == 10000);
+
+    test_destroy_ctx(&ctx);
+}
+
+//Bucket of the last sample added to port
+static uint32_t test_rtt_bucket(struct usb_port *port, uint64_t rtt_us)
+{
+    uint16_t before[USB_RTT_BUCKETS];
+    uint32_t i, bucket = USB_RTT_BUCKETS;
+
+    memcpy(before, port->rtt_hist, sizeof(before));
+    usb_helpers_add_rtt(port, rtt_us);
+
+    for (i = 0; i < USB_RTT_BUCKETS; i++) {
+        if (port->rtt_hist[i] != before[i]) {
+            TEST_CHECK(bucket == USB_RTT_BUCKETS);
+            TEST_CHECK(port->rtt_hist[i] == before[i] + 1);
+            bucket = i;
+        }
+    }
+
+    return bucket;
+}
+
+static void test_rtt_hist(void)
+{
+    struct usb_monitor_ctx ctx;
+    struct usb_port port;
+    uint32_t i;
+
+    test_init_ctx(&ctx);
+    test_init_port(&ctx, &port, "12");
+
+    TEST_CHECK(test_rtt_bucket(&port, 0) == 0);
+    TEST_CHECK(test_rtt_bucket(&port, USB_RTT_MIN_US - 1) == 0);
+
+    //Both edges of every bucket with an upper bound
+    for (i = 1; i < USB_RTT_BUCKETS - 1; i++) {
+        TEST_CHECK(test_rtt_bucket(&port, USB_RTT_MIN_US << (i - 1)) == i);
+        TEST_CHECK(test_rtt_bucket(&port, (USB_RTT_MIN_US << i) - 1) == i);
+    }
+
+    //The last bucket starts at ~2.1 s and has no upper bound
+    TEST_CHECK((USB_RTT_MIN_US << (USB_RTT_BUCKETS - 2)) == 2097152);
+    TEST_CHECK(test_rtt_bucket(&port, 2097151) == USB_RTT_BUCKETS - 2);
+    TEST_CHECK(test_rtt_bucket(&port, 2097152) == USB_RTT_BUCKETS - 1);
+    TEST_CHECK(test_rtt_bucket(&port, 4200000) == USB_RTT_BUCKETS - 1);
+    TEST_CHECK(test_rtt_bucket(&port, UINT64_MAX) == USB_RTT_BUCKETS - 1);
+    TEST_CHECK(port.rtt_last_us == UINT32_MAX);
+
+    //A full bucket halves all buckets before it is incremented
+    memset(port.rtt_hist, 0, sizeof(port.rtt_hist));
+    port.rtt_hist[3] = UINT16_MAX;
+    port.rtt_hist[4] = UINT16_MAX - 1;
+    port.rtt_hist[9] = 3;
+    usb_helpers_add_rtt(&port, USB_RTT_MIN_US << 2);
+    TEST_CHECK(port.rtt_hist[3] == (UINT16_MAX >> 1) + 1);
+    TEST_CHECK(port.rtt_hist[4] == (UINT16_MAX - 1) >> 1);
+    TEST_CHECK(port.rtt_hist[9] == 1);
+    usb_helpers_add_rtt(&port, USB_RTT_MIN_US << 3);
+    TEST_CHECK(port.rtt_hist[4] == ((UINT16_MAX - 1) >> 1) + 1);
+
+    test_destroy_ctx(&ctx);
+}
+
+static void test_rtt_ewma(void)
+{
+    struct usb_monitor_ctx ctx;
+    struct usb_port port;
+    uint32_t i;
+
+    test_init_ctx(&ctx);
+    test_init_port(&ctx, &port, "12");
+
+    //First sample is used as is, then every sample has a weight of 1/8
+    usb_helpers_add_rtt(&port, 1000);
+    TEST_CHECK(port.rtt_ewma_us == 1000 && port.rtt_last_us == 1000);
+    usb_helpers_add_rtt(&port, 1800);
+    TEST_CHECK(port.rtt_ewma_us == 1100 && port.rtt_last_us == 1800);
+    usb_helpers_add_rtt(&port, 300);
+    TEST_CHECK(port.rtt_ewma_us == 1000 && port.rtt_last_us == 300);
+
+    //Differences below 8 us are rounded away in both directions
+    usb_helpers_add_rtt(&port, 1007);
+    TEST_CHECK(port.rtt_ewma_us == 1000);
+    usb_helpers_add_rtt(&port, 993);
+    TEST_CHECK(port.rtt_ewma_us == 1000);
+    usb_helpers_add_rtt(&port, 1008);
+    TEST_CHECK(port.rtt_ewma_us == 1001);
+    usb_helpers_add_rtt(&port, 993);
+    TEST_CHECK(port.rtt_ewma_us == 1000);
+
+    //Converges from both sides, to within the rounding
+    for (i = 0; i < 100; i++)
+        usb_helpers_add_rtt(&port, 50000);
+
+    TEST_CHECK(port.rtt_ewma_us <= 50000 && port.rtt_ewma_us > 50000 - 8);
+
+    for (i = 0; i < 100; i++)
+        usb_helpers_add_rtt(&port, 200);
+
+    TEST_CHECK(port.rtt_ewma_us >= 200 && port.rtt_ewma_us < 200 + 8);
+
+    //Cleared when the device is removed
+    usb_helpers_reset_port(&port);
+    TEST_CHECK(!port.rtt_ewma_us && !port.rtt_last_us);
+
+    for (i = 0; i < USB_RTT_BUCKETS; i++)
+        TEST_CHECK(!port.rtt_hist[i]);
+
+    test_destroy_ctx(&ctx);
+}
+
+//Devices are only compared and passed to the libusb stubs
+static uint8_t test_dev[4];
+
+//Complete the ping of transfer, like libusb does when the reply arrives or
+//the transfer fails
+static void test_complete(struct libusb_transfer *transfer, int status)
+{
+    transfer->status = status;
+    transfer->callback(transfer);
+}
+
+static void test_ping_state(void)
+{
+    struct usb_monitor_ctx ctx;
+    struct usb_port port;
+    uint32_t num_timeouts;
+
+    test_init_ctx(&ctx);
+    test_init_port(&ctx, &port, "12");
+    port.dev = (libusb_device*) &test_dev[0];
+    test_now_us = 3000000000ULL;
+    test_num_opens = test_num_submits = 0;
+
+    //The first ping opens the handle and queues the ping
+    TEST_CHECK(port.ping_state == PING_IDLE);
+    usb_helpers_send_ping(&port);
+    TEST_CHECK(port.ping_state == PING_QUEUED);
+    TEST_CHECK(port.dev_handle && port.ping_transfer);
+    TEST_CHECK(test_num_opens == 1 && ctx.num_open_handles == 1);
+    TEST_CHECK(TAILQ_FIRST(&(ctx.ping_queue)) == &port);
+    TEST_CHECK(test_num_submits == 0);
+
+    //A port is never queued twice, the ping is tried again later
+    num_timeouts = test_num_timeouts;
+    usb_helpers_send_ping(&port);
+    TEST_CHECK(port.ping_state == PING_QUEUED);
+    TEST_CHECK(TAILQ_NEXT(&port, ping_next) == NULL);
+    TEST_CHECK(test_num_timeouts == num_timeouts + 1);
+
+    //The round submits the queued pings
+    usb_helpers_ping_round_cb(&ctx);
+    TEST_CHECK(port.ping_state == PING_IN_FLIGHT);
+    TEST_CHECK(TAILQ_EMPTY(&(ctx.ping_queue)));
+    TEST_CHECK(test_num_submits == 1 && ctx.pings_in_flight == 1);
+    TEST_CHECK(port.ping_submit_us == test_now_us);
+
+    //In flight is not queued again either
+    usb_helpers_send_ping(&port);
+    TEST_CHECK(port.ping_state == PING_IN_FLIGHT);
+    TEST_CHECK(TAILQ_EMPTY(&(ctx.ping_queue)));
+
+    //Reply, the round is over and the next ping is scheduled
+    test_now_us += 700;
+    num_timeouts = test_num_timeouts;
+    test_complete(port.ping_transfer, LIBUSB_TRANSFER_COMPLETED);
+    TEST_CHECK(port.ping_state == PING_IDLE);
+    TEST_CHECK(ctx.pings_in_flight == 0);
+    TEST_CHECK(ctx.ping_stats.rounds == 1 && ctx.ping_stats.pinged == 1);
+    TEST_CHECK(ctx.ping_stats.failures == 0);
+    TEST_CHECK(ctx.ping_stats.last_round_us == 700);
+    TEST_CHECK(port.rtt_last_us == 700 && port.num_retrans == 0);
+    TEST_CHECK(test_num_timeouts == num_timeouts + 1);
+
+    //The handle and the transfer are reused for the next ping
+    usb_helpers_send_ping(&port);
+    usb_helpers_ping_round_cb(&ctx);
+    TEST_CHECK(test_num_opens == 1 && test_num_submits == 2);
+    test_complete(port.ping_transfer, LIBUSB_TRANSFER_TIMED_OUT);
+    TEST_CHECK(port.ping_state == PING_IDLE);
+    TEST_CHECK(ctx.ping_stats.rounds == 2 && ctx.ping_stats.failures == 1);
+    TEST_CHECK(port.num_retrans == 1 && port.rtt_last_us == 700);
+
+    //A failed submit closes the handle, and the round ends right away
+    test_submit_retval = LIBUSB_ERROR_IO;
+    usb_helpers_send_ping(&port);
+    usb_helpers_ping_round_cb(&ctx);
+    test_submit_retval = 0;
+    TEST_CHECK(port.ping_state == PING_IDLE);
+    TEST_CHECK(!port.dev_handle && !port.ping_transfer);
+    TEST_CHECK(ctx.num_open_handles == 0 && TAILQ_EMPTY(&(ctx.handle_lru)));
+    TEST_CHECK(ctx.pings_in_flight == 0 && ctx.ping_stats.rounds == 3);
+    TEST_CHECK(ctx.ping_stats.last_round_failures == 1);
+
+    //An empty queue is not a round
+    usb_helpers_ping_round_cb(&ctx);
+    TEST_CHECK(ctx.ping_stats.rounds == 3);
+
+    test_destroy_ctx(&ctx);
+}
+
+static void test_ping_reset(void)
+{
+    struct usb_monitor_ctx ctx;
+    struct usb_port port_a, port_b;
+    struct libusb_transfer *transfer;
+    uint32_t num_submits;
+
+    test_init_ctx(&ctx);
+    test_init_port(&ctx, &port_a, "12");
+    test_init_port(&ctx, &port_b, "13");
+    port_a.dev = (libusb_device*) &test_dev[0];
+    port_b.dev = (libusb_device*) &test_dev[1];
+    test_now_us = 4000000000ULL;
+
+    usb_helpers_send_ping(&port_a);
+    usb_helpers_send_ping(&port_b);
+    TEST_CHECK(TAILQ_FIRST(&(ctx.ping_queue)) == &port_a);
+    TEST_CHECK(TAILQ_NEXT(&port_a, ping_next) == &port_b);
+
+    //Device is removed while its ping is queued, the ping is dropped
+    usb_helpers_reset_port(&port_a);
+    TEST_CHECK(port_a.ping_state == PING_IDLE);
+    TEST_CHECK(!port_a.dev_handle && !port_a.ping_transfer && !port_a.dev);
+    TEST_CHECK(TAILQ_FIRST(&(ctx.ping_queue)) == &port_b);
+    TEST_CHECK(TAILQ_NEXT(&port_b, ping_next) == NULL);
+    TEST_CHECK(ctx.num_open_handles == 1);
+
+    num_submits = test_num_submits;
+    usb_helpers_ping_round_cb(&ctx);
+    TEST_CHECK(test_num_submits == num_submits + 1);
+    TEST_CHECK(port_b.ping_state == PING_IN_FLIGHT);
+    TEST_CHECK(ctx.ping_round_pinged == 1);
+
+    //Device is removed while its ping is in flight. The transfer is cancelled
+    //and detached from the port, and the round is over
+    transfer = port_b.ping_transfer;
+    usb_helpers_reset_port(&port_b);
+    TEST_CHECK(port_b.ping_state == PING_IDLE);
+    TEST_CHECK(!port_b.dev_handle && !port_b.ping_transfer);
+    TEST_CHECK(transfer->user_data == NULL);
+    TEST_CHECK(ctx.pings_in_flight == 0 && ctx.ping_stats.rounds == 1);
+    TEST_CHECK(ctx.num_open_handles == 0 && TAILQ_EMPTY(&(ctx.handle_lru)));
+
+    //The cancelled transfer completes later and is freed without touching the
+    //port
+    test_complete(transfer, LIBUSB_TRANSFER_CANCELLED);
+    TEST_CHECK(port_b.num_retrans == 0 && ctx.ping_stats.rounds == 1);
+    TEST_CHECK(ctx.ping_stats.failures == 0);
+
+    test_destroy_ctx(&ctx);
+}
+
+//Send a ping from port and let the device answer it
+static void test_ping(struct usb_monitor_ctx *ctx, struct usb_port *port)
+{
+    usb_helpers_send_ping(port);
+    usb_helpers_ping_round_cb(ctx);
+    TEST_CHECK(port->ping_state == PING_IN_FLIGHT);
+    test_complete(port->ping_transfer, LIBUSB_TRANSFER_COMPLETED);
+}
+
+static void test_handle_lru(void)
+{
+    struct usb_monitor_ctx ctx;
+    struct usb_port ports[4];
+    const char *paths[4] = {"12", "13", "14", "15"};
+    uint32_t i;
+
+    test_init_ctx(&ctx);
+    test_now_us = 5000000000ULL;
+    test_num_opens = 0;
+
+    for (i = 0; i < 4; i++) {
+        test_init_port(&ctx, &ports[i], paths[i]);
+        ports[i].dev = (libusb_device*) &test_dev[i];
+    }
+
+    //No limit
+    for (i = 0; i < 4; i++)
+        test_ping(&ctx, &ports[i]);
+
+    TEST_CHECK(ctx.num_open_handles == 4 && test_num_opens == 4);
+    TEST_CHECK(ctx.handle_stats.opens == 4);
+    TEST_CHECK(ctx.handle_stats.evictions == 0);
+
+    //Lowering the limit closes handles when the next one is opened
+    for (i = 0; i < 4; i++)
+        usb_helpers_close_handle(&ports[i]);
+
+    ctx.max_open_handles = 2;
+    test_ping(&ctx, &ports[0]);
+    test_ping(&ctx, &ports[1]);
+    TEST_CHECK(ctx.num_open_handles == 2 && ctx.handle_stats.evictions == 0);
+
+    //The least recently pinged port loses its handle
+    test_ping(&ctx, &ports[2]);
+    TEST_CHECK(ctx.num_open_handles == 2 && ctx.handle_stats.evictions == 1);
+    TEST_CHECK(!ports[0].dev_handle && !ports[0].ping_transfer);
+    TEST_CHECK(ports[1].dev_handle && ports[2].dev_handle);
+    TEST_CHECK(TAILQ_FIRST(&(ctx.handle_lru)) == &ports[1]);
+
+    //Pinging a port with an open handle makes it the most recent one
+    test_ping(&ctx, &ports[1]);
+    TEST_CHECK(TAILQ_FIRST(&(ctx.handle_lru)) == &ports[2]);
+    TEST_CHECK(ctx.handle_stats.opens == 7);
+
+    //The evicted port opens its handle again on the next ping
+    test_ping(&ctx, &ports[0]);
+    TEST_CHECK(ports[0].dev_handle && !ports[2].dev_handle);
+    TEST_CHECK(ctx.num_open_handles == 2 && ctx.handle_stats.evictions == 2);
+    TEST_CHECK(ctx.handle_stats.opens == 8 && test_num_opens == 8);
+
+    //Ports with a ping queued or in flight keep their handle, and the limit
+    //is exceeded until they are done
+    usb_helpers_send_ping(&ports[1]);
+    usb_helpers_send_ping(&ports[0]);
+    usb_helpers_ping_round_cb(&ctx);
+    usb_helpers_send_ping(&ports[2]);
+    TEST_CHECK(ctx.num_open_handles == 3 && ctx.handle_stats.evictions == 2);
+    TEST_CHECK(ports[0].ping_state == PING_IN_FLIGHT);
+    TEST_CHECK(ports[1].ping_state == PING_IN_FLIGHT);
+    TEST_CHECK(ports[2].ping_state == PING_QUEUED);
+
+    //Once a port is idle, its handle can be taken again
+    test_complete(ports[1].ping_transfer, LIBUSB_TRANSFER_COMPLETED);
+    test_complete(ports[0].ping_transfer, LIBUSB_TRANSFER_COMPLETED);
+    usb_helpers_ping_round_cb(&ctx);
+    test_complete(ports[2].ping_transfer, LIBUSB_TRANSFER_COMPLETED);
+    test_ping(&ctx, &ports[3]);
+    TEST_CHECK(ctx.num_open_handles == 2 && ctx.handle_stats.evictions == 4);
+    TEST_CHECK(!ports[1].dev_handle && !ports[0].dev_handle);
+    TEST_CHECK(ports[2].dev_handle && ports[3].dev_handle);
+
+    for (i = 2; i < 4; i++)
+        usb_helpers_close_handle(&ports[i]);
+
+    TEST_CHECK(ctx.num_open_handles == 0 && TAILQ_EMPTY(&(ctx.handle_lru)));
+    test_destroy_ctx(&ctx);
+}
+
+static void test_backoff_growth(void)
+{
+    struct usb_monitor_ctx ctx;
+    struct usb_port port;
+    uint64_t delay_ms;
+    uint32_t i;
+
+    test_init_ctx(&ctx);
+    test_init_port(&ctx, &port, "12");
+    ctx.backoff_ms = 30000;
+    ctx.backoff_max_ms = 3600000;
+    test_now_us = 6000000000ULL;
+    test_num_restarts = 0;
+
+    //random() returns 0, so the delay is the lower end of [delay / 2, delay]
+    test_random_value = 0;
+    TEST_CHECK(usb_helpers_get_restart_backoff(&port) == 0);
+    TEST_CHECK(!usb_helpers_restart_port(&port));
+    TEST_CHECK(port.num_restarts == 1 && test_num_restarts == 1);
+    TEST_CHECK(usb_helpers_get_restart_backoff(&port) == 15000);
+
+    //Restarts are deferred until the delay has passed
+    test_now_us += 14999 * 1000ULL;
+    TEST_CHECK(usb_helpers_restart_port(&port));
+    TEST_CHECK(port.num_restarts == 1 && test_num_restarts == 1);
+    TEST_CHECK(usb_helpers_get_restart_backoff(&port) == 1);
+
+    //Doubles for every restart, until backoff_max_ms
+    for (i = 2; i <= BACKOFF_MAX_STEPS + 2; i++) {
+        test_now_us += usb_helpers_get_restart_backoff(&port) * 1000ULL;
+        TEST_CHECK(!usb_helpers_restart_port(&port));
+        TEST_CHECK(test_num_restarts == i);
+        TEST_CHECK(port.num_restarts == (i < BACKOFF_MAX_STEPS ?
+                                         i : BACKOFF_MAX_STEPS));
+
+        delay_ms = 30000ULL << (i - 1);
+
+        if (delay_ms > 3600000)
+            delay_ms = 3600000;
+
+        TEST_CHECK(usb_helpers_get_restart_backoff(&port) == delay_ms / 2);
+    }
+
+    //The upper end of the range
+    test_random_value = 1800000;
+    test_now_us += usb_helpers_get_restart_backoff(&port) * 1000ULL;
+    TEST_CHECK(!usb_helpers_restart_port(&port));
+    TEST_CHECK(usb_helpers_get_restart_backoff(&port) == 3600000);
+
+    test_random_value = 15000;
+    TEST_CHECK(usb_helpers_get_backoff_ms(&ctx, 1) == 30000);
+    test_random_value = 15001;
+    TEST_CHECK(usb_helpers_get_backoff_ms(&ctx, 1) == 15000);
+    test_random_value = 0;
+
+    //No backoff
+    ctx.backoff_ms = 0;
+    TEST_CHECK(usb_helpers_get_backoff_ms(&ctx, 1) == 0);
+    test_now_us += usb_helpers_get_restart_backoff(&port) * 1000ULL;
+    TEST_CHECK(!usb_helpers_restart_port(&port));
+    TEST_CHECK(!usb_helpers_restart_port(&port));
+    TEST_CHECK(usb_helpers_get_restart_backoff(&port) == 0);
+
+    test_destroy_ctx(&ctx);
+}
+
+static void test_backoff_decay(void)
+{
+    struct usb_monitor_ctx ctx;
+    struct usb_port port;
+    uint32_t i;
+
+    test_init_ctx(&ctx);
+    test_init_port(&ctx, &port, "12");
+    port.dev = (libusb_device*) &test_dev[0];
+    //Long enough that the restart is still deferred when a step is removed
+    ctx.backoff_ms = 400000;
+    ctx.backoff_max_ms = 3600000;
+    test_now_us = 7000000000ULL;
+    test_random_value = 0;
+
+    for (i = 0; i < 3; i++) {
+        test_now_us += usb_helpers_get_restart_backoff(&port) * 1000ULL;
+        TEST_CHECK(!usb_helpers_restart_port(&port));
+    }
+
+    //test_update() does not restart anything, so the device is still pinged
+    TEST_CHECK(port.num_restarts == 3);
+    TEST_CHECK(usb_helpers_get_restart_backoff(&port) == 800000);
+
+    //One step is removed for every BACKOFF_DECAY_SEC without failed pings
+    test_now_us += (BACKOFF_DECAY_SEC - 1) * 1000000ULL;
+    test_ping(&ctx, &port);
+    TEST_CHECK(port.num_restarts == 3);
+    test_now_us += 1000000;
+    test_ping(&ctx, &port);
+    TEST_CHECK(port.num_restarts == 2);
+
+    //The deferral of the next restart is lifted too
+    TEST_CHECK(usb_helpers_get_restart_backoff(&port) == 0);
+    test_ping(&ctx, &port);
+    TEST_CHECK(port.num_restarts == 2);
+
+    //A failed ping starts the healthy period again
+    test_now_us += (BACKOFF_DECAY_SEC / 2) * 1000000ULL;
+    usb_helpers_send_ping(&port);
+    usb_helpers_ping_round_cb(&ctx);
+    test_complete(port.ping_transfer, LIBUSB_TRANSFER_TIMED_OUT);
+    TEST_CHECK(port.num_restarts == 2);
+    test_now_us += (BACKOFF_DECAY_SEC / 2) * 1000000ULL;
+    test_ping(&ctx, &port);
+    TEST_CHECK(port.num_restarts == 2);
+    test_now_us += (BACKOFF_DECAY_SEC / 2) * 1000000ULL;
+    test_ping(&ctx, &port);
+    TEST_CHECK(port.num_restarts == 1);
+
+    //The next restart starts from the decayed step
+    TEST_CHECK(!usb_helpers_restart_port(&port));
+    TEST_CHECK(port.num_restarts == 2);
+    TEST_CHECK(usb_helpers_get_restart_backoff(&port) == 400000);
+
+    //Fully decayed
+    for (i = 0; i < 2; i++) {
+        test_now_us += BACKOFF_DECAY_SEC * 1000000ULL;
+        test_ping(&ctx, &port);
+    }
+
+    TEST_CHECK(port.num_restarts == 0);
+    test_now_us += BACKOFF_DECAY_SEC * 1000000ULL;
+    test_ping(&ctx, &port);
+    TEST_CHECK(port.num_restarts == 0);
+
+    usb_helpers_reset_port(&port);
+    test_destroy_ctx(&ctx);
+}
+
+//Add a ping rule for path to ctx, like usb_monitor_parse_ping() does
+static void test_add_ping_rule(struct usb_monitor_ctx *ctx,
+                               struct usb_ping_rule *rule, const char *path,
+                               uint8_t fields, uint32_t value)
+{
+    memset(rule, 0, sizeof(*rule));
+
+    for (rule->path_len = 0; path[rule->path_len]; rule->path_len++)
+        rule->path.bytes[rule->path_len] = path[rule->path_len] - '0';
+
+    rule->config.fields = fields;
+    rule->config.interval_ms = value;
+    rule->config.timeout_ms = value;
+    rule->config.added_ms = value;
+    rule->config.max_interval_ms = value;
+    rule->config.retrans_limit = value;
+
+    TEST_CHECK(!usb_path_tree_insert(&(ctx->ping_rule_tree), rule->path.bytes,
+                                     rule->path_len, rule));
+}
+
+static void test_ping_config(void)
+{
+    struct usb_monitor_ctx ctx;
+    struct usb_port port;
+    struct usb_ping_rule rules[6];
+    struct usb_ping_config config;
+
+    test_init_ctx(&ctx);
+    ctx.ping_config.interval_ms = 5000;
+    ctx.ping_config.timeout_ms = 5000;
+    ctx.ping_config.added_ms = 10000;
+    ctx.ping_config.retrans_limit = 5;
+    ctx.handler_ping_config[PORT_TYPE_YKUSH].interval_ms = 30000;
+    ctx.handler_ping_config[PORT_TYPE_YKUSH].fields = PING_CFG_INTERVAL;
+
+    //Added in a different order than they are applied
+    test_add_ping_rule(&ctx, &rules[0], "312", PING_CFG_RETRANS, 1);
+    test_add_ping_rule(&ctx, &rules[1], "3", PING_CFG_TIMEOUT |
+                       PING_CFG_RETRANS, 2);
+    test_add_ping_rule(&ctx, &rules[2], "31", PING_CFG_INTERVAL, 1000);
+    test_add_ping_rule(&ctx, &rules[3], "4", PING_CFG_MAX_INTERVAL, 60000);
+    test_add_ping_rule(&ctx, &rules[4], "41", PING_CFG_ADDED |
+                       PING_CFG_INTERVAL, 20000);
+    test_add_ping_rule(&ctx, &rules[5], "5", PING_CFG_RETRANS, 4);
+
+    //Only the global config. Without max_interval_ms, the interval is fixed
+    test_init_port(&ctx, &port, "21");
+    usb_helpers_get_ping_config(&ctx, &port, &config);
+    TEST_CHECK(config.interval_ms == 5000 && config.timeout_ms == 5000);
+    TEST_CHECK(config.added_ms == 10000 && config.retrans_limit == 5);
+    TEST_CHECK(config.max_interval_ms == 5000);
+
+    //The handler overrides the global config
+    port.port_type = PORT_TYPE_YKUSH;
+    usb_helpers_get_ping_config(&ctx, &port, &config);
+    TEST_CHECK(config.interval_ms == 30000 && config.timeout_ms == 5000);
+    TEST_CHECK(config.max_interval_ms == 30000);
+
+    //Rules override the handler, the longest path last. Each rule only
+    //changes its own fields
+    test_init_port(&ctx, &port, "3121");
+    port.port_type = PORT_TYPE_YKUSH;
+    usb_helpers_get_ping_config(&ctx, &port, &config);
+    TEST_CHECK(config.interval_ms == 1000 && config.timeout_ms == 2);
+    TEST_CHECK(config.added_ms == 10000 && config.retrans_limit == 1);
+    TEST_CHECK(config.max_interval_ms == 1000);
+    TEST_CHECK(config.fields == (PING_CFG_INTERVAL | PING_CFG_TIMEOUT |
+                                 PING_CFG_RETRANS));
+
+    test_init_port(&ctx, &port, "31");
+    usb_helpers_get_ping_config(&ctx, &port, &config);
+    TEST_CHECK(config.interval_ms == 1000 && config.retrans_limit == 2);
+
+    //A sibling of a rule's path is not under it
+    test_init_port(&ctx, &port, "313");
+    usb_helpers_get_ping_config(&ctx, &port, &config);
+    TEST_CHECK(config.interval_ms == 1000 && config.retrans_limit == 2);
+    test_init_port(&ctx, &port, "32");
+    usb_helpers_get_ping_config(&ctx, &port, &config);
+    TEST_CHECK(config.interval_ms == 5000 && config.retrans_limit == 2);
+
+    //max_interval_ms from one rule, interval_ms from a longer one
+    test_init_port(&ctx, &port, "41");
+    usb_helpers_get_ping_config(&ctx, &port, &config);
+    TEST_CHECK(config.interval_ms == 20000 && config.added_ms == 20000);
+    TEST_CHECK(config.max_interval_ms == 60000);
+
+    //A port with two paths gets the rules of both, still shortest first.
+    //"5" is applied before "312", even though it is the second path
+    test_init_port(&ctx, &port, "3121");
+    TEST_CHECK(!usb_helpers_port_add_path(&port, "\x05\x01", 2));
+    usb_helpers_get_ping_config(&ctx, &port, &config);
+    TEST_CHECK(config.interval_ms == 1000 && config.retrans_limit == 1);
+    TEST_CHECK(config.timeout_ms == 2 && config.max_interval_ms == 1000);
+
+    test_init_port(&ctx, &port, "31");
+    TEST_CHECK(!usb_helpers_port_add_path(&port, "\x04\x05", 2));
+    usb_helpers_get_ping_config(&ctx, &port, &config);
+    TEST_CHECK(config.interval_ms == 1000 && config.added_ms == 10000);
+    TEST_CHECK(config.retrans_limit == 2 && config.max_interval_ms == 60000);
+
+    //Both paths under the same rule, the rule is only applied once
+    test_init_port(&ctx, &port, "311");
+    TEST_CHECK(!usb_helpers_port_add_path(&port, "\x03\x01\x02", 3));
+    usb_helpers_get_ping_config(&ctx, &port, &config);
+    TEST_CHECK(config.interval_ms == 1000 && config.retrans_limit == 1);
+
+    test_destroy_ctx(&ctx);
+}
+
+//Answer num pings from port, and check that the next ping is scheduled with
+//the current interval
+static void test_ping_many(struct usb_monitor_ctx *ctx, struct usb_port *port,
+                           uint32_t num)
+{
+    uint32_t i;
+
+    for (i = 0; i < num; i++)
+        test_ping(ctx, port);
+
+    TEST_CHECK(test_timeout_in(port) >= port->ping_cur_interval_ms * 9 / 10);
+    TEST_CHECK(test_timeout_in(port) <= port->ping_cur_interval_ms * 11 / 10);
+}
+
+static void test_adaptive_interval(void)
+{
+    struct usb_monitor_ctx ctx;
+    struct usb_port port;
+
+    test_init_ctx(&ctx);
+    test_init_port(&ctx, &port, "12");
+    port.dev = (libusb_device*) &test_dev[0];
+    port.ping_interval_ms = port.ping_cur_interval_ms = 1000;
+    port.ping_max_interval_ms = 5000;
+    test_now_us = 8000000000ULL;
+    test_random_value = 12345;
+
+    //Doubled every PING_OUTPUT pings in a row, until the max
+    test_ping_many(&ctx, &port, PING_OUTPUT - 1);
+    TEST_CHECK(port.ping_cur_interval_ms == 1000);
+    test_ping_many(&ctx, &port, 1);
+    TEST_CHECK(port.ping_cur_interval_ms == 2000);
+    test_ping_many(&ctx, &port, PING_OUTPUT);
+    TEST_CHECK(port.ping_cur_interval_ms == 4000);
+    test_ping_many(&ctx, &port, PING_OUTPUT);
+    TEST_CHECK(port.ping_cur_interval_ms == 5000);
+    test_ping_many(&ctx, &port, PING_OUTPUT);
+    TEST_CHECK(port.ping_cur_interval_ms == 5000);
+
+    //A failed ping goes back to the base interval right away, and the count
+    //starts over
+    test_ping_many(&ctx, &port, PING_OUTPUT / 2);
+    usb_helpers_send_ping(&port);
+    usb_helpers_ping_round_cb(&ctx);
+    test_complete(port.ping_transfer, LIBUSB_TRANSFER_ERROR);
+    TEST_CHECK(port.ping_cur_interval_ms == 1000);
+    TEST_CHECK(test_timeout_in(&port) >= 900 && test_timeout_in(&port) <= 1100);
+    test_ping_many(&ctx, &port, PING_OUTPUT - 1);
+    TEST_CHECK(port.ping_cur_interval_ms == 1000);
+    test_ping_many(&ctx, &port, 1);
+    TEST_CHECK(port.ping_cur_interval_ms == 2000);
+
+    //Not adaptive when the max is the base interval
+    port.ping_cur_interval_ms = port.ping_max_interval_ms = 1000;
+    test_ping_many(&ctx, &port, PING_OUTPUT * 3);
+    TEST_CHECK(port.ping_cur_interval_ms == 1000);
+
+    //Max is not a power of two times the base
+    port.ping_interval_ms = port.ping_cur_interval_ms = 3000;
+    port.ping_max_interval_ms = 4000;
+    test_ping_many(&ctx, &port, PING_OUTPUT);
+    TEST_CHECK(port.ping_cur_interval_ms == 4000);
+
+    usb_helpers_reset_port(&port);
+    test_destroy_ctx(&ctx);
+}
+
+int main(int argc, char *argv[])
+{
+    test_jitter();
+    printf("jitter: OK\n");
+    test_phase();
+    printf("phase: OK\n");
+    test_rtt_hist();
+    printf("rtt_hist: OK\n");
+    test_rtt_ewma();
+    printf("rtt_ewma: OK\n");
+    test_ping_state();
+    printf("ping_state: OK\n");
+    test_ping_reset();
+    printf("ping_reset: OK\n");
+    test_handle_lru();
+    printf("handle_lru: OK\n");
+    test_backoff_growth();
+    printf("backoff_growth: OK\n");
+    test_backoff_decay();
+    printf("backoff_decay: OK\n");
+    test_ping_config();
+    printf("ping_config: OK\n");
+    test_adaptive_interval();
+    printf("adaptive_interval: OK\n");
+
+    return EXIT_SUCCESS;
+}
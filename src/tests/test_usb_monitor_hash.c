@@ -0,0 +1,303 @@
+/*
+ * Copyright 2015 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Usb Monitor. Usb Monitor is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * Usb Montior is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Usb Monitor. If not, see http://www.gnu.org/licenses/.
+ */
+
+
+//Tests for usb_monitor_hash. The implementation is included, so that keys that
+//collide (and wrap around the end of the table) can be found using the same
+//index function as the table
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../usb_monitor_hash.c"
+
+#define TEST_CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                    #cond); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+//Number of keys and operations in the randomized test
+#define TEST_NUM_KEYS 2048
+#define TEST_NUM_OPS 200000
+
+//Port set of the phase test: TEST_NUM_BUSES buses with two root ports, a
+//7-port hub on each root port and a 7-port hub on each of those ports
+#define TEST_NUM_BUSES 4
+#define TEST_HUB_PORTS 7
+#define TEST_MAX_PORTS (TEST_NUM_BUSES * 2 * TEST_HUB_PORTS * \
+                        (TEST_HUB_PORTS + 1))
+
+//Values are never dereferenced, only compared
+#define TEST_VALUE(key) ((void*) (uintptr_t) ((key) + 1))
+
+//Every entry must be reachable from its home bucket, i.e., there can be no
+//empty bucket between the home and the entry. Also checks num_entries
+static void test_check_table(struct usb_monitor_hash *hash)
+{
+    uint32_t i, idx, num_entries = 0;
+
+    for (i = 0; i < hash->size; i++) {
+        if (!hash->entries[i].value)
+            continue;
+
+        num_entries++;
+
+        for (idx = usb_monitor_hash_idx(hash, hash->entries[i].key); idx != i;
+             idx = (idx + 1) & (hash->size - 1))
+            TEST_CHECK(hash->entries[idx].value);
+    }
+
+    TEST_CHECK(num_entries == hash->num_entries);
+}
+
+//Find the first count keys that have home idx
+static void test_find_keys(struct usb_monitor_hash *hash, uint32_t idx,
+                           uint64_t *keys, uint32_t count)
+{
+    uint64_t key = 1;
+    uint32_t i = 0;
+
+    while (i < count) {
+        if (usb_monitor_hash_idx(hash, key) == idx)
+            keys[i++] = key;
+
+        key++;
+    }
+}
+
+static void test_basic()
+{
+    struct usb_monitor_hash hash;
+
+    TEST_CHECK(!usb_monitor_hash_init(&hash));
+    TEST_CHECK(usb_monitor_hash_find(&hash, 42) == NULL);
+    TEST_CHECK(usb_monitor_hash_remove(&hash, 42) == NULL);
+
+    TEST_CHECK(!usb_monitor_hash_insert(&hash, 42, TEST_VALUE(42)));
+    TEST_CHECK(usb_monitor_hash_find(&hash, 42) == TEST_VALUE(42));
+    TEST_CHECK(hash.num_entries == 1);
+
+    //Replace value
+    TEST_CHECK(!usb_monitor_hash_insert(&hash, 42, TEST_VALUE(43)));
+    TEST_CHECK(usb_monitor_hash_find(&hash, 42) == TEST_VALUE(43));
+    TEST_CHECK(hash.num_entries == 1);
+
+    TEST_CHECK(usb_monitor_hash_remove(&hash, 42) == TEST_VALUE(43));
+    TEST_CHECK(usb_monitor_hash_find(&hash, 42) == NULL);
+    TEST_CHECK(hash.num_entries == 0);
+
+    usb_monitor_hash_destroy(&hash);
+    TEST_CHECK(usb_monitor_hash_find(&hash, 42) == NULL);
+}
+
+//Three keys with home in the last bucket, and one with home in the first. The
+//cluster wraps around the end of the table: last = a, 0 = b, 1 = c, 2 = d.
+//Removing a must shift b and c back (across the end of the table), but not d
+//in front of its home
+static void test_wraparound()
+{
+    struct usb_monitor_hash hash;
+    uint64_t last_keys[3], first_key;
+    uint32_t last, i;
+
+    TEST_CHECK(!usb_monitor_hash_init(&hash));
+    last = hash.size - 1;
+    test_find_keys(&hash, last, last_keys, 3);
+    test_find_keys(&hash, 0, &first_key, 1);
+
+    for (i = 0; i < 3; i++)
+        TEST_CHECK(!usb_monitor_hash_insert(&hash, last_keys[i],
+                                            TEST_VALUE(last_keys[i])));
+    TEST_CHECK(!usb_monitor_hash_insert(&hash, first_key,
+                                        TEST_VALUE(first_key)));
+
+    TEST_CHECK(hash.entries[last].key == last_keys[0]);
+    TEST_CHECK(hash.entries[0].key == last_keys[1]);
+    TEST_CHECK(hash.entries[1].key == last_keys[2]);
+    TEST_CHECK(hash.entries[2].key == first_key);
+    test_check_table(&hash);
+
+    TEST_CHECK(usb_monitor_hash_remove(&hash, last_keys[0]) ==
+               TEST_VALUE(last_keys[0]));
+    test_check_table(&hash);
+    TEST_CHECK(hash.entries[last].key == last_keys[1]);
+    TEST_CHECK(hash.entries[0].key == last_keys[2]);
+    TEST_CHECK(hash.entries[1].key == first_key);
+    TEST_CHECK(hash.entries[2].value == NULL);
+
+    for (i = 1; i < 3; i++)
+        TEST_CHECK(usb_monitor_hash_find(&hash, last_keys[i]) ==
+                   TEST_VALUE(last_keys[i]));
+    TEST_CHECK(usb_monitor_hash_find(&hash, first_key) ==
+               TEST_VALUE(first_key));
+    TEST_CHECK(usb_monitor_hash_find(&hash, last_keys[0]) == NULL);
+
+    //Remove from the middle of the cluster
+    TEST_CHECK(usb_monitor_hash_remove(&hash, last_keys[2]) ==
+               TEST_VALUE(last_keys[2]));
+    test_check_table(&hash);
+    TEST_CHECK(usb_monitor_hash_find(&hash, last_keys[1]) ==
+               TEST_VALUE(last_keys[1]));
+    TEST_CHECK(usb_monitor_hash_find(&hash, first_key) ==
+               TEST_VALUE(first_key));
+
+    usb_monitor_hash_destroy(&hash);
+}
+
+//Random inserts and removes of a small set of keys, checked against an array.
+//The table grows several times and the clusters get long
+static void test_random()
+{
+    struct usb_monitor_hash hash;
+    uint8_t *present = calloc(TEST_NUM_KEYS, 1);
+    uint32_t i, key;
+
+    TEST_CHECK(present);
+    TEST_CHECK(!usb_monitor_hash_init(&hash));
+    srandom(1);
+
+    for (i = 0; i < TEST_NUM_OPS; i++) {
+        key = random() % TEST_NUM_KEYS;
+
+        if (random() % 2) {
+            TEST_CHECK(!usb_monitor_hash_insert(&hash, key, TEST_VALUE(key)));
+            present[key] = 1;
+        } else {
+            TEST_CHECK(usb_monitor_hash_remove(&hash, key) ==
+                       (present[key] ? TEST_VALUE(key) : NULL));
+            present[key] = 0;
+        }
+
+        if (i % 1024 == 0)
+            test_check_table(&hash);
+    }
+
+    test_check_table(&hash);
+
+    for (key = 0; key < TEST_NUM_KEYS; key++)
+        TEST_CHECK(usb_monitor_hash_find(&hash, key) ==
+                   (present[key] ? TEST_VALUE(key) : NULL));
+
+    usb_monitor_hash_destroy(&hash);
+    free(present);
+}
+
+//Same packing as usb_monitor_lists_path_key()
+static uint64_t test_path_key(const uint8_t *path, uint8_t path_len)
+{
+    uint64_t key = 0;
+
+    memcpy(&key, path, path_len);
+    return key;
+}
+
+static int test_cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *((const uint32_t*) a), y = *((const uint32_t*) b);
+
+    return x < y ? -1 : x > y;
+}
+
+//usb_monitor_hash_scale() gives the first ping of a port its phase within the
+//ping interval (usb_helpers_start_ping_timeout()). When all devices are added
+//at the same time, the first pings must be spread over the whole interval and
+//ports on the same hub must not be pinged close together
+static void test_scale_period(uint32_t period)
+{
+    uint32_t phases[TEST_MAX_PORTS], bins[10] = {0};
+    uint32_t siblings[TEST_HUB_PORTS];
+    uint32_t num_ports = 0, i, j, window, diff;
+    uint8_t path[4], bus, root, port, child;
+
+    for (bus = 1; bus <= TEST_NUM_BUSES; bus++) {
+        for (root = 1; root <= 2; root++) {
+            for (port = 1; port <= TEST_HUB_PORTS; port++) {
+                path[0] = bus;
+                path[1] = root;
+                path[2] = port;
+                phases[num_ports++] =
+                    usb_monitor_hash_scale(test_path_key(path, 3), period);
+
+                for (child = 1; child <= TEST_HUB_PORTS; child++) {
+                    path[3] = child;
+                    siblings[child - 1] =
+                        usb_monitor_hash_scale(test_path_key(path, 4), period);
+                    phases[num_ports++] = siblings[child - 1];
+                }
+
+                //Ports on the same hub are at least 1/16 interval apart
+                for (i = 0; i < TEST_HUB_PORTS; i++) {
+                    for (j = i + 1; j < TEST_HUB_PORTS; j++) {
+                        diff = siblings[i] > siblings[j] ?
+                               siblings[i] - siblings[j] :
+                               siblings[j] - siblings[i];
+                        TEST_CHECK(diff >= period / 16);
+                    }
+                }
+            }
+        }
+    }
+
+    TEST_CHECK(num_ports == TEST_MAX_PORTS);
+
+    //Every tenth of the interval gets its share of pings, +/- 20%
+    for (i = 0; i < num_ports; i++) {
+        TEST_CHECK(phases[i] < period);
+        bins[((uint64_t) phases[i] * 10) / period]++;
+    }
+
+    for (i = 0; i < 10; i++)
+        TEST_CHECK(bins[i] * 10 >= num_ports * 8 / 10 &&
+                   bins[i] * 10 <= num_ports * 12 / 10);
+
+    //No burst, at most three times the average number of pings in any 1% of
+    //the interval
+    qsort(phases, num_ports, sizeof(uint32_t), test_cmp_u32);
+    window = period / 100;
+
+    for (i = 0, j = 0; i < num_ports; i++) {
+        while (j < num_ports && phases[j] < phases[i] + window)
+            j++;
+
+        TEST_CHECK((j - i) * 100 <= num_ports * 3);
+    }
+}
+
+static void test_scale()
+{
+    test_scale_period(1000);
+    test_scale_period(5000);
+    test_scale_period(30000);
+
+    TEST_CHECK(usb_monitor_hash_scale(1, 1) == 0);
+    TEST_CHECK(usb_monitor_hash_scale(1, 0) == 0);
+}
+
+int main(int argc, char *argv[])
+{
+    test_basic();
+    test_wraparound();
+    test_random();
+    test_scale();
+
+    printf("usb_monitor_hash: OK\n");
+    return EXIT_SUCCESS;
+}
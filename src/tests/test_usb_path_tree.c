@@ -0,0 +1,248 @@
+/*
+ * Copyright 2015 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Usb Monitor. Usb Monitor is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * Usb Montior is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Usb Monitor. If not, see http://www.gnu.org/licenses/.
+ */
+
+
+//Tests for usb_path_tree. The implementation is included, so that the nodes
+//that are left after a remove can be checked
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "../usb_path_tree.c"
+
+#define TEST_CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                    #cond); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+//Values are never dereferenced, only compared
+#define TEST_VALUE(x) ((void*) (uintptr_t) (x))
+
+//Paths visited by a callback, in the order they were visited
+struct test_visit {
+    uint8_t paths[64][USB_PATH_TREE_MAX_DEPTH];
+    uint8_t path_lens[64];
+    void *values[64];
+    uint32_t num_visited;
+};
+
+static void test_visit_cb(const uint8_t *path, uint8_t path_len, void *value,
+                          void *data)
+{
+    struct test_visit *visit = data;
+
+    TEST_CHECK(visit->num_visited < 64);
+    memcpy(visit->paths[visit->num_visited], path, path_len);
+    visit->path_lens[visit->num_visited] = path_len;
+    visit->values[visit->num_visited] = value;
+    visit->num_visited++;
+}
+
+//Bus 1 with a hub on port 2, which has a hub on port 3. Bus 2 has one port
+static const uint8_t test_paths[][USB_PATH_TREE_MAX_DEPTH] = {
+    {1, 2}, {1, 2, 1}, {1, 2, 3}, {1, 2, 3, 1}, {1, 2, 3, 4}, {1, 2, 4},
+    {1, 3}, {2, 1}
+};
+static const uint8_t test_path_lens[] = {2, 3, 3, 4, 4, 3, 2, 2};
+#define TEST_NUM_PATHS (sizeof(test_path_lens) / sizeof(test_path_lens[0]))
+
+static void test_fill(struct usb_path_tree *tree)
+{
+    uint32_t i;
+
+    usb_path_tree_init(tree);
+
+    //Insert in reverse, the children must still be sorted
+    for (i = TEST_NUM_PATHS; i > 0; i--)
+        TEST_CHECK(!usb_path_tree_insert(tree, test_paths[i - 1],
+                                         test_path_lens[i - 1],
+                                         TEST_VALUE(i)));
+
+    TEST_CHECK(tree->num_values == TEST_NUM_PATHS);
+}
+
+static void test_insert()
+{
+    const uint8_t long_path[USB_PATH_TREE_MAX_DEPTH + 1] = {0};
+    const uint8_t missing[] = {1, 2, 2};
+    struct usb_path_tree tree;
+    uint32_t i;
+
+    test_fill(&tree);
+
+    for (i = 0; i < TEST_NUM_PATHS; i++)
+        TEST_CHECK(usb_path_tree_find(&tree, test_paths[i],
+                                      test_path_lens[i]) ==
+                   TEST_VALUE(i + 1));
+
+    //Nodes without a value, paths that are not in the tree and invalid paths
+    TEST_CHECK(!usb_path_tree_find(&tree, test_paths[0], 1));
+    TEST_CHECK(!usb_path_tree_find(&tree, missing, sizeof(missing)));
+    TEST_CHECK(usb_path_tree_insert(&tree, long_path, sizeof(long_path),
+                                    TEST_VALUE(1)));
+    TEST_CHECK(usb_path_tree_insert(&tree, long_path, 0, TEST_VALUE(1)));
+    TEST_CHECK(usb_path_tree_insert(&tree, test_paths[0], 2, NULL));
+
+    //Replacing a value does not change the number of values
+    TEST_CHECK(!usb_path_tree_insert(&tree, test_paths[0], 2,
+                                     TEST_VALUE(100)));
+    TEST_CHECK(usb_path_tree_find(&tree, test_paths[0], 2) ==
+               TEST_VALUE(100));
+    TEST_CHECK(tree.num_values == TEST_NUM_PATHS);
+
+    usb_path_tree_destroy(&tree);
+    TEST_CHECK(!tree.root.children && !tree.num_values);
+}
+
+//Removing a leaf frees the nodes that no longer lead anywhere, removing an
+//inner path keeps the nodes below it
+static void test_remove()
+{
+    const uint8_t bus[] = {1};
+    struct usb_path_tree tree;
+    struct usb_path_tree_node *node;
+
+    test_fill(&tree);
+
+    //{1, 2, 3} has children, the node must stay
+    TEST_CHECK(usb_path_tree_remove(&tree, test_paths[2], 3) ==
+               TEST_VALUE(3));
+    TEST_CHECK(!usb_path_tree_find(&tree, test_paths[2], 3));
+    TEST_CHECK(usb_path_tree_walk(&tree, test_paths[2], 3));
+    TEST_CHECK(usb_path_tree_find(&tree, test_paths[3], 4) == TEST_VALUE(4));
+    TEST_CHECK(!usb_path_tree_remove(&tree, test_paths[2], 3));
+
+    //Removing the last paths under {1, 2, 3} frees it
+    TEST_CHECK(usb_path_tree_remove(&tree, test_paths[3], 4) ==
+               TEST_VALUE(4));
+    TEST_CHECK(usb_path_tree_remove(&tree, test_paths[4], 4) ==
+               TEST_VALUE(5));
+    TEST_CHECK(!usb_path_tree_walk(&tree, test_paths[2], 3));
+
+    //{2, 1} is the only path on bus 2, so the bus node goes as well
+    TEST_CHECK(usb_path_tree_remove(&tree, test_paths[7], 2) ==
+               TEST_VALUE(8));
+    TEST_CHECK(!usb_path_tree_walk(&tree, test_paths[7], 1));
+
+    TEST_CHECK(tree.num_values == TEST_NUM_PATHS - 4);
+
+    //The remaining children of {1, 2} are still sorted
+    node = usb_path_tree_walk(&tree, test_paths[0], 2);
+    TEST_CHECK(node && node->children && node->children->byte == 1);
+    TEST_CHECK(node->children->next && node->children->next->byte == 4);
+    TEST_CHECK(!node->children->next->next);
+
+    TEST_CHECK(!usb_path_tree_remove(&tree, bus, 1));
+    usb_path_tree_destroy(&tree);
+}
+
+static void test_find_prefix()
+{
+    const uint8_t below[] = {1, 2, 3, 4, 7, 7};
+    const uint8_t no_value[] = {1, 2, 3, 2};
+    const uint8_t other_bus[] = {3, 1};
+    struct usb_path_tree tree;
+    uint8_t match_len;
+
+    test_fill(&tree);
+
+    TEST_CHECK(usb_path_tree_find_prefix(&tree, test_paths[4], 4,
+                                         &match_len) == TEST_VALUE(5));
+    TEST_CHECK(match_len == 4);
+
+    TEST_CHECK(usb_path_tree_find_prefix(&tree, below, sizeof(below),
+                                         &match_len) == TEST_VALUE(5));
+    TEST_CHECK(match_len == 4);
+
+    TEST_CHECK(usb_path_tree_find_prefix(&tree, no_value, sizeof(no_value),
+                                         &match_len) == TEST_VALUE(3));
+    TEST_CHECK(match_len == 3);
+
+    //Without {1, 2, 3}, the hub at {1, 2} is the longest prefix
+    usb_path_tree_remove(&tree, test_paths[2], 3);
+    TEST_CHECK(usb_path_tree_find_prefix(&tree, no_value, sizeof(no_value),
+                                         &match_len) == TEST_VALUE(1));
+    TEST_CHECK(match_len == 2);
+
+    TEST_CHECK(!usb_path_tree_find_prefix(&tree, other_bus, sizeof(other_bus),
+                                          &match_len));
+    TEST_CHECK(!match_len);
+
+    usb_path_tree_destroy(&tree);
+}
+
+static void test_foreach()
+{
+    const uint8_t below[] = {1, 2, 3, 4, 7};
+    struct usb_path_tree tree;
+    struct test_visit visit;
+    uint32_t i;
+
+    test_fill(&tree);
+
+    //Whole tree, in path order
+    memset(&visit, 0, sizeof(visit));
+    TEST_CHECK(usb_path_tree_foreach(&tree, NULL, 0, test_visit_cb, &visit) ==
+               TEST_NUM_PATHS);
+    TEST_CHECK(visit.num_visited == TEST_NUM_PATHS);
+
+    for (i = 0; i < TEST_NUM_PATHS; i++) {
+        TEST_CHECK(visit.path_lens[i] == test_path_lens[i]);
+        TEST_CHECK(!memcmp(visit.paths[i], test_paths[i], test_path_lens[i]));
+        TEST_CHECK(visit.values[i] == TEST_VALUE(i + 1));
+    }
+
+    //Subtree of the hub at {1, 2, 3}, including the hub itself
+    memset(&visit, 0, sizeof(visit));
+    TEST_CHECK(usb_path_tree_foreach(&tree, test_paths[2], 3, test_visit_cb,
+                                     &visit) == 3);
+    TEST_CHECK(visit.values[0] == TEST_VALUE(3) &&
+               visit.values[1] == TEST_VALUE(4) &&
+               visit.values[2] == TEST_VALUE(5));
+
+    //Prefix that is not in the tree
+    TEST_CHECK(!usb_path_tree_foreach(&tree, below, sizeof(below),
+                                      test_visit_cb, &visit));
+
+    //Every value on the way to a path, shortest first
+    memset(&visit, 0, sizeof(visit));
+    TEST_CHECK(usb_path_tree_foreach_prefix(&tree, below, sizeof(below),
+                                            test_visit_cb, &visit) == 3);
+    TEST_CHECK(visit.path_lens[0] == 2 && visit.values[0] == TEST_VALUE(1));
+    TEST_CHECK(visit.path_lens[1] == 3 && visit.values[1] == TEST_VALUE(3));
+    TEST_CHECK(visit.path_lens[2] == 4 && visit.values[2] == TEST_VALUE(5));
+
+    usb_path_tree_destroy(&tree);
+}
+
+int main(int argc, char *argv[])
+{
+    test_insert();
+    printf("insert: OK\n");
+    test_remove();
+    printf("remove: OK\n");
+    test_find_prefix();
+    printf("find_prefix: OK\n");
+    test_foreach();
+    printf("foreach: OK\n");
+
+    return EXIT_SUCCESS;
+}
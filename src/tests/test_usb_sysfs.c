@@ -0,0 +1,254 @@
+/*
+ * Copyright 2015 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Usb Monitor. Usb Monitor is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * Usb Montior is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Usb Monitor. If not, see http://www.gnu.org/licenses/.
+ */
+
+
+//Tests for the sysfs probes, run against a fake sysfs tree in a temporary
+//directory (ctx->sysfs_root). The implementation is included, so that pread
+//can be replaced to return ENODEV like sysfs does when a device is removed
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static uint8_t test_pread_enodev;
+
+static ssize_t test_pread(int fd, void *buf, size_t count, off_t offset)
+{
+    if (test_pread_enodev) {
+        errno = ENODEV;
+        return -1;
+    }
+
+    return pread(fd, buf, count, offset);
+}
+
+#define pread test_pread
+#include "../usb_sysfs.c"
+#undef pread
+
+#define TEST_CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+                    #cond); \
+            exit(EXIT_FAILURE); \
+        } \
+    } while (0)
+
+//Name of the device in the fake tree, see usb_helpers_fill_port_array()
+#define TEST_DEV_NAME "1-2.3"
+
+static char test_root[] = "/tmp/test_usb_sysfs.XXXXXX";
+static char test_dev_dir[sizeof(test_root) + sizeof(TEST_DEV_NAME) + 1];
+
+//The probes only need the path of the device, the rest of usb_helpers (and
+//libusb) is not linked
+void usb_helpers_fill_port_array(struct libusb_device *dev, uint8_t *path,
+                                 uint8_t *path_len)
+{
+    path[0] = 1;
+    path[1] = 2;
+    path[2] = 3;
+    *path_len = 3;
+}
+
+//Rewrite attr in place, so that fds cached by the probes see the new value
+static void test_write_attr(const char *attr, const char *value)
+{
+    char path[256];
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s/%s", test_dev_dir, attr);
+    TEST_CHECK((fp = fopen(path, "w")) != NULL);
+    fputs(value, fp);
+    fclose(fp);
+}
+
+static void test_remove_attr(const char *attr)
+{
+    char path[256];
+
+    snprintf(path, sizeof(path), "%s/%s", test_dev_dir, attr);
+    unlink(path);
+}
+
+static void test_init_port(struct usb_port *port, struct usb_monitor_ctx *ctx,
+                           uint8_t probe_type)
+{
+    memset(port, 0, sizeof(struct usb_port));
+    memset(port->sysfs_fd, -1, sizeof(port->sysfs_fd));
+    port->ctx = ctx;
+    //Never dereferenced, the probes only check that a device is connected
+    port->dev = (libusb_device*) port;
+    port->probe_type = probe_type;
+}
+
+static void test_set_state(const char *authorized, const char *config)
+{
+    test_write_attr("authorized", authorized);
+    test_write_attr("bConfigurationValue", config);
+}
+
+static void test_state(struct usb_monitor_ctx *ctx)
+{
+    struct usb_port port;
+
+    test_init_port(&port, ctx, PROBE_TYPE_SYSFS_STATE);
+
+    test_set_state("1\n", "1\n");
+    TEST_CHECK(usb_sysfs_probe(&port) == 0);
+    TEST_CHECK(port.sysfs_fd[0] >= 0 && port.sysfs_fd[1] >= 0);
+
+    //Not configured
+    test_set_state("1\n", "\n");
+    TEST_CHECK(usb_sysfs_probe(&port) == 1);
+
+    //Not authorized
+    test_set_state("0\n", "1\n");
+    TEST_CHECK(usb_sysfs_probe(&port) == 1);
+
+    test_set_state("1\n", "2\n");
+    TEST_CHECK(usb_sysfs_probe(&port) == 0);
+
+    usb_sysfs_close(&port);
+    TEST_CHECK(port.sysfs_fd[0] == -1 && port.sysfs_fd[1] == -1);
+}
+
+static void test_urbnum(struct usb_monitor_ctx *ctx)
+{
+    struct usb_port port;
+
+    test_init_port(&port, ctx, PROBE_TYPE_SYSFS_URBNUM);
+    test_set_state("1\n", "1\n");
+
+    //First probe has nothing to compare with, the state decides
+    test_write_attr("urbnum", "100\n");
+    TEST_CHECK(usb_sysfs_probe(&port) == 0);
+    TEST_CHECK(port.sysfs_urbnum == 100);
+
+    //Advance
+    test_write_attr("urbnum", "150\n");
+    TEST_CHECK(usb_sysfs_probe(&port) == 0);
+    TEST_CHECK(port.sysfs_urbnum == 150);
+
+    //Stalled and configured, every probe without progress fails
+    TEST_CHECK(usb_sysfs_probe(&port) == 1);
+    TEST_CHECK(usb_sysfs_probe(&port) == 1);
+    TEST_CHECK(port.sysfs_urbnum == 150);
+
+    //Moving again
+    test_write_attr("urbnum", "151\n");
+    TEST_CHECK(usb_sysfs_probe(&port) == 0);
+
+    //Moving and a bad state, progress does not hide the state
+    test_write_attr("urbnum", "152\n");
+    test_set_state("1\n", "\n");
+    TEST_CHECK(usb_sysfs_probe(&port) == 1);
+    TEST_CHECK(port.sysfs_urbnum == 152);
+    test_write_attr("urbnum", "153\n");
+    test_set_state("0\n", "1\n");
+    TEST_CHECK(usb_sysfs_probe(&port) == 1);
+
+    //Stalled and a bad state
+    TEST_CHECK(usb_sysfs_probe(&port) == 1);
+    test_set_state("1\n", "\n");
+    TEST_CHECK(usb_sysfs_probe(&port) == 1);
+
+    //Recovers when both the state and urbnum are fine
+    test_set_state("1\n", "1\n");
+    TEST_CHECK(usb_sysfs_probe(&port) == 1);
+    test_write_attr("urbnum", "154\n");
+    TEST_CHECK(usb_sysfs_probe(&port) == 0);
+
+    usb_sysfs_close(&port);
+    TEST_CHECK(port.sysfs_urbnum == 0);
+
+    //A first probe with a bad state fails too
+    test_set_state("1\n", "\n");
+    TEST_CHECK(usb_sysfs_probe(&port) == 1);
+    TEST_CHECK(port.sysfs_urbnum == 154);
+    usb_sysfs_close(&port);
+    test_set_state("1\n", "1\n");
+}
+
+static void test_enodev(struct usb_monitor_ctx *ctx)
+{
+    struct usb_port state_port, urbnum_port;
+
+    test_set_state("1\n", "1\n");
+    test_write_attr("urbnum", "200\n");
+
+    test_init_port(&state_port, ctx, PROBE_TYPE_SYSFS_STATE);
+    test_init_port(&urbnum_port, ctx, PROBE_TYPE_SYSFS_URBNUM);
+    TEST_CHECK(usb_sysfs_probe(&state_port) == 0);
+    TEST_CHECK(usb_sysfs_probe(&urbnum_port) == 0);
+
+    //Device is removed while the fds are open
+    test_pread_enodev = 1;
+    TEST_CHECK(usb_sysfs_probe(&state_port) == 1);
+    TEST_CHECK(usb_sysfs_probe(&urbnum_port) == 1);
+    test_pread_enodev = 0;
+
+    usb_sysfs_close(&state_port);
+    usb_sysfs_close(&urbnum_port);
+}
+
+static void test_missing(struct usb_monitor_ctx *ctx)
+{
+    struct usb_port port;
+
+    //Opening stops at the first missing attribute, nothing is left open
+    test_remove_attr("bConfigurationValue");
+    test_init_port(&port, ctx, PROBE_TYPE_SYSFS_URBNUM);
+    TEST_CHECK(usb_sysfs_probe(&port) == 1);
+    TEST_CHECK(port.sysfs_fd[0] == -1 && port.sysfs_fd[1] == -1 &&
+               port.sysfs_fd[2] == -1);
+
+    //No device connected
+    test_init_port(&port, ctx, PROBE_TYPE_SYSFS_STATE);
+    port.dev = NULL;
+    TEST_CHECK(usb_sysfs_probe(&port) == 1);
+}
+
+int main(int argc, char *argv[])
+{
+    struct usb_monitor_ctx ctx;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.logfile = stderr;
+
+    TEST_CHECK(mkdtemp(test_root) != NULL);
+    snprintf(test_dev_dir, sizeof(test_dev_dir), "%s/%s", test_root,
+             TEST_DEV_NAME);
+    TEST_CHECK(mkdir(test_dev_dir, 0700) == 0);
+    ctx.sysfs_root = test_root;
+
+    test_state(&ctx);
+    test_urbnum(&ctx);
+    test_enodev(&ctx);
+    test_missing(&ctx);
+
+    test_remove_attr("authorized");
+    test_remove_attr("bConfigurationValue");
+    test_remove_attr("urbnum");
+    rmdir(test_dev_dir);
+    rmdir(test_root);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,168 @@
+/*
+ * Copyright 2015 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Usb Monitor. Usb Monitor is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * Usb Montior is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Usb Monitor. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "usb_monitor.h"
+#include "usb_bad_ids.h"
+
+static int usb_bad_ids_cmp(const void *a, const void *b)
+{
+    const struct usb_bad_device *bad_a = a, *bad_b = b;
+    int retval;
+
+    if (bad_a->path_len != bad_b->path_len)
+        return bad_a->path_len < bad_b->path_len ? -1 : 1;
+    else if ((retval = memcmp(bad_a->path.bytes, bad_b->path.bytes,
+                              bad_a->path_len)))
+        return retval;
+    else if (bad_a->vid != bad_b->vid)
+        return bad_a->vid < bad_b->vid ? -1 : 1;
+    else if (bad_a->pid_min != bad_b->pid_min)
+        return bad_a->pid_min < bad_b->pid_min ? -1 : 1;
+    else
+        return 0;
+}
+
+uint8_t usb_bad_ids_index(struct usb_monitor_ctx *ctx)
+{
+    struct usb_bad_device *bad_dev;
+    uint32_t i;
+
+    //Sort the table so that the entries of a path are next to each other, and
+    //the entries of a vid can be found with a binary search when a device is
+    //added
+    qsort(ctx->bad_device_ids, ctx->num_bad_device_ids,
+          sizeof(struct usb_bad_device), usb_bad_ids_cmp);
+
+    for (i = 0; i < ctx->num_bad_device_ids; i++) {
+        bad_dev = &(ctx->bad_device_ids[i]);
+
+        if (!bad_dev->path_len) {
+            ctx->num_global_bad_ids++;
+            continue;
+        }
+
+        //Only the first entry of a path is in the tree
+        if (usb_path_tree_find(&(ctx->bad_id_tree), bad_dev->path.bytes,
+                               bad_dev->path_len))
+            continue;
+
+        if (usb_path_tree_insert(&(ctx->bad_id_tree), bad_dev->path.bytes,
+                                 bad_dev->path_len, bad_dev))
+            return 1;
+    }
+
+    return 0;
+}
+
+//Return the first of the num_entries entries starting at entries that has vid
+//and contains pid, or NULL. The entries must be sorted on vid and pid_min
+static struct usb_bad_device* usb_bad_ids_find_vid(
+        struct usb_bad_device *entries, uint32_t num_entries, uint16_t vid,
+        uint16_t pid)
+{
+    uint32_t low = 0, high = num_entries, mid;
+
+    //Find the first entry for vid
+    while (low < high) {
+        mid = low + ((high - low) / 2);
+
+        if (entries[mid].vid < vid)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    for (; low < num_entries; low++) {
+        if (entries[low].vid != vid || entries[low].pid_min > pid)
+            break;
+
+        if (entries[low].pid_max >= pid)
+            return &(entries[low]);
+    }
+
+    return NULL;
+}
+
+//Entries for vid are checked before the entries that match any vid (vid 0)
+static struct usb_bad_device* usb_bad_ids_find(struct usb_bad_device *entries,
+                                               uint32_t num_entries,
+                                               uint16_t vid, uint16_t pid)
+{
+    struct usb_bad_device *match;
+
+    if ((match = usb_bad_ids_find_vid(entries, num_entries, vid, pid)) || !vid)
+        return match;
+
+    return usb_bad_ids_find_vid(entries, num_entries, 0, pid);
+}
+
+struct usb_bad_ids_match {
+    struct usb_monitor_ctx *ctx;
+    struct usb_port *port;
+    struct usb_bad_device *match;
+};
+
+//value is the first entry of a path, the entries of the path follow it
+static void usb_bad_ids_match_cb(const uint8_t *path, uint8_t path_len,
+                                 void *value, void *data)
+{
+    struct usb_bad_ids_match *bad_id = data;
+    struct usb_bad_device *first = value, *end, *itr;
+
+    if (bad_id->match && bad_id->match->path_len >= path_len)
+        return;
+
+    end = bad_id->ctx->bad_device_ids + bad_id->ctx->num_bad_device_ids;
+
+    itr = first;
+
+    while (itr < end && itr->path_len == first->path_len &&
+           itr->path.key == first->path.key)
+        itr++;
+
+    if ((itr = usb_bad_ids_find(first, itr - first, bad_id->port->vp.vid,
+                                bad_id->port->vp.pid)))
+        bad_id->match = itr;
+}
+
+struct usb_bad_device* usb_bad_ids_match(struct usb_monitor_ctx *ctx,
+                                         struct usb_port *port)
+{
+    struct usb_bad_ids_match bad_id;
+    uint8_t i;
+
+    bad_id.ctx = ctx;
+    bad_id.port = port;
+    bad_id.match = NULL;
+
+    for (i = 0; i < MAX_NUM_PATHS; i++) {
+        if (!port->path_len[i])
+            break;
+
+        usb_path_tree_foreach_prefix(&(ctx->bad_id_tree), port->path[i].bytes,
+                                     port->path_len[i], usb_bad_ids_match_cb,
+                                     &bad_id);
+    }
+
+    if (bad_id.match)
+        return bad_id.match;
+
+    return usb_bad_ids_find(ctx->bad_device_ids, ctx->num_global_bad_ids,
+                            port->vp.vid, port->vp.pid);
+}
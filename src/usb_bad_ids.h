@@ -0,0 +1,38 @@
+/*
+ * Copyright 2015 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Usb Monitor. Usb Monitor is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * Usb Montior is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Usb Monitor. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef USB_BAD_IDS_H
+#define USB_BAD_IDS_H
+
+#include <stdint.h>
+
+struct usb_monitor_ctx;
+struct usb_port;
+struct usb_bad_device;
+
+//Sort ctx->bad_device_ids and index the entries with a path in
+//ctx->bad_id_tree. Must be called once after the table has been filled in.
+//Return 0 on success, 1 on failure
+uint8_t usb_bad_ids_index(struct usb_monitor_ctx *ctx);
+
+//Return the entry that decides if the device connected to port is restarted,
+//or NULL if no entry matches the device. Entries with the longest path that is
+//a prefix of one of the port's paths are checked first, then entries without
+//path. Within a path, an entry for the device's vid wins over an entry for any
+//vid, and with overlapping pid ranges the range with the lowest pid_min wins
+struct usb_bad_device* usb_bad_ids_match(struct usb_monitor_ctx *ctx,
+                                         struct usb_port *port);
+#endif
@@ -8,24 +8,44 @@
 #include "usb_monitor_lists.h"
 #include "usb_logging.h"
 #include "usb_monitor_callbacks.h"
+#include "usb_sysfs.h"
+#include "usb_bad_ids.h"
+
+void usb_helpers_port_timeout_cb(void *ptr)
+{
+    struct usb_port *port = ptr;
+
+    //Due to async requests, the enabled guard is needed to prevent us
+    //accidentaly sending PING on disabled port for example. However, in the
+    //case of probe, we need to call timeout callback
+    if (port->enabled || port->msg_mode == PROBE)
+        port->timeout(port);
+}
 
 uint8_t usb_helpers_configure_port(struct usb_port *port,
                                    struct usb_monitor_ctx *ctx,
                                    const char *path, uint8_t path_len,
                                    uint8_t port_num, struct usb_hub *parent)
 {
-        port->path[0] = strndup(path, path_len);
-
-        if (port->path[0] == NULL)
+        if (!path_len || path_len > USB_PATH_MAX)
             return 1;
 
+        //Not all handlers zero the memory of the port
+        memset(port->path, 0, sizeof(port->path));
+        memset(port->path_len, 0, sizeof(port->path_len));
+        memcpy(port->path[0].bytes, path, path_len);
         port->path_len[0] = path_len;
+        memset(port->sysfs_fd, -1, sizeof(port->sysfs_fd));
         port->port_num = port_num;
         port->pwr_state = POWER_ON;
         port->ctx = ctx;
         port->parent = parent;
         port->enabled = 1;
 
+        port->timeout_handle.cb = usb_helpers_port_timeout_cb;
+        port->timeout_handle.data = port;
+        port->timeout_handle.slack = ctx->timer_slack_ms;
+
         usb_monitor_lists_add_port(ctx, port);
 
         return 0;
@@ -36,8 +56,11 @@ uint8_t usb_helpers_port_add_path(struct usb_port *port, const char *path,
 {
     uint8_t i = 0;
 
+    if (!path_len || path_len > USB_PATH_MAX)
+        return 1;
+
     for (i = 0; i < MAX_NUM_PATHS; i++) {
-        if (!port->path[i])
+        if (!port->path_len[i])
             break;
     }
 
@@ -45,25 +68,14 @@ uint8_t usb_helpers_port_add_path(struct usb_port *port, const char *path,
     if (i == MAX_NUM_PATHS)
         return 1;
 
-    port->path[i] = strndup(path, path_len);
-
-    //TODO: Fail better
-    if (!port->path[i])
-        return 1;
-
+    memset(&(port->path[i]), 0, sizeof(union usb_path));
+    memcpy(port->path[i].bytes, path, path_len);
     port->path_len[i] = path_len;
 
-    return 0;
-}
+    if (port->port_next.le_prev)
+        usb_monitor_lists_index_port(port->ctx, port);
 
-void usb_helpers_release_port(struct usb_port *port)
-{
-    uint8_t i = 0;
-
-    for (i = 0; i < MAX_NUM_PATHS; i++) {
-        if (port->path[i])
-            free(port->path[i]);
-    }
+    return 0;
 }
 
 void usb_helpers_print_port(struct usb_port *port, const char *type,
@@ -82,7 +94,7 @@ void usb_helpers_print_port(struct usb_port *port, const char *type,
         return;*/
 
     for (j = 0; j < MAX_NUM_PATHS; j++) {
-        if (port->path[j] == NULL)
+        if (!port->path_len[j])
             break;
 
         if (j)
@@ -91,10 +103,10 @@ void usb_helpers_print_port(struct usb_port *port, const char *type,
         for (i = 0; i < port->path_len[j]; i++) {
             if (i != (port->path_len[j] - 1))
                 path_progress += sprintf(path_buf + path_progress, "%u-",
-                        port->path[j][i]);
+                        port->path[j].bytes[i]);
             else
                 path_progress += sprintf(path_buf + path_progress, "%u",
-                        port->path[j][i]);
+                        port->path[j].bytes[i]);
         }
     }
 
@@ -215,16 +227,110 @@ uint8_t usb_helpers_get_num_ports(struct usb_monitor_ctx *ctx,
     }
 }
 
+uint32_t usb_helpers_add_jitter(uint32_t delay_ms)
+{
+    uint32_t jitter_ms = ((uint64_t) delay_ms * TIMER_JITTER_PCT) / 100;
+
+    if (!jitter_ms)
+        return delay_ms;
+
+    return delay_ms - jitter_ms + (random() % ((2 * jitter_ms) + 1));
+}
+
 void usb_helpers_start_timeout(struct usb_port *port, uint8_t timeout_sec)
+{
+    usb_helpers_start_timeout_ms(port, timeout_sec * 1000U);
+}
+
+void usb_helpers_start_timeout_ms(struct usb_port *port, uint32_t timeout_ms)
 {
     struct timespec tp;
 
     clock_gettime(CLOCK_MONOTONIC_RAW, &tp);
 
-    port->timeout_expire = ((tp.tv_sec + timeout_sec) * 1e6) + (tp.tv_nsec/1e3);
+    port->timeout_handle.timeout_clock = (tp.tv_sec * 1000ULL) +
+                                         (tp.tv_nsec / 1000000) + timeout_ms;
     usb_monitor_lists_add_timeout(port->ctx, port);
 }
 
+void usb_helpers_start_ping_timeout(struct usb_port *port, uint32_t delay_ms,
+                                    uint8_t add_phase)
+{
+    delay_ms = usb_helpers_add_jitter(delay_ms);
+
+    //The offset of a port is always the same, and the offsets of ports that
+    //are close in the topology are spread over the whole interval
+    if (add_phase)
+        delay_ms += usb_monitor_hash_scale(port->path[0].key,
+                                           port->ping_interval_ms);
+
+    usb_helpers_start_timeout_ms(port, delay_ms);
+}
+
+static uint64_t usb_helpers_get_time_us()
+{
+    struct timespec tp;
+
+    clock_gettime(CLOCK_MONOTONIC_RAW, &tp);
+    return (tp.tv_sec * 1000000ULL) + (tp.tv_nsec / 1000);
+}
+
+//Called when a ping is no longer in flight. The round is over when the last
+//ping of the round has completed
+static void usb_helpers_ping_done(struct usb_monitor_ctx *ctx, uint8_t failed)
+{
+    struct usb_monitor_ping_stats *stats = &(ctx->ping_stats);
+    uint64_t round_us;
+
+    ctx->ping_round_failures += failed;
+
+    if (ctx->pings_in_flight && --ctx->pings_in_flight)
+        return;
+
+    round_us = usb_helpers_get_time_us() - ctx->ping_round_start;
+
+    stats->rounds++;
+    stats->pinged += ctx->ping_round_pinged;
+    stats->failures += ctx->ping_round_failures;
+    stats->round_us += round_us;
+    stats->last_round_us = round_us;
+    stats->last_round_pinged = ctx->ping_round_pinged;
+    stats->last_round_failures = ctx->ping_round_failures;
+
+    if (round_us > stats->max_round_us)
+        stats->max_round_us = round_us;
+}
+
+void usb_helpers_close_handle(struct usb_port *port)
+{
+    struct libusb_transfer *transfer = port->ping_transfer;
+
+    //A transfer can not be freed while it is in flight, and a cancelled
+    //transfer is only reaped while its handle is open. Cancel the ping and let
+    //usb_helpers_ping_cb() free the transfer and close the handle. user_data is
+    //cleared, since port might be freed before the callback runs
+    if (port->ping_state == PING_IN_FLIGHT) {
+        transfer->user_data = NULL;
+        libusb_cancel_transfer(transfer);
+        usb_helpers_ping_done(port->ctx, 0);
+    } else {
+        usb_helpers_dequeue_ping(port);
+
+        if (transfer)
+            libusb_free_transfer(transfer);
+
+        libusb_release_interface(port->dev_handle, 0);
+        libusb_close(port->dev_handle);
+    }
+
+    port->ping_transfer = NULL;
+    port->ping_state = PING_IDLE;
+    port->dev_handle = NULL;
+
+    TAILQ_REMOVE(&(port->ctx->handle_lru), port, handle_next);
+    port->ctx->num_open_handles--;
+}
+
 void usb_helpers_reset_port(struct usb_port *port)
 {
     struct libusb_device_descriptor desc;
@@ -235,20 +341,21 @@ void usb_helpers_reset_port(struct usb_port *port)
                 "Device: %.4x:%.4x removed\n", desc.idVendor, desc.idProduct);
 
         if (port->dev_handle)
-            libusb_close(port->dev_handle);
+            usb_helpers_close_handle(port);
 
 
         libusb_unref_device(port->dev);
     }
 
+    usb_sysfs_close(port);
+
     //If we are currently resetting a device, do not remove from timeout
     //list. Otherwise, we will not send the up message. This is safe because
     //RESET depends on timeout. If a reset message fails, device is moved
     //back to IDLE. If device is then removed, it will correctly be removed
     //from timeout as well
     if ((port->msg_mode != RESET && port->msg_mode != PROBE) &&
-        (port->timeout_next.le_next != NULL ||
-        port->timeout_next.le_prev != NULL)) {
+        usb_monitor_lists_is_timeout_active(port)) {
         usb_monitor_lists_del_timeout(port);
     }
 
@@ -258,12 +365,132 @@ void usb_helpers_reset_port(struct usb_port *port)
     port->dev_handle = NULL;
     port->status = PORT_NO_DEV_CONNECTED;
     port->num_retrans = 0;
+    port->rtt_last_us = 0;
+    port->rtt_ewma_us = 0;
+    memset(port->rtt_hist, 0, sizeof(port->rtt_hist));
 }
 
-static void usb_helpers_ping_cb(struct libusb_transfer *transfer)
+//Update the RTT statistics of port with a successful ping
+static void usb_helpers_add_rtt(struct usb_port *port, uint64_t rtt_us)
 {
-    struct usb_port *port = transfer->user_data;
+    uint32_t bucket = 0, i;
+
+    if (rtt_us > UINT32_MAX)
+        rtt_us = UINT32_MAX;
+
+    if (rtt_us >= USB_RTT_MIN_US) {
+        bucket = 64 - __builtin_clzll(rtt_us >> USB_RTT_MIN_SHIFT);
+
+        if (bucket >= USB_RTT_BUCKETS)
+            bucket = USB_RTT_BUCKETS - 1;
+    }
+
+    if (port->rtt_hist[bucket] == UINT16_MAX) {
+        for (i = 0; i < USB_RTT_BUCKETS; i++)
+            port->rtt_hist[i] >>= 1;
+    }
+
+    port->rtt_hist[bucket]++;
+
+    //First sample of the device is used as is. The difference is shifted as
+    //an unsigned value, so the average moves towards rtt_us in both directions
+    if (port->rtt_ewma_us == 0)
+        port->rtt_ewma_us = rtt_us;
+    else if (rtt_us > port->rtt_ewma_us)
+        port->rtt_ewma_us += (rtt_us - port->rtt_ewma_us) >>
+                             USB_RTT_EWMA_SHIFT;
+    else
+        port->rtt_ewma_us -= (port->rtt_ewma_us - rtt_us) >>
+                             USB_RTT_EWMA_SHIFT;
+
+    port->rtt_last_us = rtt_us;
+}
+
+//Remove one step of backoff if port has been healthy for BACKOFF_DECAY_SEC.
+//The deferral of the next restart is lifted too, the new number of steps
+//decides the delay after the next restart
+static void usb_helpers_decay_backoff(struct usb_port *port)
+{
+    uint64_t now_ms = usb_helpers_get_time_us() / 1000;
+
+    if (now_ms - port->backoff_mark_ms < BACKOFF_DECAY_SEC * 1000)
+        return;
+
+    port->num_restarts--;
+    port->backoff_mark_ms = now_ms;
+    port->restart_after_ms = 0;
+}
+
+//Delay before port can be restarted again after restart number num_restarts.
+//The delay is drawn from [delay / 2, delay], so that ports that were
+//restarted together (for example when a hub was restarted) spread out
+static uint64_t usb_helpers_get_backoff_ms(struct usb_monitor_ctx *ctx,
+                                           uint8_t num_restarts)
+{
+    uint64_t delay_ms = (uint64_t) ctx->backoff_ms << (num_restarts - 1);
+
+    if (!delay_ms)
+        return 0;
+
+    if (delay_ms > ctx->backoff_max_ms)
+        delay_ms = ctx->backoff_max_ms;
+
+    return (delay_ms / 2) + (random() % ((delay_ms / 2) + 1));
+}
+
+uint8_t usb_helpers_restart_port(struct usb_port *port)
+{
+    uint64_t now_ms = usb_helpers_get_time_us() / 1000;
+    uint64_t delay_ms;
+    char path_buf[MAX_USB_PATH];
+    uint8_t path_buf_len = 0;
 
+    if (now_ms < port->restart_after_ms)
+        return 1;
+
+    if (port->update(port, CMD_RESTART))
+        return 1;
+
+    if (port->num_restarts < BACKOFF_MAX_STEPS)
+        port->num_restarts++;
+
+    delay_ms = usb_helpers_get_backoff_ms(port->ctx, port->num_restarts);
+    port->restart_after_ms = now_ms + delay_ms;
+    port->backoff_mark_ms = now_ms;
+
+    if (port->num_restarts > 1) {
+        usb_helpers_convert_path_char(port, path_buf, &path_buf_len, 0);
+        USB_DEBUG_PRINT_SYSLOG(port->ctx, LOG_INFO,
+                "Port %s restarted %u times, next restart in %u s\n",
+                path_buf, port->num_restarts,
+                (uint32_t) (delay_ms / 1000));
+    }
+
+    return 0;
+}
+
+uint32_t usb_helpers_get_restart_backoff(struct usb_port *port)
+{
+    uint64_t now_ms = usb_helpers_get_time_us() / 1000;
+
+    if (now_ms >= port->restart_after_ms)
+        return 0;
+
+    return port->restart_after_ms - now_ms;
+}
+
+static void usb_helpers_stretch_ping_interval(struct usb_port *port)
+{
+    if (port->ping_cur_interval_ms > port->ping_max_interval_ms / 2)
+        port->ping_cur_interval_ms = port->ping_max_interval_ms;
+    else
+        port->ping_cur_interval_ms *= 2;
+}
+
+//Handle the result of a liveness probe, no matter the probe type
+static void usb_helpers_handle_probe_result(struct usb_port *port,
+                                            uint8_t failed)
+{
     //With asynchrnous enable/disale/reset requests, we might be waiting for a
     //"ping" reply when request occurs. If this happens and reply arrives before
     //device is removed, ignore ping reply
@@ -271,18 +498,26 @@ static void usb_helpers_ping_cb(struct libusb_transfer *transfer)
         return;
     }
 
-    if (transfer->status != LIBUSB_TRANSFER_COMPLETED) {
+    if (failed) {
         USB_DEBUG_PRINT_SYSLOG(port->ctx, LOG_ERR,
                 "Ping failed for %.4x:%.4x\n",
                 port->vp.vid, port->vp.pid);
 
-        if (port->num_retrans == USB_RETRANS_LIMIT) {
+        //A failed ping means that the device is not healthy (yet)
+        if (port->num_restarts)
+            port->backoff_mark_ms = usb_helpers_get_time_us() / 1000;
+
+        //Check the device again soon
+        port->ping_cnt = 0;
+        port->ping_cur_interval_ms = port->ping_interval_ms;
+
+        if (port->num_retrans >= port->retrans_limit) {
             port->num_retrans = 0;
             if (port->msg_mode != RESET) {
-                //If restart fails, we want to try again right away. Do that
-                //after timer expires next time.
-                if (port->update(port, CMD_RESTART)) {
-                    port->num_retrans = USB_RETRANS_LIMIT;
+                //If restart fails or is deferred, we want to try again right
+                //away. Do that after timer expires next time.
+                if (usb_helpers_restart_port(port)) {
+                    port->num_retrans = port->retrans_limit;
                 } else {
                     return;
                 }
@@ -296,32 +531,110 @@ static void usb_helpers_ping_cb(struct libusb_transfer *transfer)
                     "Ping success for %.4x:%.4x\n",
                     port->vp.vid, port->vp.pid);
             port->ping_cnt = 0;
+
+            //Ping cnt is reset when a ping fails, so device has answered the
+            //last PING_OUTPUT pings
+            if (port->ping_cur_interval_ms < port->ping_max_interval_ms)
+                usb_helpers_stretch_ping_interval(port);
         }
         port->num_retrans = 0;
+
+        if (port->num_restarts)
+            usb_helpers_decay_backoff(port);
     }
 
     //We can only get into this function after timeout has been handeled and
     //removed from timeout list. It is therefore safe to add the port to the
     //timeout list again
-    usb_helpers_start_timeout(port, DEFAULT_TIMEOUT_SEC);
+    usb_helpers_start_ping_timeout(port, port->ping_cur_interval_ms, 0);
+}
+
+static void usb_helpers_ping_cb(struct libusb_transfer *transfer)
+{
+    struct usb_port *port = transfer->user_data;
+    uint8_t failed = transfer->status != LIBUSB_TRANSFER_COMPLETED;
+
+    //Port closed its handle while the transfer was in flight, see
+    //usb_helpers_close_handle()
+    if (port == NULL) {
+        libusb_release_interface(transfer->dev_handle, 0);
+        libusb_close(transfer->dev_handle);
+        libusb_free_transfer(transfer);
+        return;
+    }
+
+    port->ping_state = PING_IDLE;
+
+    if (!failed)
+        usb_helpers_add_rtt(port, usb_helpers_get_time_us() -
+                                  port->ping_submit_us);
+
+    usb_helpers_ping_done(port->ctx, failed);
+    usb_helpers_handle_probe_result(port, failed);
+}
+
+//Close handles until there is room for a new one. Only ports without a ping
+//queued or in flight are considered, so the limit can be exceeded for a while
+//if every port with an open handle is busy
+static void usb_helpers_evict_handles(struct usb_monitor_ctx *ctx)
+{
+    struct usb_port *itr, *next;
+
+    for (itr = TAILQ_FIRST(&(ctx->handle_lru));
+         itr && ctx->num_open_handles >= ctx->max_open_handles; itr = next) {
+        next = TAILQ_NEXT(itr, handle_next);
+
+        if (itr->ping_state != PING_IDLE)
+            continue;
+
+        usb_helpers_close_handle(itr);
+        ctx->handle_stats.evictions++;
+    }
 }
 
 static int32_t usb_helpers_configure_handle(struct usb_port *port)
 {
+    struct usb_monitor_ctx *ctx = port->ctx;
+    struct usb_monitor_handle_stats *stats = &(ctx->handle_stats);
     int32_t retval = 0;
+    uint64_t open_us;
+
+    if (ctx->max_open_handles &&
+        ctx->num_open_handles >= ctx->max_open_handles)
+        usb_helpers_evict_handles(ctx);
 
+    open_us = usb_helpers_get_time_us();
     retval = libusb_open(port->dev, &(port->dev_handle));
+    open_us = usb_helpers_get_time_us() - open_us;
+
+    //The transfer is reused for all pings sent while the handle is open
+    if (!retval && !(port->ping_transfer = libusb_alloc_transfer(0))) {
+        libusb_close(port->dev_handle);
+        port->dev_handle = NULL;
+        retval = LIBUSB_ERROR_NO_MEM;
+    }
 
     if (retval) {
+        stats->open_failures++;
         USB_DEBUG_PRINT_SYSLOG(port->ctx, LOG_ERR,
                 "Failed to open device, msg: %s, dev:\n",
                 libusb_error_name(retval));
         port->output(port);
         //That we cant open device is an indication that something is wrong
         port->num_retrans++;
-        usb_helpers_start_timeout(port, DEFAULT_TIMEOUT_SEC);
+        usb_helpers_start_ping_timeout(port, port->ping_interval_ms, 0);
+        return retval;
     }
 
+    stats->opens++;
+    stats->open_us += open_us;
+
+    if (open_us > stats->max_open_us)
+        stats->max_open_us = open_us;
+
+    TAILQ_INSERT_TAIL(&(ctx->handle_lru), port, handle_next);
+    ctx->num_open_handles++;
+
     return retval;
 }
 
@@ -329,51 +642,117 @@ void usb_helpers_send_ping(struct usb_port *port)
 {
     struct libusb_transfer *transfer;
 
+    //sysfs probes only read a few cached fds, so they are run right away and
+    //do not need the device handle
+    if (port->probe_type != PROBE_TYPE_USBFS_GET_STATUS) {
+        usb_helpers_handle_probe_result(port, usb_sysfs_probe(port));
+        return;
+    }
+
     if (port->dev_handle == NULL)
         if (usb_helpers_configure_handle(port))
             return;
 
-    transfer = libusb_alloc_transfer(0);
+    transfer = port->ping_transfer;
 
-    if (transfer == NULL) {
+    //Most recently pinged port is last in LRU list
+    TAILQ_REMOVE(&(port->ctx->handle_lru), port, handle_next);
+    TAILQ_INSERT_TAIL(&(port->ctx->handle_lru), port, handle_next);
+
+    //Should not happen, ping timeout is only started when the previous ping
+    //has completed
+    if (port->ping_state != PING_IDLE) {
         USB_DEBUG_PRINT_SYSLOG(port->ctx, LOG_ERR,
-                "Could not allocate transfer for:\n");
+                "Ping already pending for:\n");
         port->output(port);
-        usb_helpers_start_timeout(port, DEFAULT_TIMEOUT_SEC);
+        usb_helpers_start_ping_timeout(port, port->ping_interval_ms, 0);
         return;
     }
 
-    //Use flags to save us from adding som basic logic
-    transfer->flags = LIBUSB_TRANSFER_SHORT_NOT_OK |
-                      LIBUSB_TRANSFER_FREE_TRANSFER;
-
-    libusb_fill_control_setup(port->ping_buf,
-                              0x80,
-                              0x00,
-                              0x00,
-                              0x00,
-                              0x02);
+    //The transfer is not freed after the callback, it belongs to the port
+    transfer->flags = LIBUSB_TRANSFER_SHORT_NOT_OK;
 
     libusb_fill_control_transfer(transfer,
                                  port->dev_handle,
                                  port->ping_buf,
                                  usb_helpers_ping_cb,
                                  port,
-                                 5000);
+                                 port->ping_timeout_ms);
+
+    //Ports are pinged from their timeouts, and timeouts that expire close to
+    //each other are run in the same iteration of the event loop (timer
+    //slack). Queue the ping so that all pings of this iteration are submitted
+    //together by usb_helpers_ping_round_cb()
+    TAILQ_INSERT_TAIL(&(port->ctx->ping_queue), port, ping_next);
+    port->ping_state = PING_QUEUED;
+    backend_event_loop_post_task(port->ctx->event_loop,
+                                 &(port->ctx->ping_task));
+}
+
+void usb_helpers_dequeue_ping(struct usb_port *port)
+{
+    if (port->ping_state != PING_QUEUED)
+        return;
+
+    TAILQ_REMOVE(&(port->ctx->ping_queue), port, ping_next);
+    port->ping_state = PING_IDLE;
+}
+
+void usb_helpers_ping_round_cb(void *ptr)
+{
+    struct usb_monitor_ctx *ctx = ptr;
+    struct usb_port *port;
+
+    if (TAILQ_EMPTY(&(ctx->ping_queue)))
+        return;
+
+    //Pings submitted while a round is in progress become part of that round
+    if (!ctx->pings_in_flight) {
+        ctx->ping_round_start = usb_helpers_get_time_us();
+        ctx->ping_round_pinged = 0;
+        ctx->ping_round_failures = 0;
+    }
 
     libusb_unlock_events(NULL);
 
-    if (libusb_submit_transfer(transfer)) {
-        USB_DEBUG_PRINT_SYSLOG(port->ctx, LOG_ERR,
-                "Failed to submit transfer\n");
-        libusb_free_transfer(transfer);
-        libusb_release_interface(port->dev_handle, 0);
-        libusb_close(port->dev_handle);
-        port->dev_handle = NULL;
-        usb_helpers_start_timeout(port, DEFAULT_TIMEOUT_SEC);
+    while ((port = TAILQ_FIRST(&(ctx->ping_queue)))) {
+        TAILQ_REMOVE(&(ctx->ping_queue), port, ping_next);
+        port->ping_state = PING_IDLE;
+        ctx->ping_round_pinged++;
+
+        //The generic handler uses ping_buf for its hub requests, so the setup
+        //is filled in right before the transfer is submitted
+        libusb_fill_control_setup(port->ping_buf,
+                                  0x80,
+                                  0x00,
+                                  0x00,
+                                  0x00,
+                                  0x02);
+        port->ping_submit_us = usb_helpers_get_time_us();
+
+        if (libusb_submit_transfer(port->ping_transfer)) {
+            USB_DEBUG_PRINT_SYSLOG(ctx, LOG_ERR,
+                    "Failed to submit transfer\n");
+            ctx->ping_round_failures++;
+            usb_helpers_close_handle(port);
+
+            //The port timer is only used for pinging in PING mode
+            if (port->msg_mode == PING)
+                usb_helpers_start_ping_timeout(port, port->ping_interval_ms,
+                                               0);
+        } else {
+            port->ping_state = PING_IN_FLIGHT;
+            ctx->pings_in_flight++;
+        }
     }
 
     libusb_lock_events(NULL);
+
+    //Every submit failed
+    if (!ctx->pings_in_flight)
+        usb_helpers_ping_done(ctx, 0);
+
+    usb_monitor_update_libusb_timeout(ctx);
 }
 
 void usb_helpers_check_devices(struct usb_monitor_ctx *ctx)
@@ -420,46 +799,160 @@ void usb_helpers_convert_path_char(struct usb_port *port, char *output,
     memset(output, 0, MAX_USB_PATH); 
 
     for (i = 0; i < port->path_len[path_idx] - 1; i++)
-        len += snprintf(output + len, 4, "%u-", port->path[path_idx][i]);
+        len += snprintf(output + len, 4, "%u-", port->path[path_idx].bytes[i]);
 
-    len += snprintf(output + len, 3, "%u", port->path[path_idx][i]);
+    len += snprintf(output + len, 3, "%u", port->path[path_idx].bytes[i]);
     *output_len = len;
 }
 
-uint8_t usb_helpers_check_bad_id(struct usb_monitor_ctx *ctx,
-                                 struct usb_port *port)
+uint8_t usb_helpers_get_probe_type(struct usb_monitor_ctx *ctx,
+                                   struct usb_port *port)
 {
-    uint32_t i;
+    struct usb_probe_rule *rule, *match = NULL;
+    uint8_t i, match_len;
 
-    for (i = 0; i < ctx->num_bad_device_ids; i++) {
-        if (port->vp.vid == ctx->bad_device_ids[i].vid &&
-            port->vp.pid == ctx->bad_device_ids[i].pid) {
-            USB_DEBUG_PRINT_SYSLOG(ctx, LOG_INFO,
-                    "Will restart %.4x:%.4x due to bad ID\n",
-                    port->vp.vid, port->vp.pid);
-            return 1;
-   
-        }
+    for (i = 0; i < MAX_NUM_PATHS; i++) {
+        if (!port->path_len[i])
+            break;
+
+        rule = usb_path_tree_find_prefix(&(ctx->probe_rule_tree),
+                                         port->path[i].bytes,
+                                         port->path_len[i], &match_len);
+
+        if (rule && (!match || match_len > match->path_len))
+            match = rule;
     }
 
-    return 0;
+    return match ? match->probe_type : ctx->probe_type;
 }
 
-void usb_helpers_reset_all_ports(struct usb_monitor_ctx *ctx, uint8_t forced)
+void usb_helpers_merge_ping_config(struct usb_ping_config *config,
+                                   const struct usb_ping_config *layer)
 {
-    struct usb_port *itr;
+    config->fields |= layer->fields;
 
-    LIST_FOREACH(itr, &(ctx->port_list), port_next) {
-        //Only restart enabled ports which are not connected and are currently
-        //not being reset or probed
-        if (itr->msg_mode == RESET || !itr->enabled || itr->msg_mode == PROBE) {
-            continue;
-        }
+    if (layer->fields & PING_CFG_INTERVAL)
+        config->interval_ms = layer->interval_ms;
 
-        if (forced || itr->status == PORT_NO_DEV_CONNECTED) {
-            itr->update(itr, CMD_RESTART);
-        }
+    if (layer->fields & PING_CFG_TIMEOUT)
+        config->timeout_ms = layer->timeout_ms;
+
+    if (layer->fields & PING_CFG_ADDED)
+        config->added_ms = layer->added_ms;
+
+    if (layer->fields & PING_CFG_RETRANS)
+        config->retrans_limit = layer->retrans_limit;
+
+    if (layer->fields & PING_CFG_MAX_INTERVAL)
+        config->max_interval_ms = layer->max_interval_ms;
+}
+
+//The ping rules that match a port, sorted on path length
+struct usb_helpers_ping_rules {
+    struct usb_ping_rule *rules[MAX_NUM_PATHS * USB_PATH_TREE_MAX_DEPTH];
+    uint8_t num_rules;
+};
+
+static void usb_helpers_add_ping_rule_cb(const uint8_t *path, uint8_t path_len,
+                                         void *value, void *data)
+{
+    struct usb_helpers_ping_rules *matches = data;
+    struct usb_ping_rule *rule = value;
+    uint8_t i;
+
+    //A port with more than one path can match the same rule twice
+    for (i = 0; i < matches->num_rules; i++) {
+        if (matches->rules[i] == rule)
+            return;
+    }
+
+    //Rules of a path arrive shortest first, but the rules of different paths
+    //must be mixed
+    for (i = matches->num_rules; i > 0; i--) {
+        if (matches->rules[i - 1]->path_len <= rule->path_len)
+            break;
     }
+
+    memmove(&(matches->rules[i + 1]), &(matches->rules[i]),
+            (matches->num_rules - i) * sizeof(struct usb_ping_rule*));
+    matches->rules[i] = rule;
+    matches->num_rules++;
+}
+
+void usb_helpers_get_ping_config(struct usb_monitor_ctx *ctx,
+                                 struct usb_port *port,
+                                 struct usb_ping_config *config)
+{
+    struct usb_helpers_ping_rules matches;
+    uint8_t i;
+
+    *config = ctx->ping_config;
+
+    if (port->port_type < NUM_PORT_TYPES)
+        usb_helpers_merge_ping_config(config,
+                &(ctx->handler_ping_config[port->port_type]));
+
+    matches.num_rules = 0;
+
+    for (i = 0; i < MAX_NUM_PATHS; i++) {
+        if (!port->path_len[i])
+            break;
+
+        usb_path_tree_foreach_prefix(&(ctx->ping_rule_tree),
+                                     port->path[i].bytes, port->path_len[i],
+                                     usb_helpers_add_ping_rule_cb, &matches);
+    }
+
+    //The most specific rule is applied last
+    for (i = 0; i < matches.num_rules; i++)
+        usb_helpers_merge_ping_config(config, &(matches.rules[i]->config));
+
+    //Interval is not adaptive
+    if (config->max_interval_ms < config->interval_ms)
+        config->max_interval_ms = config->interval_ms;
+}
+
+uint8_t usb_helpers_check_bad_id(struct usb_monitor_ctx *ctx,
+                                 struct usb_port *port)
+{
+    struct usb_bad_device *match = usb_bad_ids_match(ctx, port);
+
+    if (!match || !match->restart)
+        return 0;
+
+    USB_DEBUG_PRINT_SYSLOG(ctx, LOG_INFO,
+            "Will restart %.4x:%.4x due to bad ID\n",
+            port->vp.vid, port->vp.pid);
+    return 1;
+}
+
+static void usb_helpers_reset_port_cb(const uint8_t *path, uint8_t path_len,
+                                      void *value, void *data)
+{
+    struct usb_port *itr = value;
+    uint8_t forced = *((uint8_t*) data);
+
+    //A port with more than one path is only reset for its first path
+    if (path_len != itr->path_len[0] ||
+        memcmp(path, itr->path[0].bytes, path_len))
+        return;
+
+    //Only restart enabled ports which are not connected and are currently
+    //not being reset or probed
+    if (itr->msg_mode == RESET || !itr->enabled || itr->msg_mode == PROBE)
+        return;
+
+    if (forced)
+        itr->update(itr, CMD_RESTART);
+    else if (itr->status == PORT_NO_DEV_CONNECTED)
+        usb_helpers_restart_port(itr);
+}
+
+void usb_helpers_reset_all_ports(struct usb_monitor_ctx *ctx, uint8_t forced)
+{
+    //Ports are reset in topology order, hub by hub
+    usb_monitor_lists_foreach_port_path(ctx, NULL, 0,
+                                        usb_helpers_reset_port_cb, &forced);
 }
 
 uint8_t usb_helpers_convert_char_to_path(char *path_str, uint8_t *path,
@@ -9,6 +9,7 @@
 struct usb_port;
 struct usb_hub;
 struct usb_monitor_ctx;
+struct usb_ping_config;
 
 //Use struct from uapi/usb/ch9.h instead
 struct hub_descriptor {
@@ -26,8 +27,9 @@ uint8_t usb_helpers_configure_port(struct usb_port *port,
                                    const char *path, uint8_t path_len,
                                    uint8_t port_num, struct usb_hub *parent);
 
-//Release memory contained in the generic part of usb port
-void usb_helpers_release_port(struct usb_port *port);
+//Close the device handle of port and free its ping transfer. If a ping is in
+//flight, it is cancelled and the handle is closed when the ping completes
+void usb_helpers_close_handle(struct usb_port *port);
 
 //Add path to existing port
 uint8_t usb_helpers_port_add_path(struct usb_port *port, const char *path,
@@ -45,15 +47,43 @@ int8_t usb_helpers_get_power_switch(struct usb_monitor_ctx *ctx,
 uint8_t usb_helpers_get_num_ports(struct usb_monitor_ctx *ctx,
                                   libusb_device *hub_device, uint16_t usb_ver);
 
-//Generic function for starting a timer
+//Timeout callback for all ports, called by the event loop
+void usb_helpers_port_timeout_cb(void *ptr);
+
+//Return delay_ms randomly moved by up to +/- TIMER_JITTER_PCT
+uint32_t usb_helpers_add_jitter(uint32_t delay_ms);
+
+//Generic function for starting a timer. The timeout is exact, it is used for
+//the steps of a port reset that the hardware needs (for example how long a
+//port is kept off)
 void usb_helpers_start_timeout(struct usb_port *port, uint8_t timeout_sec);
 
+//Same as usb_helpers_start_timeout(), but timeout is in ms
+void usb_helpers_start_timeout_ms(struct usb_port *port, uint32_t timeout_ms);
+
+//Start the timeout for the next ping of port. delay_ms is randomly moved by up
+//to TIMER_JITTER_PCT, so that ports that were pinged together drift apart. If
+//add_phase is set, a fixed per-port offset within the ping interval is added
+//too. This is used for the first ping after a device has been added, since
+//devices are often added at the same time (hub restarted, all ports reset)
+void usb_helpers_start_ping_timeout(struct usb_port *port, uint32_t delay_ms,
+                                    uint8_t add_phase);
+
 //Reset a usb_port struct, close handle, etc.
 void usb_helpers_reset_port(struct usb_port *port);
 
-//Sending ping is generic
+//Sending ping is generic. The ping is queued and submitted at the end of the
+//current event loop iteration, together with the other pings that are due
 void usb_helpers_send_ping(struct usb_port *port);
 
+//Remove port from the ping queue, if a ping is queued. Must be called when
+//msg_mode leaves PING. A ping that is already in flight is ignored when it
+//completes
+void usb_helpers_dequeue_ping(struct usb_port *port);
+
+//Task that submits all queued pings (ctx->ping_task), ptr is the context
+void usb_helpers_ping_round_cb(void *ptr);
+
 //Iterate through devices and call add for each of them. Used in case hub config
 //fails, for example
 void usb_helpers_check_devices(struct usb_monitor_ctx *ctx);
@@ -63,12 +93,34 @@ void usb_helpers_check_devices(struct usb_monitor_ctx *ctx);
 void usb_helpers_fill_port_array(struct libusb_device *dev, uint8_t *path,
                                  uint8_t *path_len);
 
+//Return the probe type to use for port, see struct usb_probe_rule
+uint8_t usb_helpers_get_probe_type(struct usb_monitor_ctx *ctx,
+                                   struct usb_port *port);
+
+//Override the settings in config with the settings that are set in layer
+void usb_helpers_merge_ping_config(struct usb_ping_config *config,
+                                   const struct usb_ping_config *layer);
+
+//Get the ping settings of port, see struct usb_ping_config
+void usb_helpers_get_ping_config(struct usb_monitor_ctx *ctx,
+                                 struct usb_port *port,
+                                 struct usb_ping_config *config);
+
 //Check if the port contains a bad id or not, return 0 if not, 1 if true
 uint8_t usb_helpers_check_bad_id(struct usb_monitor_ctx *ctx,
                                  struct usb_port *port);
 
+//Restart port, unless it is backing off from earlier automatic restarts.
+//Returns 0 if port was restarted, 1 if restart failed or was deferred. The
+//backoff state (num_restarts, restart_after_ms and backoff_mark_ms) is kept
+//when the device is removed
+uint8_t usb_helpers_restart_port(struct usb_port *port);
+
+//Return how long (ms) automatic restarts of port are deferred
+uint32_t usb_helpers_get_restart_backoff(struct usb_port *port);
+
 //Reset ports. If forced is set, then restart thos with a device connected
-//as well
+//as well and ignore the restart backoff
 void usb_helpers_reset_all_ports(struct usb_monitor_ctx *ctx, uint8_t forced);
 
 //Writes the path of port to output buffer, length is store in output_len
@@ -28,6 +28,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <time.h>
 
 #include <json-c/json.h>
@@ -37,6 +38,7 @@
 #include "ykush_handler.h"
 #include "usb_monitor_lists.h"
 #include "usb_helpers.h"
+#include "usb_bad_ids.h"
 #include "gpio_handler.h"
 #include "generic_handler.h"
 #include "usb_logging.h"
@@ -59,17 +61,6 @@ void usb_monitor_print_ports(struct usb_monitor_ctx *ctx)
     fprintf(ctx->logfile, "\n");
 }
 
-void usb_monitor_start_itr_cb(struct usb_monitor_ctx *ctx)
-{
-    ctx->event_loop->itr_data = ctx;
-    ctx->event_loop->itr_cb = usb_monitor_itr_cb;
-}
-
-void usb_monitor_stop_itr_cb(struct usb_monitor_ctx *ctx)
-{
-    ctx->event_loop->itr_cb = ctx->event_loop->itr_data = NULL;
-}
-
 static uint8_t usb_monitor_parse_handlers(struct usb_monitor_ctx *ctx,
                                           struct json_object *handlers)
 {
@@ -128,14 +119,22 @@ static uint8_t usb_monitor_parse_handlers(struct usb_monitor_ctx *ctx,
     return 0;
 }
 
+//Entries are {"vid": x, "pid": y}. pid can be replaced by "pid_min" and
+//"pid_max" for a range, or left out to match every pid of vid. vid can be left
+//out to match every vendor. "path" limits
+//the entry to the ports under path, and "restart": false exempts these ports
 static uint8_t usb_monitor_parse_bad_vid_pids(struct usb_monitor_ctx *ctx,
                                               struct json_object *bad_vid_pids)
 {
     uint32_t num_bad_vid_pids =
         (uint32_t) json_object_array_length(bad_vid_pids);
     int i;
-    uint16_t vid, pid;
+    int32_t vid, pid, pid_min, pid_max;
+    char path_buf[MAX_USB_PATH];
+    const char *path;
     struct json_object *bad_vid_pid;
+    struct usb_bad_device *bad_dev;
+    json_type val_type;
 
     if (!(ctx->bad_device_ids = calloc(sizeof(struct usb_bad_device) *
                                        num_bad_vid_pids, 1))) {
@@ -145,7 +144,10 @@ static uint8_t usb_monitor_parse_bad_vid_pids(struct usb_monitor_ctx *ctx,
 
     for (i = 0; i < num_bad_vid_pids; i++) {
         bad_vid_pid = json_object_array_get_idx(bad_vid_pids, i);
-        vid = pid = 0;
+        bad_dev = &(ctx->bad_device_ids[i]);
+        vid = pid = pid_min = pid_max = -1;
+        path = NULL;
+        bad_dev->restart = 1;
 
         if (json_object_get_type(bad_vid_pid) != json_type_object) {
             fprintf(stderr, "Array element has incorrect type (not obj.)\n");
@@ -153,7 +155,27 @@ static uint8_t usb_monitor_parse_bad_vid_pids(struct usb_monitor_ctx *ctx,
         }
 
         json_object_object_foreach(bad_vid_pid, key, val) {
-            if (json_object_get_type(val) != json_type_int) {
+            val_type = json_object_get_type(val);
+
+            if (!strcmp("path", key)) {
+                if (val_type != json_type_string) {
+                    fprintf(stderr, "Incorrect object found in array\n");
+                    return 1;
+                }
+
+                path = json_object_get_string(val);
+                continue;
+            } else if (!strcmp("restart", key)) {
+                if (val_type != json_type_boolean) {
+                    fprintf(stderr, "Incorrect object found in array\n");
+                    return 1;
+                }
+
+                bad_dev->restart = json_object_get_boolean(val);
+                continue;
+            }
+
+            if (val_type != json_type_int) {
                 fprintf(stderr, "Incorrect object found in array\n");
                 return 1;
             }
@@ -162,61 +184,389 @@ static uint8_t usb_monitor_parse_bad_vid_pids(struct usb_monitor_ctx *ctx,
                 vid = json_object_get_int(val);
             } else if (!strcmp("pid", key)) {
                 pid = json_object_get_int(val);
+            } else if (!strcmp("pid_min", key)) {
+                pid_min = json_object_get_int(val);
+            } else if (!strcmp("pid_max", key)) {
+                pid_max = json_object_get_int(val);
             } else {
                 fprintf(stderr, "Unknown key found\n");
                 return 1;
             }
         }
 
-        //Add wildcard support (for pid) later
-        if (!vid || !pid) {
-            fprintf(stderr, "vid/pid is not set\n");
+        if (!vid || vid > UINT16_MAX || !pid) {
+            fprintf(stderr, "vid/pid is invalid\n");
+            return 1;
+        }
+
+        //No vid means any vid, stored as vid 0
+        if (vid < 0)
+            vid = 0;
+
+        //pid is the same as a range of one pid. No pid means any pid
+        if (pid > 0) {
+            if (pid_min >= 0 || pid_max >= 0) {
+                fprintf(stderr, "Both pid and pid range set\n");
+                return 1;
+            }
+
+            pid_min = pid_max = pid;
+        }
+
+        if (pid_min < 0)
+            pid_min = 0;
+
+        if (pid_max < 0)
+            pid_max = UINT16_MAX;
+
+        if (pid_min > pid_max || pid_max > UINT16_MAX) {
+            fprintf(stderr, "Invalid pid range\n");
+            return 1;
+        }
+
+        bad_dev->vid = vid;
+        bad_dev->pid_min = pid_min;
+        bad_dev->pid_max = pid_max;
+
+        if (!path)
+            continue;
+
+        //convert_char_to_path modifies the string
+        if (strlen(path) >= sizeof(path_buf)) {
+            fprintf(stderr, "Bad device path is too long\n");
             return 1;
         }
 
-        ctx->bad_device_ids[i].vid = vid;
-        ctx->bad_device_ids[i].pid = pid;
+        strcpy(path_buf, path);
+
+        if (usb_helpers_convert_char_to_path(path_buf, bad_dev->path.bytes,
+                                             &(bad_dev->path_len)) ||
+            !bad_dev->path_len) {
+            fprintf(stderr, "Bad device path is invalid\n");
+            return 1;
+        }
     }
 
     ctx->num_bad_device_ids = num_bad_vid_pids;
+
+    if (usb_bad_ids_index(ctx)) {
+        fprintf(stderr, "Could not index bad devices\n");
+        return 1;
+    }
+
     return 0;
 }
 
-//Return 0 on success, 1 on failure
-static uint8_t usb_monitor_parse_config(struct usb_monitor_ctx *ctx,
-                                        const char *config_file_name)
+//Returns probe type, or -1 if name is unknown
+static int32_t usb_monitor_parse_probe_type(const char *name)
 {
-    //Limit the number of bytes we read from file
-    char buf[1024];
-    FILE *conf_file;
-    //TODO: Clean up a bit here
-    struct json_object *conf_json;
-    int retval = 0;
-
-    memset(buf, 0, sizeof(buf));
-    conf_file = fopen(config_file_name, "re");
+    if (!strcmp(name, "usbfs_get_status"))
+        return PROBE_TYPE_USBFS_GET_STATUS;
+    else if (!strcmp(name, "sysfs_urbnum"))
+        return PROBE_TYPE_SYSFS_URBNUM;
+    else if (!strcmp(name, "sysfs_state"))
+        return PROBE_TYPE_SYSFS_STATE;
+    else
+        return -1;
+}
 
-    if (conf_file == NULL) {
-        fprintf(stderr, "Failed to open config file\n");
+//Entries are {"path": "x-x", "probe": "<probe type>"}
+static uint8_t usb_monitor_parse_probe_rules(struct usb_monitor_ctx *ctx,
+                                             struct json_object *probe_rules)
+{
+    uint32_t num_probe_rules =
+        (uint32_t) json_object_array_length(probe_rules);
+    int i;
+    int32_t probe_type;
+    char path_buf[MAX_USB_PATH];
+    const char *path;
+    struct json_object *probe_rule;
+    struct usb_probe_rule *rule;
+
+    if (!(ctx->probe_rules = calloc(sizeof(struct usb_probe_rule) *
+                                    num_probe_rules, 1))) {
+        fprintf(stderr, "Could not allocate probe rules memory\n");
         return 1;
     }
 
-    retval = fread(buf, 1, 1024, conf_file);
+    for (i = 0; i < num_probe_rules; i++) {
+        probe_rule = json_object_array_get_idx(probe_rules, i);
+        rule = &(ctx->probe_rules[i]);
+        probe_type = -1;
+        path = NULL;
+
+        if (json_object_get_type(probe_rule) != json_type_object) {
+            fprintf(stderr, "Array element has incorrect type (not obj.)\n");
+            return 1;
+        }
+
+        json_object_object_foreach(probe_rule, key, val) {
+            if (json_object_get_type(val) != json_type_string) {
+                fprintf(stderr, "Incorrect object found in array\n");
+                return 1;
+            }
+
+            if (!strcmp("path", key)) {
+                path = json_object_get_string(val);
+            } else if (!strcmp("probe", key)) {
+                probe_type = usb_monitor_parse_probe_type(
+                        json_object_get_string(val));
+            } else {
+                fprintf(stderr, "Unknown key found\n");
+                return 1;
+            }
+        }
+
+        if (!path || probe_type < 0 || strlen(path) >= sizeof(path_buf)) {
+            fprintf(stderr, "Probe rule path/probe is not set or invalid\n");
+            return 1;
+        }
+
+        //convert_char_to_path modifies the string
+        strcpy(path_buf, path);
+
+        if (usb_helpers_convert_char_to_path(path_buf, rule->path.bytes,
+                                             &(rule->path_len)) ||
+            !rule->path_len) {
+            fprintf(stderr, "Probe rule path is invalid\n");
+            return 1;
+        }
+
+        rule->probe_type = probe_type;
+
+        //The first rule for a path wins
+        if (usb_path_tree_find(&(ctx->probe_rule_tree), rule->path.bytes,
+                               rule->path_len))
+            continue;
+
+        if (usb_path_tree_insert(&(ctx->probe_rule_tree), rule->path.bytes,
+                                 rule->path_len, rule)) {
+            fprintf(stderr, "Could not index probe rules\n");
+            return 1;
+        }
+    }
+
+    ctx->num_probe_rules = num_probe_rules;
+    return 0;
+}
 
-    if (retval != sizeof(buf) &&
-        ferror(conf_file)) {
-        fprintf(stderr, "Failed to read from config file\n");
-        fclose(conf_file);
+//Parse one ping setting into config
+static uint8_t usb_monitor_parse_ping_value(const char *key,
+                                            struct json_object *val,
+                                            struct usb_ping_config *config)
+{
+    int32_t value;
+
+    if (json_object_get_type(val) != json_type_int ||
+        (value = json_object_get_int(val)) < 0) {
+        fprintf(stderr, "Ping config %s is of incorrect type\n", key);
         return 1;
+    }
+
+    if (!strcmp("interval_ms", key) && value > 0) {
+        config->interval_ms = value;
+        config->fields |= PING_CFG_INTERVAL;
+    } else if (!strcmp("timeout_ms", key) && value > 0) {
+        config->timeout_ms = value;
+        config->fields |= PING_CFG_TIMEOUT;
+    } else if (!strcmp("added_delay_ms", key)) {
+        config->added_ms = value;
+        config->fields |= PING_CFG_ADDED;
+    } else if (!strcmp("max_interval_ms", key)) {
+        config->max_interval_ms = value;
+        config->fields |= PING_CFG_MAX_INTERVAL;
+    } else if (!strcmp("retrans_limit", key) && value <= UINT8_MAX) {
+        config->retrans_limit = value;
+        config->fields |= PING_CFG_RETRANS;
     } else {
-        fclose(conf_file);
+        fprintf(stderr, "Unknown or invalid ping config %s\n", key);
+        return 1;
     }
 
-    //Parse JSON
-    conf_json = json_tokener_parse(buf);
+    return 0;
+}
+
+//Parse the ping settings in obj into config, settings that are not in obj are
+//left untouched
+static uint8_t usb_monitor_parse_ping_config(struct json_object *obj,
+                                             struct usb_ping_config *config)
+{
+    if (json_object_get_type(obj) != json_type_object) {
+        fprintf(stderr, "Ping config has incorrect type (not obj.)\n");
+        return 1;
+    }
+
+    json_object_object_foreach(obj, key, val) {
+        if (usb_monitor_parse_ping_value(key, val, config))
+            return 1;
+    }
+
+    return 0;
+}
+
+//Entries are {"path": "x-x", <ping settings>}
+static uint8_t usb_monitor_parse_ping_rule(struct json_object *obj,
+                                           struct usb_ping_rule *rule)
+{
+    char path_buf[MAX_USB_PATH];
+    const char *path = NULL;
+
+    if (json_object_get_type(obj) != json_type_object) {
+        fprintf(stderr, "Array element has incorrect type (not obj.)\n");
+        return 1;
+    }
+
+    json_object_object_foreach(obj, key, val) {
+        if (!strcmp("path", key) &&
+            json_object_get_type(val) == json_type_string) {
+            path = json_object_get_string(val);
+        } else if (usb_monitor_parse_ping_value(key, val, &(rule->config))) {
+            return 1;
+        }
+    }
+
+    if (!path || strlen(path) >= sizeof(path_buf)) {
+        fprintf(stderr, "Ping rule path is not set or invalid\n");
+        return 1;
+    }
+
+    //convert_char_to_path modifies the string
+    strcpy(path_buf, path);
+
+    if (usb_helpers_convert_char_to_path(path_buf, rule->path.bytes,
+                                         &(rule->path_len)) ||
+        !rule->path_len) {
+        fprintf(stderr, "Ping rule path is invalid\n");
+        return 1;
+    }
+
+    return 0;
+}
+
+//Handler names are the same as in the handlers array, and ports of hubs
+//without a special handler use "Generic"
+static int32_t usb_monitor_parse_port_type(const char *name)
+{
+    if (!strcmp(name, "Generic"))
+        return PORT_TYPE_UNKNOWN;
+    else if (!strcmp(name, "GPIO"))
+        return PORT_TYPE_GPIO;
+    else if (!strcmp(name, "YKUSH"))
+        return PORT_TYPE_YKUSH;
+    else if (!strcmp(name, "Lanner"))
+        return PORT_TYPE_LANNER;
+    else
+        return -1;
+}
+
+static uint8_t usb_monitor_parse_ping_rules(struct usb_monitor_ctx *ctx,
+                                            struct json_object *rules)
+{
+    uint32_t num_ping_rules = (uint32_t) json_object_array_length(rules);
+    struct usb_ping_rule *rule, *prev_rule;
+    uint32_t i;
+
+    if (!(ctx->ping_rules = calloc(sizeof(struct usb_ping_rule) *
+                                   num_ping_rules, 1))) {
+        fprintf(stderr, "Could not allocate ping rules memory\n");
+        return 1;
+    }
+
+    for (i = 0; i < num_ping_rules; i++) {
+        rule = &(ctx->ping_rules[ctx->num_ping_rules]);
+
+        if (usb_monitor_parse_ping_rule(json_object_array_get_idx(rules, i),
+                                        rule))
+            return 1;
+
+        //A later rule for the same path overrides the settings it contains,
+        //the slot is reused for the next rule
+        if ((prev_rule = usb_path_tree_find(&(ctx->ping_rule_tree),
+                                            rule->path.bytes,
+                                            rule->path_len))) {
+            usb_helpers_merge_ping_config(&(prev_rule->config),
+                                          &(rule->config));
+            memset(rule, 0, sizeof(struct usb_ping_rule));
+            continue;
+        }
+
+        if (usb_path_tree_insert(&(ctx->ping_rule_tree), rule->path.bytes,
+                                 rule->path_len, rule)) {
+            fprintf(stderr, "Could not index ping rules\n");
+            return 1;
+        }
+
+        ctx->num_ping_rules++;
+    }
+
+    return 0;
+}
+
+//The ping object contains the default ping settings, "handlers" with the
+//settings per handler and "rules", an array of settings for a path, for
+//example:
+//{"interval_ms": 5000, "handlers": {"YKUSH": {"retrans_limit": 2}},
+// "rules": [{"path": "3-1", "interval_ms": 1000}]}
+static uint8_t usb_monitor_parse_ping(struct usb_monitor_ctx *ctx,
+                                      struct json_object *ping)
+{
+    int32_t port_type;
+
+    if (json_object_get_type(ping) != json_type_object) {
+        fprintf(stderr, "ping is of incorrect type\n");
+        return 1;
+    }
+
+    json_object_object_foreach(ping, key, val) {
+        if (!strcmp("rules", key)) {
+            if (json_object_get_type(val) != json_type_array) {
+                fprintf(stderr, "ping rules is of incorrect type\n");
+                return 1;
+            }
+
+            if (usb_monitor_parse_ping_rules(ctx, val))
+                return 1;
+        } else if (!strcmp("handlers", key)) {
+            if (json_object_get_type(val) != json_type_object) {
+                fprintf(stderr, "ping handlers is of incorrect type\n");
+                return 1;
+            }
+
+            json_object_object_foreach(val, handler, handler_val) {
+                if ((port_type = usb_monitor_parse_port_type(handler)) < 0) {
+                    fprintf(stderr, "Unknown handler %s in ping config\n",
+                            handler);
+                    return 1;
+                }
+
+                if (usb_monitor_parse_ping_config(handler_val,
+                        &(ctx->handler_ping_config[port_type])))
+                    return 1;
+            }
+        } else if (usb_monitor_parse_ping_value(key, val,
+                                                &(ctx->ping_config))) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+//Return 0 on success, 1 on failure
+static uint8_t usb_monitor_parse_config(struct usb_monitor_ctx *ctx,
+                                        const char *config_file_name)
+{
+    //TODO: Clean up a bit here
+    struct json_object *conf_json;
+    int retval = 0;
+    int32_t probe_type;
+
+    //Read and parse the whole file, the rule tables make configs larger than
+    //what fits in a fixed buffer
+    conf_json = json_object_from_file(config_file_name);
 
     if (conf_json == NULL) {
-        fprintf(stderr, "Failed to parse JSON\n");
+        fprintf(stderr, "Failed to read or parse config file\n");
         return 1;
     }
 
@@ -251,6 +601,55 @@ static uint8_t usb_monitor_parse_config(struct usb_monitor_ctx *ctx,
             if ((retval = usb_monitor_parse_bad_vid_pids(ctx, val))) {
                 break;
             }
+        } else if (!strcmp("probe", key)) {
+            if (json_object_get_type(val) != json_type_string ||
+                (probe_type = usb_monitor_parse_probe_type(
+                        json_object_get_string(val))) < 0) {
+                fprintf(stderr, "probe is of incorrect type or unknown");
+                retval = 1;
+                break;
+            }
+
+            ctx->probe_type = probe_type;
+        } else if (!strcmp("probe_rules", key)) {
+            if (json_object_get_type(val) != json_type_array) {
+                fprintf(stderr, "probe_rules is of incorrect type");
+                retval = 1;
+                break;
+            }
+
+            if ((retval = usb_monitor_parse_probe_rules(ctx, val))) {
+                break;
+            }
+        } else if (!strcmp("restart_backoff_sec", key) ||
+                   !strcmp("restart_backoff_max_sec", key)) {
+            if (json_object_get_type(val) != json_type_int ||
+                json_object_get_int(val) < 0) {
+                fprintf(stderr, "%s is of incorrect type", key);
+                retval = 1;
+                break;
+            }
+
+            if (!strcmp("restart_backoff_sec", key))
+                ctx->backoff_ms = json_object_get_int(val) * 1000U;
+            else
+                ctx->backoff_max_ms = json_object_get_int(val) * 1000U;
+        } else if (!strcmp("ping", key)) {
+            if ((retval = usb_monitor_parse_ping(ctx, val))) {
+                break;
+            }
+        } else if (!strcmp("sysfs_root", key)) {
+            if (json_object_get_type(val) != json_type_string) {
+                fprintf(stderr, "sysfs_root is of incorrect type");
+                retval = 1;
+                break;
+            }
+
+            if (!(ctx->sysfs_root = strdup(json_object_get_string(val)))) {
+                fprintf(stderr, "Could not allocate sysfs_root\n");
+                retval = 1;
+                break;
+            }
         }
     }
 
@@ -267,33 +666,38 @@ static void usb_monitor_signal_handler(int signum)
 
 static void usb_monitor_start_event_loop(struct usb_monitor_ctx *ctx)
 {
+    struct backend_timeout_handle *handle;
     struct timespec tp;
-    uint64_t cur_time;
+    uint64_t cur_time, first_reset;
 
     clock_gettime(CLOCK_MONOTONIC_RAW, &tp);
     cur_time = (tp.tv_sec * 1e3) + (tp.tv_nsec / 1e6);
 
     //These timeout pointers will live for as long as the application.
-    //Therefore, there is no need to save them anywhere
-    if (!backend_event_loop_add_timeout(ctx->event_loop, cur_time + 1000,
-                                        usb_monitor_1sec_timeout_cb, ctx, 1000,
-                                        true)) {
-        return;
-    }
-   
+    //Therefore, there is no need to save them anywhere, except for the reset
+    //timeout that is jittered by its callback
     //Do not make this one a multiple of reset_cb timeout. There is no need
     //resetting and checking at the same time
-    if (!backend_event_loop_add_timeout(ctx->event_loop, cur_time + 25000,
-                                        usb_monitor_check_devices_cb,
-                                        ctx, 25000, true)) {
+    if (!(handle = backend_event_loop_add_timeout(ctx->event_loop,
+                                                  cur_time + 25000,
+                                                  usb_monitor_check_devices_cb,
+                                                  ctx, 25000, true))) {
         return;
     }
 
-    if (!ctx->disable_auto_restart &&
-        !backend_event_loop_add_timeout(ctx->event_loop, cur_time + 120000,
-                                        usb_monitor_check_reset_cb,
-                                        ctx, 120000, true)) {
-        return;
+    backend_timeout_set_slack(handle, ctx->timer_slack_ms);
+
+    if (!ctx->disable_auto_restart) {
+        first_reset = cur_time + usb_helpers_add_jitter(RESET_SWEEP_MS);
+
+        if (!(handle = backend_event_loop_add_timeout(ctx->event_loop,
+                                                      first_reset,
+                                                      usb_monitor_check_reset_cb,
+                                                      ctx, RESET_SWEEP_MS, true)))
+            return;
+
+        backend_timeout_set_slack(handle, ctx->timer_slack_ms);
+        ctx->check_reset_handle = handle;
     }
 
     backend_event_loop_run(ctx->event_loop);
@@ -311,6 +715,7 @@ static void usb_monitor_configure_client(struct usb_monitor_ctx *ctx,
 
     http_parser_init(&(client->parser), HTTP_REQUEST);
     client->parser.data = (void*) client;
+    client->parser_settings.on_url = usb_monitor_client_on_url;
     client->parser_settings.on_body = usb_monitor_client_on_body;
     client->parser_settings.on_message_complete =
         usb_monitor_client_on_complete;
@@ -378,6 +783,45 @@ static int usb_monitor_configure_unix_socket(struct usb_monitor_ctx *ctx)
                                      fd, ctx->accept_handle);
 }
 
+//Names used for the callbacks in the profiling output and slow callback
+//warnings. Handlers with private callbacks register their own names
+static void usb_monitor_set_cb_names(struct usb_monitor_ctx *ctx)
+{
+    struct backend_event_loop *del = ctx->event_loop;
+
+    backend_event_loop_set_cb_name(del, (void*) usb_monitor_usb_event_cb,
+                                   "libusb_events");
+    backend_event_loop_set_cb_name(del, (void*) usb_monitor_libusb_timeout_cb,
+                                   "libusb_timeout");
+    backend_event_loop_set_cb_name(del, (void*) usb_monitor_accept_cb,
+                                   "http_accept");
+    backend_event_loop_set_cb_name(del, (void*) usb_monitor_client_cb,
+                                   "http_client");
+    backend_event_loop_set_cb_name(del, (void*) usb_monitor_check_devices_cb,
+                                   "check_devices");
+    backend_event_loop_set_cb_name(del, (void*) usb_monitor_check_reset_cb,
+                                   "check_reset");
+    backend_event_loop_set_cb_name(del, (void*) usb_helpers_port_timeout_cb,
+                                   "port_timeout");
+    backend_event_loop_set_cb_name(del, (void*) usb_helpers_ping_round_cb,
+                                   "ping_round");
+}
+
+//Free the indexes and the rules from the config file. Only used on shutdown
+static void usb_monitor_release(struct usb_monitor_ctx *ctx)
+{
+    usb_path_tree_destroy(&(ctx->port_path_tree));
+    usb_path_tree_destroy(&(ctx->probe_rule_tree));
+    usb_path_tree_destroy(&(ctx->ping_rule_tree));
+    usb_path_tree_destroy(&(ctx->bad_id_tree));
+    usb_monitor_hash_destroy(&(ctx->port_path_hash));
+    usb_monitor_hash_destroy(&(ctx->hub_hash));
+
+    free(ctx->bad_device_ids);
+    free(ctx->probe_rules);
+    free(ctx->ping_rules);
+}
+
 static uint8_t usb_monitor_configure(struct usb_monitor_ctx *ctx, uint8_t sock)
 {
     int i = 0;
@@ -386,11 +830,28 @@ static uint8_t usb_monitor_configure(struct usb_monitor_ctx *ctx, uint8_t sock)
 
     LIST_INIT(&(ctx->hub_list));
     LIST_INIT(&(ctx->port_list));
-    LIST_INIT(&(ctx->timeout_list));
+
+    if (usb_monitor_hash_init(&(ctx->port_path_hash)) ||
+        usb_monitor_hash_init(&(ctx->hub_hash))) {
+        fprintf(stderr, "Failed to allocate port path and hub hash\n");
+        fclose(ctx->logfile);
+        return 1;
+    }
+
+    usb_path_tree_init(&(ctx->port_path_tree));
+    usb_path_tree_init(&(ctx->probe_rule_tree));
+    usb_path_tree_init(&(ctx->ping_rule_tree));
+    usb_path_tree_init(&(ctx->bad_id_tree));
+
+    TAILQ_INIT(&(ctx->ping_queue));
+    TAILQ_INIT(&(ctx->handle_lru));
+    backend_configure_itr_task(&(ctx->ping_task), usb_helpers_ping_round_cb,
+                               ctx);
 
     //We handle maximum of five concurrent clients
     ctx->clients_map = 0x1F;
-    ctx->event_loop = backend_event_loop_create();
+    ctx->event_loop = backend_event_loop_create(ctx->use_timer_wheel ?
+                                                BACKEND_FLAG_TIMER_WHEEL : 0);
 
     for (i = 0; i < MAX_HTTP_CLIENTS; i++)
         ctx->clients[i] = NULL;
@@ -400,9 +861,18 @@ static uint8_t usb_monitor_configure(struct usb_monitor_ctx *ctx, uint8_t sock)
         fclose(ctx->logfile);
         return 1;
     }
+
+    //Profiling is best effort, we can run without it
+    if (backend_event_loop_enable_profiling(ctx->event_loop, ctx->cb_budget_ms,
+                                            usb_monitor_slow_cb, ctx))
+        USB_DEBUG_PRINT_SYSLOG(ctx, LOG_INFO, "Failed to enable callback "
+                               "profiling\n");
+
+    usb_monitor_set_cb_names(ctx);
    
     if (sock) {
-        ctx->accept_handle = backend_create_epoll_handle(ctx, 0, NULL, 0);
+        ctx->accept_handle = backend_create_epoll_handle(ctx->event_loop, ctx,
+                                                         0, NULL, 0);
 
         if (ctx->accept_handle == NULL) {
             fprintf(stderr, "Could not create accept handle\n");
@@ -425,7 +895,8 @@ static uint8_t usb_monitor_configure(struct usb_monitor_ctx *ctx, uint8_t sock)
     }
 
     ctx->libusb_handle = 
-        backend_create_epoll_handle(ctx, 0, usb_monitor_usb_event_cb, 1);
+        backend_create_epoll_handle(ctx->event_loop, ctx, 0,
+                                    usb_monitor_usb_event_cb, 1);
 
     if (ctx->libusb_handle == NULL) {
         fprintf(stderr, "Failed to create epoll handle\n");
@@ -450,6 +921,36 @@ static uint8_t usb_monitor_configure(struct usb_monitor_ctx *ctx, uint8_t sock)
 
     free(libusb_fds);
 
+    //Unless libusb handles its timeouts through the file descriptors above
+    //(timerfd on newer kernels), we have to drive them ourselves. Instead of
+    //polling, we arm a timerfd with the value of libusb_get_next_timeout()
+    ctx->libusb_timer_fd = -1;
+
+    if (!libusb_pollfds_handle_timeouts(NULL)) {
+        ctx->libusb_timer_fd = timerfd_create(CLOCK_MONOTONIC,
+                                              TFD_NONBLOCK | TFD_CLOEXEC);
+
+        if (ctx->libusb_timer_fd == -1) {
+            fprintf(stderr, "Failed to create libusb timerfd\n");
+            fclose(ctx->logfile);
+            return 1;
+        }
+
+        ctx->libusb_timer_handle =
+            backend_create_epoll_handle(ctx->event_loop, ctx,
+                                        ctx->libusb_timer_fd,
+                                        usb_monitor_libusb_timeout_cb, 0);
+
+        if (ctx->libusb_timer_handle == NULL ||
+            backend_event_loop_update(ctx->event_loop, EPOLLIN, EPOLL_CTL_ADD,
+                                      ctx->libusb_timer_fd,
+                                      ctx->libusb_timer_handle)) {
+            fprintf(stderr, "Failed to add libusb timerfd to event loop\n");
+            fclose(ctx->logfile);
+            return 1;
+        }
+    }
+
     libusb_set_pollfd_notifiers(NULL,
                                 usb_monitor_libusb_fd_add,
                                 usb_monitor_libusb_fd_remove,
@@ -499,6 +1000,15 @@ static void usb_monitor_print_usage()
     fprintf(stdout, "\t-g : group id of usb monitor socket (optional)\n");
     fprintf(stdout, "\t-d : run as daemon\n");
     fprintf(stdout, "\t-s : write to syslog\n");
+    fprintf(stdout, "\t-w : use timing wheel for timers (default is heap)\n");
+    fprintf(stdout, "\t-b : warn when a callback runs for longer than this "
+                    "many ms, 0 to disable (default %u)\n",
+                    DEFAULT_CB_BUDGET_MS);
+    fprintf(stdout, "\t-t : timer slack in ms, timers that expire within this "
+                    "window are run together (default %u)\n",
+                    DEFAULT_TIMER_SLACK_MS);
+    fprintf(stdout, "\t-n : max. number of open device handles, the least "
+                    "recently pinged are closed first (default 0, no limit)\n");
     fprintf(stdout, "\t-p : generate pin/port mapping dynamically. This value "
             "is set to the path of new mapping file (optional, only GPIO for "
             "now, default is empty)\n");
@@ -512,6 +1022,7 @@ int main(int argc, char *argv[])
     uint8_t daemonize = 0;
     char *conf_file_name = NULL, *probe_mapping_path = NULL;
     struct sigaction sig_handler;
+    struct usb_bad_device *bad_dev;
     int32_t pid_fd, i;
 
     //We should only allow one running instance of usb_monitor
@@ -533,8 +1044,18 @@ int main(int argc, char *argv[])
     }
 
     usbmon_ctx->logfile = stderr;
-
-    while ((retval = getopt(argc, argv, "o:c:g:dhsp:")) != -1) {
+    usbmon_ctx->timer_slack_ms = DEFAULT_TIMER_SLACK_MS;
+    usbmon_ctx->cb_budget_ms = DEFAULT_CB_BUDGET_MS;
+    usbmon_ctx->ping_config.interval_ms = DEFAULT_TIMEOUT_SEC * 1000;
+    usbmon_ctx->ping_config.timeout_ms = DEFAULT_PING_TIMEOUT_MS;
+    usbmon_ctx->ping_config.added_ms = ADDED_TIMEOUT_SEC * 1000;
+    usbmon_ctx->ping_config.retrans_limit = USB_RETRANS_LIMIT;
+    usbmon_ctx->backoff_ms = DEFAULT_BACKOFF_SEC * 1000;
+    usbmon_ctx->backoff_max_ms = DEFAULT_BACKOFF_MAX_SEC * 1000;
+    //Only used for jitter
+    srandom(time(NULL) ^ getpid());
+
+    while ((retval = getopt(argc, argv, "o:c:g:dhswt:b:n:p:")) != -1) {
         switch (retval) {
         case 'o':
             usbmon_ctx->logfile = fopen(optarg, "a+");
@@ -548,6 +1069,18 @@ int main(int argc, char *argv[])
         case 's':
             usbmon_ctx->use_syslog = 1;
             break;
+        case 'w':
+            usbmon_ctx->use_timer_wheel = 1;
+            break;
+        case 'b':
+            usbmon_ctx->cb_budget_ms = atoi(optarg);
+            break;
+        case 't':
+            usbmon_ctx->timer_slack_ms = atoi(optarg);
+            break;
+        case 'n':
+            usbmon_ctx->max_open_handles = atoi(optarg);
+            break;
         case 'g':
             usbmon_ctx->group_id = atoi(optarg);
             break;
@@ -614,9 +1147,12 @@ int main(int argc, char *argv[])
         USB_DEBUG_PRINT_SYSLOG(usbmon_ctx, LOG_INFO, "Bad device IDs:\n");
 
         for (i = 0; i < usbmon_ctx->num_bad_device_ids; i++) {
-            USB_DEBUG_PRINT_SYSLOG(usbmon_ctx, LOG_INFO, "0x%.4x:0x%.4x\n",
-                                   usbmon_ctx->bad_device_ids[i].vid,
-                                   usbmon_ctx->bad_device_ids[i].pid);
+            bad_dev = &(usbmon_ctx->bad_device_ids[i]);
+            USB_DEBUG_PRINT_SYSLOG(usbmon_ctx, LOG_INFO,
+                                   "0x%.4x:0x%.4x-0x%.4x path len %u "
+                                   "restart %u\n", bad_dev->vid,
+                                   bad_dev->pid_min, bad_dev->pid_max,
+                                   bad_dev->path_len, bad_dev->restart);
         }
     }
 
@@ -633,6 +1169,7 @@ int main(int argc, char *argv[])
 
     usb_monitor_start_event_loop(usbmon_ctx);
 
+    usb_monitor_release(usbmon_ctx);
     libusb_exit(NULL);
 
     //We shall never stop
@@ -24,17 +24,46 @@
 #include <sys/queue.h>
 #include <libusb-1.0/libusb.h>
 
+#include "backend_event_loop.h"
+#include "usb_monitor_hash.h"
+#include "usb_path_tree.h"
+
 #define DEFAULT_TIMEOUT_SEC 5
 #define ADDED_TIMEOUT_SEC 10
+#define DEFAULT_TIMER_SLACK_MS 500 //How late a port timeout is allowed to fire
+#define DEFAULT_CB_BUDGET_MS 500 //Warn when a callback blocks for longer
 #define USB_RETRANS_LIMIT 5
-#define PING_OUTPUT 20 //Only write ping sucess ~ever 100 sec
+#define DEFAULT_PING_TIMEOUT_MS 5000
+//Automatic restarts of a port are backed off exponentially, starting at
+//DEFAULT_BACKOFF_SEC and capped at DEFAULT_BACKOFF_MAX_SEC. Every
+//BACKOFF_DECAY_SEC the device answers pings without failing, one step is
+//removed again
+#define DEFAULT_BACKOFF_SEC 30
+#define DEFAULT_BACKOFF_MAX_SEC 3600
+#define BACKOFF_DECAY_SEC 600
+#define BACKOFF_MAX_STEPS 32
+#define TIMER_JITTER_PCT 10 //Pings and the sweep are moved by up to +/- 10%
+#define RESET_SWEEP_MS 120000 //How often empty ports are restarted
+#define PING_OUTPUT 20 //Log ping success and adapt interval every 20 pings
 #define USB_PATH_MAX 8 //len(path) + bus number
-#define MAX_NUM_PATHS 2 //How many paths can be controlled by one port
+//How many paths can be controlled by one port, can be set when building
+#ifndef MAX_NUM_PATHS
+#define MAX_NUM_PATHS 2
+#endif
 
 #define NUM_CONNECTIONS 1
 #define MAX_HTTP_CLIENTS 5
 
 #define GPIO_PROBE_PATH_LEN 127 //buffer size is 128 + 4 (.tmp)
+#define USB_SYSFS_MAX_FDS 3 //Max. number of sysfs attributes used by a probe
+//Ping RTT histogram. Bucket 0 is < USB_RTT_MIN_US, bucket i is
+//[USB_RTT_MIN_US << (i - 1), USB_RTT_MIN_US << i) and the last bucket has no
+//upper bound. The last bucket starts at 128us << 14, ~2.1s
+#define USB_RTT_BUCKETS 16
+#define USB_RTT_MIN_SHIFT 7
+#define USB_RTT_MIN_US (1 << USB_RTT_MIN_SHIFT)
+#define USB_RTT_EWMA_SHIFT 3 //Weight of a new sample is 1/8
+//When a counter in the histogram would wrap, all counters are halved
 
 struct usb_port;
 struct backend_epoll_handle;
@@ -43,6 +72,14 @@ struct http_client;
 
 struct lanner_shared;
 
+//A path is the bus number followed by the port numbers, at most USB_PATH_MAX
+//bytes. The unused bytes are zero. Bus and port numbers start at 1, so key is
+//unique for each path and two paths are compared with a single integer compare
+union usb_path {
+    uint8_t bytes[USB_PATH_MAX];
+    uint64_t key;
+};
+
 //port function pointers
 typedef void (*print_port)(struct usb_port *port);
 typedef int32_t (*update_port)(struct usb_port *port, uint8_t cmd);
@@ -52,7 +89,8 @@ enum {
     PORT_TYPE_UNKNOWN = 0,
     PORT_TYPE_GPIO,
     PORT_TYPE_YKUSH,
-    PORT_TYPE_LANNER
+    PORT_TYPE_LANNER,
+    NUM_PORT_TYPES
 };
 
 //The device pointed to here is the device that will be used for comparison when
@@ -62,35 +100,58 @@ enum {
     LIST_ENTRY(usb_hub) hub_next; \
     uint8_t num_ports
 
-//Size of path is 8 since it is bus + max depth (7)
+//Paths are stored in the port, path_len is 0 for unused paths
 //parent might be NULL
-//TODO: Try to optimize struct and remove gaps
+//timeout_handle is the port's timer in the event loop. It is used for sending
+//pings and for the different steps of resetting a port
+//
+//Hot fields, used every time a port timer fires or a ping completes, come
+//first (up to path_len, 128 bytes on 64-bit). Fields only used when a port is
+//configured, reset or printed come last
 #define USB_PORT_MANDATORY \
-    struct usb_hub *parent; \
+    struct backend_timeout_handle timeout_handle; \
     struct usb_monitor_ctx *ctx; \
-    libusb_device *dev; \
     libusb_device_handle *dev_handle;\
-    char *path[MAX_NUM_PATHS]; \
-    print_port output; \
-    update_port update; \
+    libusb_device *dev; \
     handle_timeout timeout; \
-    uint64_t timeout_expire; \
-    struct { \
-        uint16_t vid; \
-        uint16_t pid; \
-    } vp; \
-    uint8_t status; \
-    uint8_t enabled; \
-    uint8_t pwr_state; \
+    LIST_ENTRY(usb_port) port_next; \
     uint8_t msg_mode; \
-    uint8_t path_len[MAX_NUM_PATHS]; \
+    uint8_t enabled; \
+    uint8_t status; \
     uint8_t num_retrans; \
     uint8_t ping_cnt; \
+    uint8_t pwr_state; \
     uint8_t port_num; \
     uint8_t port_type; \
+    struct { \
+        uint16_t vid; \
+        uint16_t pid; \
+    } vp; \
+    uint8_t path_len[MAX_NUM_PATHS]; \
     uint8_t ping_buf[LIBUSB_CONTROL_SETUP_SIZE + 2]; \
-    LIST_ENTRY(usb_port) port_next; \
-    LIST_ENTRY(usb_port) timeout_next
+    struct usb_hub *parent; \
+    update_port update; \
+    print_port output; \
+    struct libusb_transfer *ping_transfer; \
+    TAILQ_ENTRY(usb_port) ping_next; \
+    TAILQ_ENTRY(usb_port) handle_next; \
+    union usb_path path[MAX_NUM_PATHS]; \
+    uint64_t sysfs_urbnum; \
+    uint64_t ping_submit_us; \
+    uint32_t rtt_last_us; \
+    uint32_t rtt_ewma_us; \
+    uint16_t rtt_hist[USB_RTT_BUCKETS]; \
+    uint64_t restart_after_ms; \
+    uint64_t backoff_mark_ms; \
+    uint32_t ping_interval_ms; \
+    uint32_t ping_max_interval_ms; \
+    uint32_t ping_cur_interval_ms; \
+    uint32_t ping_timeout_ms; \
+    int32_t sysfs_fd[USB_SYSFS_MAX_FDS]; \
+    uint8_t ping_state; \
+    uint8_t probe_type; \
+    uint8_t num_restarts; \
+    uint8_t retrans_limit
 
 enum port_msg {
     IDLE = 0,
@@ -99,6 +160,24 @@ enum port_msg {
     PROBE
 };
 
+//Where the ping_transfer of a port is. The transfer is allocated when
+//dev_handle is opened and reused for every ping. ping_next links a queued port
+//into ctx->ping_queue
+enum ping_state {
+    PING_IDLE = 0,
+    PING_QUEUED,
+    PING_IN_FLIGHT
+};
+
+//usbfs_get_status sends a GET_STATUS request to the device, the sysfs probes
+//read the state of the device from sysfs (see usb_sysfs.h) and keep the
+//attribute files open in sysfs_fd
+enum probe_type {
+    PROBE_TYPE_USBFS_GET_STATUS = 0,
+    PROBE_TYPE_SYSFS_URBNUM,
+    PROBE_TYPE_SYSFS_STATE
+};
+
 enum port_status {
     PORT_NO_DEV_CONNECTED = 0,
     PORT_DEV_CONNECTED,
@@ -127,16 +206,103 @@ struct usb_port {
     USB_PORT_MANDATORY;
 };
 
+//Devices with vid (or any vid if vid is 0) and a pid in [pid_min, pid_max] are
+//restarted when they are added. If path_len is set, the entry only applies to
+//ports with a path equal to or under path. The most specific matching entry
+//decides, so an entry with a path and restart = 0 can exempt some ports from a
+//global entry. The table is sorted on path (entries without path first), vid
+//and pid_min, see usb_bad_ids_match()
 struct usb_bad_device {
+    union usb_path path;
     uint16_t vid;
-    uint16_t pid;
+    uint16_t pid_min;
+    uint16_t pid_max;
+    uint8_t path_len;
+    uint8_t restart;
+};
+
+//Ports with a path equal to or under path use probe_type instead of the
+//default probe type. The longest matching path is used, and if several rules
+//have the same path the first one is used
+struct usb_probe_rule {
+    union usb_path path;
+    uint8_t path_len;
+    uint8_t probe_type;
+};
+
+//Ping settings. interval_ms is the time from a ping has completed until the
+//next ping is sent, timeout_ms the timeout of the ping transfer and added_ms
+//the time from a device is added until the first ping. The port is restarted
+//after retrans_limit + 1 failed pings in a row.
+//
+//If max_interval_ms is larger than interval_ms, the ping interval is adaptive.
+//The interval is doubled every PING_OUTPUT pings that succeed in a row, up to
+//max_interval_ms, and goes back to interval_ms when a ping fails or a device is
+//added. The current interval of a port is ping_cur_interval_ms.
+//
+//The settings of a port are layered: ctx->ping_config is overridden by the
+//config of the port's handler and then by every ping rule that matches the
+//port, shortest path first. Only the settings in fields (PING_CFG_*) are used
+//from a layer. Rules with the same path are merged into one when the config is
+//parsed, later rules override earlier ones
+struct usb_ping_config {
+    uint32_t interval_ms;
+    uint32_t timeout_ms;
+    uint32_t added_ms;
+    uint32_t max_interval_ms;
+    uint8_t retrans_limit;
+    uint8_t fields;
+};
+
+enum {
+    PING_CFG_INTERVAL = 1 << 0,
+    PING_CFG_TIMEOUT = 1 << 1,
+    PING_CFG_ADDED = 1 << 2,
+    PING_CFG_RETRANS = 1 << 3,
+    PING_CFG_MAX_INTERVAL = 1 << 4
+};
+
+//Ping settings for the ports equal to or under path
+struct usb_ping_rule {
+    union usb_path path;
+    struct usb_ping_config config;
+    uint8_t path_len;
+};
+
+//A ping round is every ping submitted from the time the first ping is
+//submitted until no pings are in flight. Times are in us
+struct usb_monitor_ping_stats {
+    uint64_t rounds;
+    uint64_t pinged;
+    uint64_t failures;
+    uint64_t round_us;
+    uint64_t max_round_us;
+    uint64_t last_round_us;
+    uint32_t last_round_pinged;
+    uint32_t last_round_failures;
+};
+
+//Device handles opened for pinging, and what opening them has cost (us)
+struct usb_monitor_handle_stats {
+    uint64_t opens;
+    uint64_t open_failures;
+    uint64_t evictions;
+    uint64_t open_us;
+    uint64_t max_open_us;
 };
 
 struct usb_monitor_ctx {
     struct backend_event_loop *event_loop;
     struct backend_epoll_handle *libusb_handle;
+    struct backend_epoll_handle *libusb_timer_handle;
     struct backend_epoll_handle *accept_handle;
+    //Periodic timeout of the restart sweep, the interval is jittered every time
+    struct backend_timeout_handle *check_reset_handle;
     struct usb_bad_device *bad_device_ids;
+    struct usb_probe_rule *probe_rules;
+    struct usb_ping_rule *ping_rules;
+    //Root of the sysfs device tree, NULL is DEFAULT_SYSFS_ROOT
+    char *sysfs_root;
     struct http_client *clients[MAX_HTTP_CLIENTS];
     struct lanner_shared *mcu_info;
     struct timeval last_restart;
@@ -144,18 +310,58 @@ struct usb_monitor_ctx {
     FILE* logfile;
     LIST_HEAD(hubs, usb_hub) hub_list;
     LIST_HEAD(ports, usb_port) port_list;
-    struct ports timeout_list;
+    //All paths of all ports in port_list, see usb_monitor_lists_path_key()
+    struct usb_monitor_hash port_path_hash;
+    //Same paths, ordered by topology. Used for finding all ports under a hub
+    struct usb_path_tree port_path_tree;
+    //Probe rules, ping rules and the first bad device entry of every path,
+    //indexed on path. Rules that match a port are found by walking the port's
+    //paths
+    struct usb_path_tree probe_rule_tree;
+    struct usb_path_tree ping_rule_tree;
+    struct usb_path_tree bad_id_tree;
+    //All hubs in hub_list, keyed on hub_dev
+    struct usb_monitor_hash hub_hash;
+    //Ports that are due a ping are queued here and submitted together by
+    //ping_task, at the end of the event loop iteration
+    TAILQ_HEAD(ping_queue, usb_port) ping_queue;
+    struct usb_ping_config ping_config;
+    struct usb_ping_config handler_ping_config[NUM_PORT_TYPES];
+    struct backend_itr_task ping_task;
+    struct usb_monitor_ping_stats ping_stats;
+    uint64_t ping_round_start;
+    uint32_t pings_in_flight;
+    uint32_t ping_round_pinged;
+    uint32_t ping_round_failures;
+    //Ports with an open device handle, least recently pinged first. When
+    //max_open_handles (0 is no limit) is reached, the handle of the least
+    //recently pinged idle port is closed before a new one is opened
+    TAILQ_HEAD(handle_lru, usb_port) handle_lru;
+    struct usb_monitor_handle_stats handle_stats;
+    uint32_t num_open_handles;
+    uint32_t max_open_handles;
     gid_t group_id;
+    int32_t libusb_timer_fd;
     uint32_t num_bad_device_ids;
+    //Entries without path, these are first in bad_device_ids
+    uint32_t num_global_bad_ids;
+    uint32_t num_probe_rules;
+    uint32_t num_ping_rules;
+    uint32_t timer_slack_ms;
+    uint32_t cb_budget_ms;
+    //Base and max. delay of the restart backoff, 0 disables backoff
+    uint32_t backoff_ms;
+    uint32_t backoff_max_ms;
     uint8_t clients_map;
     uint8_t use_syslog;
+    uint8_t use_timer_wheel;
+    uint8_t libusb_timer_armed;
     uint8_t disable_auto_restart;
+    uint8_t probe_type;
 };
 
 //Output all of the ports, move to helpers?
 void usb_monitor_print_ports(struct usb_monitor_ctx *ctx);
 
-void usb_monitor_start_itr_cb(struct usb_monitor_ctx *ctx);
-void usb_monitor_stop_itr_cb(struct usb_monitor_ctx *ctx);
 
 #endif
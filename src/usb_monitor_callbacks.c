@@ -16,7 +16,9 @@
  */
 
 #include <stdint.h>
+#include <string.h>
 #include <sys/epoll.h>
+#include <sys/timerfd.h>
 #include <unistd.h>
 #include <time.h>
 
@@ -29,7 +31,6 @@
 #include "backend_event_loop.h"
 
 #include "gpio_handler.h"
-#include "lanner_handler.h"
 
 /* libusb-callbacks for when devices are added/removed. It is also called
  * manually when we detect a hub, since we risk devices being added before we
@@ -39,6 +40,7 @@ static void usb_device_added(struct usb_monitor_ctx *ctx, libusb_device *dev)
     //Check if device is connected to a port we control
     struct usb_port *port;
     struct libusb_device_descriptor desc;
+    struct usb_ping_config ping_config;
     uint8_t path[USB_PATH_MAX];
     uint8_t path_len;
 
@@ -84,8 +86,25 @@ static void usb_device_added(struct usb_monitor_ctx *ctx, libusb_device *dev)
     port->vp.pid = desc.idProduct;
     port->status = PORT_DEV_CONNECTED;
     port->dev = dev;
+    port->probe_type = usb_helpers_get_probe_type(ctx, port);
     libusb_ref_device(dev);
 
+    usb_helpers_get_ping_config(ctx, port, &ping_config);
+    port->ping_interval_ms = ping_config.interval_ms;
+    port->ping_max_interval_ms = ping_config.max_interval_ms;
+    port->ping_cur_interval_ms = ping_config.interval_ms;
+    port->ping_cnt = 0;
+    port->ping_timeout_ms = ping_config.timeout_ms;
+    port->retrans_limit = ping_config.retrans_limit;
+
+    //Pings of ports with a short interval can not be delayed by the full timer
+    //slack
+    if (ctx->timer_slack_ms > port->ping_interval_ms / 4)
+        backend_timeout_set_slack(&(port->timeout_handle),
+                                  port->ping_interval_ms / 4);
+    else
+        backend_timeout_set_slack(&(port->timeout_handle), ctx->timer_slack_ms);
+
     usb_monitor_print_ports(ctx);
 
     //Whenever we detect a device, we need to add to timeout to send ping.
@@ -96,7 +115,7 @@ static void usb_device_added(struct usb_monitor_ctx *ctx, libusb_device *dev)
         gpio_handler_handle_probe_connect(port);
     } else {
         port->msg_mode = PING;
-        usb_helpers_start_timeout(port, ADDED_TIMEOUT_SEC);
+        usb_helpers_start_ping_timeout(port, ping_config.added_ms, 1);
 
 	    if (usb_helpers_check_bad_id(ctx, port)) {
 		    port->update(port, CMD_RESTART);
@@ -147,43 +166,67 @@ int usb_monitor_cb(libusb_context *ctx, libusb_device *device,
     return 0;
 }
 
-static void usb_monitor_check_timeouts(struct usb_monitor_ctx *ctx)
+void usb_monitor_update_libusb_timeout(struct usb_monitor_ctx *ctx)
 {
-    struct usb_port *timeout_itr = NULL, *old_timeout = NULL;
-    struct timespec tp;
-    uint64_t cur_time;
-
-    clock_gettime(CLOCK_MONOTONIC_RAW, &tp);
-    cur_time = (tp.tv_sec * 1e6) + (tp.tv_nsec/1e3);
-
-    timeout_itr = ctx->timeout_list.lh_first;
-
-    while (timeout_itr != NULL) {
-        if (cur_time >= timeout_itr->timeout_expire) {
-            //Detatch from list, then run timeout
-            old_timeout = timeout_itr;
-            timeout_itr = timeout_itr->timeout_next.le_next;
-
-            usb_monitor_lists_del_timeout(old_timeout);
-
-            //Due to async requests, the enabled guard is needed to prevent us
-            //accidentaly sending PING on disabled port for example. However,
-            //in the case of probe, we need to call timeout callback
-            if (old_timeout->enabled || old_timeout->msg_mode == PROBE)
-                old_timeout->timeout(old_timeout);
-        } else {
-            timeout_itr = timeout_itr->timeout_next.le_next;
-        }
+    struct itimerspec its;
+    struct timeval tv;
+
+    //libusb handles its own timeouts, or we failed to create timerfd
+    if (ctx->libusb_timer_fd < 0)
+        return;
+
+    memset(&its, 0, sizeof(its));
+
+    //0 means no pending timeouts, then we disarm the timer (all zeros). Errors
+    //are treated the same way, we will get a new chance after the next event
+    if (libusb_get_next_timeout(NULL, &tv) == 1) {
+        its.it_value.tv_sec = tv.tv_sec;
+        its.it_value.tv_nsec = tv.tv_usec * 1000;
+
+        //A timeout that has already expired is reported as zero, which would
+        //disarm the timer. Make sure we wake up right away instead
+        if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+            its.it_value.tv_nsec = 1;
+    } else if (!ctx->libusb_timer_armed) {
+        return;
     }
+
+    ctx->libusb_timer_armed = its.it_value.tv_sec || its.it_value.tv_nsec;
+    timerfd_settime(ctx->libusb_timer_fd, 0, &its, NULL);
 }
 
-//For events on USB socket
-void usb_monitor_usb_event_cb(void *ptr, int32_t fd, uint32_t events)
+static void usb_monitor_handle_libusb_events(struct usb_monitor_ctx *ctx)
 {
     struct timeval tv = {0 ,0};
+
     libusb_unlock_events(NULL);
     libusb_handle_events_timeout_completed(NULL, &tv, NULL);
     libusb_lock_events(NULL);
+
+    //Handling events might have completed or submitted transfers, which
+    //changes when the next libusb timeout expires
+    usb_monitor_update_libusb_timeout(ctx);
+}
+
+//For events on USB socket
+void usb_monitor_usb_event_cb(void *ptr, int32_t fd, uint32_t events)
+{
+    usb_monitor_handle_libusb_events(ptr);
+}
+
+//One of libusb's timeouts (for example for a ping transfer) has expired
+void usb_monitor_libusb_timeout_cb(void *ptr, int32_t fd, uint32_t events)
+{
+    struct usb_monitor_ctx *ctx = ptr;
+    uint64_t num_expirations;
+
+    //Read to reset the timerfd, value itself is not interesting
+    if (read(fd, &num_expirations, sizeof(num_expirations)) < 0) {
+        USB_DEBUG_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to read libusb timerfd\n");
+    }
+
+    ctx->libusb_timer_armed = 0;
+    usb_monitor_handle_libusb_events(ctx);
 }
 
 void usb_monitor_check_devices_cb(void *ptr)
@@ -195,24 +238,27 @@ void usb_monitor_check_devices_cb(void *ptr)
 void usb_monitor_check_reset_cb(void *ptr)
 {
     struct usb_monitor_ctx *ctx = ptr;
+
+    //The timeout is rearmed with intvl after the callback has run. Jitter it,
+    //so that the sweep does not stay in phase with other periodic work
+    ctx->check_reset_handle->intvl = usb_helpers_add_jitter(RESET_SWEEP_MS);
     usb_helpers_reset_all_ports(ctx, 0);
 }
 
-//This function is called every second.
-void usb_monitor_1sec_timeout_cb(void *ptr)
+void usb_monitor_slow_cb(void *ptr, const char *name, void *cb,
+                         uint64_t duration_ns)
 {
     struct usb_monitor_ctx *ctx = ptr;
-    struct timeval tv = {0 ,0};
-
-    //First, check for any of libusb's timers. We are incontrol of timer, so no
-    //need for this function to block
-    libusb_unlock_events(NULL);
-    libusb_handle_events_timeout_completed(NULL, &tv, NULL);
-    libusb_lock_events(NULL);
 
-    //Check if we have any pending timeouts
-    //TODO: Consider using the event loop timer queue for this
-    usb_monitor_check_timeouts(ctx);
+    //Everything else has been stalled while the callback ran
+    if (name)
+        USB_DEBUG_PRINT_SYSLOG(ctx, LOG_WARNING, "Callback %s blocked event "
+                               "loop for %llu ms\n", name,
+                               (unsigned long long) (duration_ns / 1000000));
+    else
+        USB_DEBUG_PRINT_SYSLOG(ctx, LOG_WARNING, "Callback %p blocked event "
+                               "loop for %llu ms\n", cb,
+                               (unsigned long long) (duration_ns / 1000000));
 }
 
 void usb_monitor_libusb_fd_add(int fd, short events, void *data)
@@ -228,14 +274,11 @@ void usb_monitor_libusb_fd_add(int fd, short events, void *data)
 
 void usb_monitor_libusb_fd_remove(int fd, void *data)
 {
-    //Closing a file descriptor causes it to be removed from epoll-set
-    close(fd);
-}
-
-void usb_monitor_itr_cb(void *ptr)
-{
-    struct usb_monitor_ctx *ctx = ptr;
+    struct usb_monitor_ctx *ctx = data;
 
-    lanner_handler_itr_cb(ctx);
-    usb_monitor_stop_itr_cb(ctx);
+    //The fd is owned by libusb, which closes it after this callback. Closing it
+    //here as well would close whatever fd got the same number in between (for
+    //example a new client socket). libusb does not promise when it closes the
+    //fd, so remove it from the event loop ourselves
+    backend_event_loop_update(ctx->event_loop, 0, EPOLL_CTL_DEL, fd, NULL);
 }
@@ -24,20 +24,29 @@
 int usb_monitor_cb(libusb_context *ctx, libusb_device *device,
                           libusb_hotplug_event event, void *user_data);
 
+struct usb_monitor_ctx;
+
 //Event callback from our event loop
 void usb_monitor_usb_event_cb(void *ptr, int32_t fd, uint32_t events);
 
-//These are the three timeout callbacks
+//Event loop callback for the timerfd used to handle libusb timeouts
+void usb_monitor_libusb_timeout_cb(void *ptr, int32_t fd, uint32_t events);
+
+//Arm (or disarm) the libusb timerfd according to libusb_get_next_timeout().
+//Must be called after a transfer is submitted
+void usb_monitor_update_libusb_timeout(struct usb_monitor_ctx *ctx);
+
+//These are the two global timeout callbacks. Port timeouts are handled by
+//the timeout_handle of each port
 void usb_monitor_check_devices_cb(void *ptr);
 void usb_monitor_check_reset_cb(void *ptr);
-void usb_monitor_1sec_timeout_cb(void *ptr);
+
+//Called by the event loop when a callback has run for longer than the budget
+void usb_monitor_slow_cb(void *ptr, const char *name, void *cb,
+                         uint64_t duration_ns);
 
 //Libusb file descriptor callbacks
 void usb_monitor_libusb_fd_add(int fd, short events, void *data);
 void usb_monitor_libusb_fd_remove(int fd, void *data);
 
-//This is a callback is used to check + start updating the power of different
-//modems on Lanner devices
-void usb_monitor_itr_cb(void *ptr);
-
 #endif
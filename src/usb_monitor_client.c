@@ -50,6 +50,8 @@ static uint8_t usb_monitor_client_add_paths_json(struct json_object *path_array,
     char path_buf[MAX_USB_PATH];
     uint8_t path_buf_len = 0;
     struct json_object *port_info = json_object_new_object(), *obj_add = NULL;
+    struct json_object *obj_rtt;
+    uint8_t i;
 
     if (port_info == NULL)
         return 1;
@@ -91,11 +93,98 @@ static uint8_t usb_monitor_client_add_paths_json(struct json_object *path_array,
     else
         json_object_object_add(port_info, "enabled", obj_add);
 
+    //restart backoff
+    obj_add = json_object_new_int(port->num_restarts);
+
+    if (obj_add == NULL)
+        return 1;
+    else
+        json_object_object_add(port_info, "restarts", obj_add);
+
+    obj_add = json_object_new_int64(usb_helpers_get_restart_backoff(port));
+
+    if (obj_add == NULL)
+        return 1;
+    else
+        json_object_object_add(port_info, "restart_backoff_ms", obj_add);
+
+    obj_add = json_object_new_int64(port->ping_cur_interval_ms);
+
+    if (obj_add == NULL)
+        return 1;
+    else
+        json_object_object_add(port_info, "ping_interval_ms", obj_add);
+
+    //ping round-trip time (us) of the connected device
+    obj_add = json_object_new_int64(port->rtt_last_us);
+
+    if (obj_add == NULL)
+        return 1;
+    else
+        json_object_object_add(port_info, "rtt_us", obj_add);
+
+    obj_add = json_object_new_int64(port->rtt_ewma_us);
+
+    if (obj_add == NULL)
+        return 1;
+    else
+        json_object_object_add(port_info, "rtt_ewma_us", obj_add);
+
+    obj_add = json_object_new_array();
+
+    if (obj_add == NULL)
+        return 1;
+    else
+        json_object_object_add(port_info, "rtt_hist", obj_add);
+
+    for (i = 0; i < USB_RTT_BUCKETS; i++) {
+        obj_rtt = json_object_new_int(port->rtt_hist[i]);
+
+        if (obj_rtt == NULL)
+            return 1;
+
+        json_object_array_add(obj_add, obj_rtt);
+    }
+
     return 0;
 }
 
-static json_object *usb_monitor_client_get_json(struct usb_monitor_ctx *ctx)
+struct usb_monitor_client_json_itr {
+    struct json_object *ports_array;
+    uint8_t failed;
+};
+
+static void usb_monitor_client_add_path_cb(const uint8_t *path,
+                                           uint8_t path_len, void *value,
+                                           void *data)
+{
+    struct usb_monitor_client_json_itr *itr = data;
+    struct usb_port *port = value;
+    uint64_t key = usb_monitor_lists_path_key(path, path_len);
+    uint8_t i;
+
+    if (itr->failed)
+        return;
+
+    for (i = 0; i < MAX_NUM_PATHS; i++) {
+        if (!port->path_len[i])
+            break;
+
+        if (port->path[i].key != key)
+            continue;
+
+        itr->failed = usb_monitor_client_add_paths_json(itr->ports_array, port,
+                                                        i);
+        return;
+    }
+}
+
+//prefix is optional. If set, only the ports with a path under prefix are added
+static json_object *usb_monitor_client_get_json(struct usb_monitor_ctx *ctx,
+                                                uint8_t *prefix,
+                                                uint8_t prefix_len)
 {
+    struct usb_monitor_client_json_itr json_itr;
     struct usb_port *itr;
     uint8_t i = 0;
     struct json_object *json_ports = json_object_new_object();
@@ -115,9 +204,24 @@ static json_object *usb_monitor_client_get_json(struct usb_monitor_ctx *ctx)
     //of put-calls in case of error
     json_object_object_add(json_ports, "ports", ports_array);
 
+    if (prefix) {
+        json_itr.ports_array = ports_array;
+        json_itr.failed = 0;
+        usb_monitor_lists_foreach_port_path(ctx, prefix, prefix_len,
+                                            usb_monitor_client_add_path_cb,
+                                            &json_itr);
+
+        if (json_itr.failed) {
+            json_object_put(json_ports);
+            return NULL;
+        }
+
+        return json_ports;
+    }
+
     LIST_FOREACH(itr, &(ctx->port_list), port_next) {
         for (i = 0; i < MAX_NUM_PATHS; i++) {
-            if (!itr->path[i])
+            if (!itr->path_len[i])
                 break;
 
             if (usb_monitor_client_add_paths_json(ports_array, itr, i)) {
@@ -130,13 +234,262 @@ static json_object *usb_monitor_client_get_json(struct usb_monitor_ctx *ctx)
     return json_ports;
 }
 
+//Compare the path part of the request URL (everything before '?') to path
+static uint8_t usb_monitor_client_url_is(struct http_client *client,
+                                         const char *path)
+{
+    size_t path_len = strlen(path), url_len = 0;
+
+    if (!client->url)
+        return 0;
+
+    while (url_len < client->url_len && client->url[url_len] != '?')
+        url_len++;
+
+    return url_len == path_len && !memcmp(client->url, path, path_len);
+}
+
+//Copy the value of query parameter key to value (NULL-terminated). Returns 0 if
+//key is found and value fits, 1 otherwise
+static uint8_t usb_monitor_client_get_param(struct http_client *client,
+                                            const char *key, char *value,
+                                            size_t value_size)
+{
+    size_t key_len = strlen(key), pos = 0, end;
+
+    if (!client->url)
+        return 1;
+
+    while (pos < client->url_len && client->url[pos] != '?')
+        pos++;
+
+    while (pos < client->url_len) {
+        //Skip the '?' or '&' in front of the parameter
+        pos++;
+
+        for (end = pos; end < client->url_len && client->url[end] != '&';
+             end++);
+
+        if (end - pos > key_len && client->url[pos + key_len] == '=' &&
+            !memcmp(client->url + pos, key, key_len)) {
+            pos += key_len + 1;
+
+            if (end - pos >= value_size)
+                return 1;
+
+            memcpy(value, client->url + pos, end - pos);
+            value[end - pos] = '\0';
+            return 0;
+        }
+
+        pos = end;
+    }
+
+    return 1;
+}
+
+static uint8_t usb_monitor_client_add_int64(struct json_object *obj,
+                                            const char *key, int64_t value)
+{
+    struct json_object *obj_add = json_object_new_int64(value);
+
+    if (obj_add == NULL)
+        return 1;
+
+    json_object_object_add(obj, key, obj_add);
+    return 0;
+}
+
+static uint8_t usb_monitor_client_add_cb_json(struct json_object *cb_array,
+                                              struct backend_cb_prof *prof)
+{
+    static const char *cb_types[] = {"fd", "timeout", "task"};
+    char addr_buf[2 + (sizeof(void*) * 2) + 1];
+    struct json_object *cb_info = json_object_new_object(), *obj_add = NULL;
+
+    if (cb_info == NULL)
+        return 1;
+
+    json_object_array_add(cb_array, cb_info);
+
+    if (prof->name) {
+        obj_add = json_object_new_string(prof->name);
+    } else {
+        snprintf(addr_buf, sizeof(addr_buf), "%p", prof->cb);
+        obj_add = json_object_new_string(addr_buf);
+    }
+
+    if (obj_add == NULL)
+        return 1;
+    else
+        json_object_object_add(cb_info, "name", obj_add);
+
+    obj_add = json_object_new_string(cb_types[prof->type]);
+    if (obj_add == NULL)
+        return 1;
+    else
+        json_object_object_add(cb_info, "type", obj_add);
+
+    if (usb_monitor_client_add_int64(cb_info, "count", prof->count) ||
+        usb_monitor_client_add_int64(cb_info, "total_us",
+                                     prof->total_ns / 1000) ||
+        usb_monitor_client_add_int64(cb_info, "max_us", prof->max_ns / 1000) ||
+        usb_monitor_client_add_int64(cb_info, "p50_us",
+                                     backend_cb_prof_percentile(prof, 50)) ||
+        usb_monitor_client_add_int64(cb_info, "p99_us",
+                                     backend_cb_prof_percentile(prof, 99)) ||
+        usb_monitor_client_add_int64(cb_info, "over_budget",
+                                     prof->over_budget))
+        return 1;
+
+    return 0;
+}
+
+static json_object *usb_monitor_client_get_stats_json(
+        struct usb_monitor_ctx *ctx)
+{
+    struct backend_event_loop_stats stats;
+    struct backend_cb_prof_table *prof = ctx->event_loop->prof;
+    struct usb_monitor_ping_stats *ping = &(ctx->ping_stats);
+    struct usb_monitor_handle_stats *handles = &(ctx->handle_stats);
+    struct json_object *json_stats = json_object_new_object();
+    struct json_object *loop_obj, *ping_obj, *handle_obj, *cb_array;
+    uint32_t i;
+
+    if (json_stats == NULL)
+        return NULL;
+
+    loop_obj = json_object_new_object();
+
+    if (loop_obj == NULL) {
+        json_object_put(json_stats);
+        return NULL;
+    }
+
+    json_object_object_add(json_stats, "loop", loop_obj);
+    backend_event_loop_get_stats(ctx->event_loop, &stats);
+
+    if (usb_monitor_client_add_int64(loop_obj, "iterations", stats.iterations) ||
+        usb_monitor_client_add_int64(loop_obj, "events", stats.events) ||
+        usb_monitor_client_add_int64(loop_obj, "max_events", stats.max_events) ||
+        usb_monitor_client_add_int64(loop_obj, "full_waits", stats.full_waits) ||
+        usb_monitor_client_add_int64(loop_obj, "events_size",
+                                     stats.events_size) ||
+        usb_monitor_client_add_int64(loop_obj, "wait_us",
+                                     stats.wait_ns / 1000) ||
+        usb_monitor_client_add_int64(loop_obj, "dispatch_us",
+                                     stats.dispatch_ns / 1000) ||
+        usb_monitor_client_add_int64(loop_obj, "timer_wakeups",
+                                     stats.timer_wakeups) ||
+        usb_monitor_client_add_int64(loop_obj, "timers_run", stats.timers_run) ||
+        usb_monitor_client_add_int64(loop_obj, "wakeups_saved",
+                                     stats.wakeups_saved)) {
+        json_object_put(json_stats);
+        return NULL;
+    }
+
+    ping_obj = json_object_new_object();
+
+    if (ping_obj == NULL) {
+        json_object_put(json_stats);
+        return NULL;
+    }
+
+    json_object_object_add(json_stats, "ping", ping_obj);
+
+    if (usb_monitor_client_add_int64(ping_obj, "rounds", ping->rounds) ||
+        usb_monitor_client_add_int64(ping_obj, "pinged", ping->pinged) ||
+        usb_monitor_client_add_int64(ping_obj, "failures", ping->failures) ||
+        usb_monitor_client_add_int64(ping_obj, "round_us", ping->round_us) ||
+        usb_monitor_client_add_int64(ping_obj, "max_round_us",
+                                     ping->max_round_us) ||
+        usb_monitor_client_add_int64(ping_obj, "last_round_us",
+                                     ping->last_round_us) ||
+        usb_monitor_client_add_int64(ping_obj, "last_round_pinged",
+                                     ping->last_round_pinged) ||
+        usb_monitor_client_add_int64(ping_obj, "last_round_failures",
+                                     ping->last_round_failures)) {
+        json_object_put(json_stats);
+        return NULL;
+    }
+
+    handle_obj = json_object_new_object();
+
+    if (handle_obj == NULL) {
+        json_object_put(json_stats);
+        return NULL;
+    }
+
+    json_object_object_add(json_stats, "handles", handle_obj);
+
+    if (usb_monitor_client_add_int64(handle_obj, "open",
+                                     ctx->num_open_handles) ||
+        usb_monitor_client_add_int64(handle_obj, "max",
+                                     ctx->max_open_handles) ||
+        usb_monitor_client_add_int64(handle_obj, "opens", handles->opens) ||
+        usb_monitor_client_add_int64(handle_obj, "open_failures",
+                                     handles->open_failures) ||
+        usb_monitor_client_add_int64(handle_obj, "evictions",
+                                     handles->evictions) ||
+        usb_monitor_client_add_int64(handle_obj, "open_us", handles->open_us) ||
+        usb_monitor_client_add_int64(handle_obj, "max_open_us",
+                                     handles->max_open_us)) {
+        json_object_put(json_stats);
+        return NULL;
+    }
+
+    cb_array = json_object_new_array();
+
+    if (cb_array == NULL) {
+        json_object_put(json_stats);
+        return NULL;
+    }
+
+    json_object_object_add(json_stats, "callbacks", cb_array);
+
+    if (!prof)
+        return json_stats;
+
+    for (i = 0; i < BACKEND_PROF_MAX_CB; i++) {
+        //Skip callbacks that have a name, but have not been run yet
+        if (!prof->entries[i].count)
+            continue;
+
+        if (usb_monitor_client_add_cb_json(cb_array, &(prof->entries[i]))) {
+            json_object_put(json_stats);
+            return NULL;
+        }
+    }
+
+    return json_stats;
+}
+
 static void usb_monitor_client_handle_get(struct http_client *client)
 {
     char hdr_buf[HTTP_REPLY_HEADER_MAX_LEN];
     int32_t actual_hdr_len = 0;
 
     const char *json_str = NULL;
-    struct json_object *json_ports = usb_monitor_client_get_json(client->ctx);
+    struct json_object *json_ports;
+    char path_buf[MAX_USB_PATH];
+    uint8_t dev_path[USB_PATH_MAX];
+    uint8_t path_len = 0;
+
+    if (usb_monitor_client_url_is(client, "/stats")) {
+        json_ports = usb_monitor_client_get_stats_json(client->ctx);
+    } else if (!usb_monitor_client_get_param(client, "path", path_buf,
+                                             sizeof(path_buf))) {
+        if (usb_helpers_convert_char_to_path(path_buf, dev_path, &path_len)) {
+            //Bad request
+            usb_monitor_client_send_code(client, 400);
+            return;
+        }
+
+        json_ports = usb_monitor_client_get_json(client->ctx, dev_path,
+                                                 path_len);
+    } else {
+        json_ports = usb_monitor_client_get_json(client->ctx, NULL, 0);
+    }
 
     if (json_ports == NULL) {
         //Internal server error
@@ -286,7 +639,7 @@ static void usb_monitor_client_handle_post(struct http_client *client)
         socket_utility_send(client->fd, (void*) hdr_buf, actual_hdr_len);
 
         //Also try to include port info in post reply
-        ports = usb_monitor_client_get_json(client->ctx);
+        ports = usb_monitor_client_get_json(client->ctx, NULL, 0);
         if (ports != NULL) {
             json_str = json_object_to_json_string_ext(ports,
                                                       JSON_C_TO_STRING_PLAIN);
@@ -296,6 +649,20 @@ static void usb_monitor_client_handle_post(struct http_client *client)
     }
 }
 
+int usb_monitor_client_on_url(struct http_parser *parser, const char *at,
+                              size_t length)
+{
+    struct http_client *client = parser->data;
+
+    //The URL can be delivered in several parts, they are contiguous in
+    //recv_buf
+    if (client->url == NULL)
+        client->url = at;
+
+    client->url_len += length;
+    return 0;
+}
+
 int usb_monitor_client_on_body(struct http_parser *parser, const char *at,
                                size_t length)
 {
@@ -30,17 +30,21 @@
 struct http_client {
     char recv_buf[MAX_REQUEST_SIZE];
     const char *body_offset;
+    const char *url;
     struct http_parser parser;
     struct http_parser_settings parser_settings;
     struct backend_epoll_handle handle;
     struct usb_monitor_ctx *ctx;
     int32_t fd;
     uint16_t recv_progress;
+    uint16_t url_len;
     uint8_t req_done;
     uint8_t idx;
 };
 
 //HTTP parse callbacks for the events we are interested in
+int usb_monitor_client_on_url(struct http_parser *parser, const char *at,
+                              size_t length);
 int usb_monitor_client_on_body(struct http_parser *parser, const char *at,
                                size_t length);
 int usb_monitor_client_on_complete(struct http_parser *parser);
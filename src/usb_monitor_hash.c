@@ -0,0 +1,166 @@
+/*
+ * Copyright 2015 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Usb Monitor. Usb Monitor is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * Usb Montior is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Usb Monitor. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "usb_monitor_hash.h"
+
+//Fibonacci hashing, the multiplication spreads the bits of the key so that the
+//top bits can be used as index. Keys that only differ in one byte (ports on
+//the same hub) then end up far apart
+static inline uint32_t usb_monitor_hash_idx(struct usb_monitor_hash *hash,
+                                            uint64_t key)
+{
+    return (key * USB_MONITOR_HASH_MULT) >> (64 - hash->bits);
+}
+
+uint32_t usb_monitor_hash_scale(uint64_t key, uint32_t range)
+{
+    uint64_t hash = (key * USB_MONITOR_HASH_MULT) >> 32;
+
+    return (hash * range) >> 32;
+}
+
+static uint8_t usb_monitor_hash_alloc(struct usb_monitor_hash *hash,
+                                      uint32_t size)
+{
+    hash->entries = calloc(sizeof(struct usb_monitor_hash_entry), size);
+
+    if (hash->entries == NULL)
+        return 1;
+
+    hash->size = size;
+    hash->num_entries = 0;
+    hash->bits = __builtin_ctz(size);
+
+    return 0;
+}
+
+uint8_t usb_monitor_hash_init(struct usb_monitor_hash *hash)
+{
+    return usb_monitor_hash_alloc(hash, USB_MONITOR_HASH_SIZE);
+}
+
+void usb_monitor_hash_destroy(struct usb_monitor_hash *hash)
+{
+    free(hash->entries);
+    hash->entries = NULL;
+    hash->size = hash->num_entries = 0;
+}
+
+static uint8_t usb_monitor_hash_grow(struct usb_monitor_hash *hash)
+{
+    struct usb_monitor_hash old = *hash;
+    uint32_t i;
+
+    if (usb_monitor_hash_alloc(hash, old.size * 2)) {
+        *hash = old;
+        return 1;
+    }
+
+    for (i = 0; i < old.size; i++) {
+        if (old.entries[i].value)
+            usb_monitor_hash_insert(hash, old.entries[i].key,
+                                    old.entries[i].value);
+    }
+
+    free(old.entries);
+    return 0;
+}
+
+uint8_t usb_monitor_hash_insert(struct usb_monitor_hash *hash, uint64_t key,
+                                void *value)
+{
+    uint32_t idx;
+
+    if ((hash->num_entries + 1) * 4 > hash->size * 3 &&
+        usb_monitor_hash_grow(hash))
+        return 1;
+
+    idx = usb_monitor_hash_idx(hash, key);
+
+    while (hash->entries[idx].value && hash->entries[idx].key != key)
+        idx = (idx + 1) & (hash->size - 1);
+
+    if (!hash->entries[idx].value)
+        hash->num_entries++;
+
+    hash->entries[idx].key = key;
+    hash->entries[idx].value = value;
+
+    return 0;
+}
+
+void* usb_monitor_hash_find(struct usb_monitor_hash *hash, uint64_t key)
+{
+    uint32_t idx;
+
+    if (!hash->size)
+        return NULL;
+
+    idx = usb_monitor_hash_idx(hash, key);
+
+    while (hash->entries[idx].value) {
+        if (hash->entries[idx].key == key)
+            return hash->entries[idx].value;
+
+        idx = (idx + 1) & (hash->size - 1);
+    }
+
+    return NULL;
+}
+
+void* usb_monitor_hash_remove(struct usb_monitor_hash *hash, uint64_t key)
+{
+    uint32_t idx, next, home, mask = hash->size - 1;
+    void *value;
+
+    if (!hash->size)
+        return NULL;
+
+    idx = usb_monitor_hash_idx(hash, key);
+
+    while (hash->entries[idx].value && hash->entries[idx].key != key)
+        idx = (idx + 1) & mask;
+
+    if (!(value = hash->entries[idx].value))
+        return NULL;
+
+    //Backward shift deletion. Move every following entry of the cluster that
+    //would no longer be reachable into the hole
+    next = idx;
+
+    while (1) {
+        next = (next + 1) & mask;
+
+        if (!hash->entries[next].value)
+            break;
+
+        home = usb_monitor_hash_idx(hash, hash->entries[next].key);
+
+        //Entry can only be moved if its home is not in (idx, next]
+        if (((next - home) & mask) >= ((next - idx) & mask)) {
+            hash->entries[idx] = hash->entries[next];
+            idx = next;
+        }
+    }
+
+    hash->entries[idx].value = NULL;
+    hash->num_entries--;
+
+    return value;
+}
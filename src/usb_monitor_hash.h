@@ -0,0 +1,63 @@
+/*
+ * Copyright 2015 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Usb Monitor. Usb Monitor is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * Usb Montior is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Usb Monitor. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef USB_MONITOR_HASH_H
+#define USB_MONITOR_HASH_H
+
+#include <stdint.h>
+
+//Initial number of buckets, must be a power of two. The table doubles when
+//it is more than 3/4 full
+#define USB_MONITOR_HASH_SIZE 64
+//Multiplier of the hash, 2^64 divided by the golden ratio
+#define USB_MONITOR_HASH_MULT 0x9E3779B97F4A7C15ULL
+
+//value == NULL means that the bucket is empty
+struct usb_monitor_hash_entry {
+    uint64_t key;
+    void *value;
+};
+
+//Open addressing hash table with linear probing, mapping a 64 bit key to a
+//pointer. Deletes shift the following entries back, so there are no
+//tombstones and lookups never get slower over time
+struct usb_monitor_hash {
+    struct usb_monitor_hash_entry *entries;
+    uint32_t size;
+    uint32_t num_entries;
+    uint8_t bits;
+};
+
+//Returns 0 on success, 1 if memory could not be allocated
+uint8_t usb_monitor_hash_init(struct usb_monitor_hash *hash);
+void usb_monitor_hash_destroy(struct usb_monitor_hash *hash);
+
+//Insert key, value is replaced if key is already in the table. value can not
+//be NULL. Returns 0 on success, 1 if table had to grow and that failed
+uint8_t usb_monitor_hash_insert(struct usb_monitor_hash *hash, uint64_t key,
+                                void *value);
+
+//Returns the value stored for key, or NULL
+void* usb_monitor_hash_find(struct usb_monitor_hash *hash, uint64_t key);
+
+//Remove key from table. Returns the value that was stored, or NULL
+void* usb_monitor_hash_remove(struct usb_monitor_hash *hash, uint64_t key);
+
+//Map key to [0, range) with the same hash as the table. Keys that only differ
+//in a few bits (like the paths of ports on the same hub) are spread over the
+//whole range
+uint32_t usb_monitor_hash_scale(uint64_t key, uint32_t range);
+#endif
@@ -22,21 +22,72 @@
 #include "usb_monitor.h"
 #include "usb_monitor_lists.h"
 #include "usb_helpers.h"
+#include "usb_logging.h"
+
+/* Port list functions. Ports are looked up through the path hash */
+uint64_t usb_monitor_lists_path_key(const uint8_t *path, uint8_t path_len)
+{
+    uint64_t key = 0;
+
+    memcpy(&key, path, path_len < sizeof(key) ? path_len : sizeof(key));
+    return key;
+}
+
+void usb_monitor_lists_index_port(struct usb_monitor_ctx *ctx,
+                                  struct usb_port *port)
+{
+    uint8_t i;
+
+    for (i = 0; i < MAX_NUM_PATHS; i++) {
+        if (!port->path_len[i])
+            break;
+
+        if (usb_monitor_hash_insert(&(ctx->port_path_hash), port->path[i].key, port))
+            USB_DEBUG_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to add path to "
+                                   "hash\n");
+
+        if (usb_path_tree_insert(&(ctx->port_path_tree), port->path[i].bytes,
+                                 port->path_len[i], port))
+            USB_DEBUG_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to add path to "
+                                   "tree\n");
+    }
+}
 
-/* Port list functions. No need for a find since these do not depend on events */
 void usb_monitor_lists_add_port(struct usb_monitor_ctx *ctx, struct usb_port *port)
 {
     LIST_INSERT_HEAD(&(ctx->port_list), port, port_next);
+    usb_monitor_lists_index_port(ctx, port);
 }
 
 void usb_monitor_lists_del_port(struct usb_port *port)
 {
+    struct usb_monitor_ctx *ctx = port->ctx;
+    uint64_t key;
+    uint8_t i;
+
     if (port->port_next.le_next == NULL &&
         port->port_next.le_prev == NULL)
         return;
 
     LIST_REMOVE(port, port_next);
 
+    //Paths are unique, but be careful not to remove an entry that has been
+    //taken over by another port
+    for (i = 0; i < MAX_NUM_PATHS; i++) {
+        if (!port->path_len[i])
+            break;
+
+        key = port->path[i].key;
+
+        if (usb_monitor_hash_find(&(ctx->port_path_hash), key) == port)
+            usb_monitor_hash_remove(&(ctx->port_path_hash), key);
+
+        if (usb_path_tree_find(&(ctx->port_path_tree), port->path[i].bytes,
+                               port->path_len[i]) == port)
+            usb_path_tree_remove(&(ctx->port_path_tree), port->path[i].bytes,
+                                 port->path_len[i]);
+    }
+
     //This is a work-around for an issue where a hub is removed while ports
     //are being reset. Resetting depends on the timer for sending the second
     //message, or retransmitting a message. When a device goes down, we
@@ -58,55 +109,56 @@ struct usb_port *usb_monitor_lists_find_port_path(struct usb_monitor_ctx *ctx,
                                                   uint8_t *path,
                                                   uint8_t path_len)
 {
-    uint8_t i;
-    struct usb_port *itr = NULL;
-
-    LIST_FOREACH(itr, &(ctx->port_list), port_next) {
-        for (i = 0; i < MAX_NUM_PATHS; i++) {
-            if (!itr->path[i])
-                break;
-
-            if ((itr->path_len[i] == path_len) &&
-                (!memcmp(itr->path[i], path, path_len))) {
-                return itr;
-            }
-        }
-    }
+    if (path_len > USB_PATH_MAX)
+        return NULL;
 
-    return NULL;
+    return usb_monitor_hash_find(&(ctx->port_path_hash),
+                                 usb_monitor_lists_path_key(path, path_len));
 }
 
+uint32_t usb_monitor_lists_foreach_port_path(struct usb_monitor_ctx *ctx,
+                                             uint8_t *prefix,
+                                             uint8_t prefix_len,
+                                             usb_path_tree_cb cb, void *data)
+{
+    return usb_path_tree_foreach(&(ctx->port_path_tree), prefix, prefix_len,
+                                 cb, data);
+}
+
+/* Port timeouts are kept in the timer queue of the event loop */
 void usb_monitor_lists_add_timeout(struct usb_monitor_ctx *ctx, struct usb_port *port)
 {
-    LIST_INSERT_HEAD(&(ctx->timeout_list), port, timeout_next);
+    backend_insert_timeout(ctx->event_loop, &(port->timeout_handle));
 }
 
 void usb_monitor_lists_del_timeout(struct usb_port *port)
 {
-    LIST_REMOVE(port, timeout_next);
-    port->timeout_next.le_next = NULL;
-    port->timeout_next.le_prev = NULL;
+    backend_delete_timeout(&(port->timeout_handle));
 }
 
 uint8_t usb_monitor_lists_is_timeout_active(struct usb_port *port)
 {
-    return port->timeout_next.le_next || port->timeout_next.le_prev;
+    return backend_timeout_is_active(&(port->timeout_handle));
 }
 
-/* HUB list functions  */
+/* HUB list functions. Hubs are looked up through the hub hash */
 void usb_monitor_lists_add_hub(struct usb_monitor_ctx *ctx, struct usb_hub *hub)
 {
     //First, insert hub in list
     LIST_INSERT_HEAD(&(ctx->hub_list), hub, hub_next);
 
+    if (usb_monitor_hash_insert(&(ctx->hub_hash), (uintptr_t) hub->hub_dev,
+                                hub))
+        USB_DEBUG_PRINT_SYSLOG(ctx, LOG_ERR, "Failed to add hub to hash\n");
+
     //Whenever we add a hub, we also need to iterate through the list of devices
     //and see if we are aware of any that are connected
     usb_helpers_check_devices(ctx);
 }
 
-void usb_monitor_lists_del_hub(struct usb_hub *hub)
+void usb_monitor_lists_del_hub(struct usb_monitor_ctx *ctx,
+                               struct usb_hub *hub)
 {
-
     if (hub->hub_next.le_next == NULL &&
         hub->hub_next.le_prev == NULL)
         return;
@@ -115,16 +167,57 @@ void usb_monitor_lists_del_hub(struct usb_hub *hub)
     hub->hub_next.le_next = NULL;
     hub->hub_next.le_prev = NULL;
 
+    if (usb_monitor_hash_find(&(ctx->hub_hash), (uintptr_t) hub->hub_dev) == hub)
+        usb_monitor_hash_remove(&(ctx->hub_hash), (uintptr_t) hub->hub_dev);
 }
 
-struct usb_hub* usb_monitor_lists_find_hub(struct usb_monitor_ctx *ctx,
-                                     libusb_device *hub)
+//Ports of a hub that are found in the path tree
+struct usb_monitor_lists_hub_ports {
+    struct usb_hub *hub;
+    struct usb_port *ports[UINT8_MAX];
+    uint32_t num_ports;
+};
+
+static void usb_monitor_lists_hub_port_cb(const uint8_t *path,
+                                          uint8_t path_len, void *value,
+                                          void *data)
+{
+    struct usb_monitor_lists_hub_ports *hub_ports = data;
+    struct usb_port *port = value;
+
+    //Ports of hubs further down are deleted together with their own hub, and a
+    //port with more than one path is only collected for its first path
+    if (port->parent != hub_ports->hub || path_len != port->path_len[0] ||
+        memcmp(path, port->path[0].bytes, path_len) ||
+        hub_ports->num_ports == UINT8_MAX)
+        return;
+
+    hub_ports->ports[hub_ports->num_ports++] = port;
+}
+
+uint32_t usb_monitor_lists_del_hub_ports(struct usb_monitor_ctx *ctx,
+                                         struct usb_hub *hub)
 {
-    struct usb_hub *itr = ctx->hub_list.lh_first;
+    struct usb_monitor_lists_hub_ports hub_ports;
+    uint8_t path[USB_PATH_MAX], path_len;
+    uint32_t i;
+
+    usb_helpers_fill_port_array(hub->hub_dev, path, &path_len);
+    hub_ports.hub = hub;
+    hub_ports.num_ports = 0;
+
+    //The tree can not be modified while we iterate over it
+    usb_path_tree_foreach(&(ctx->port_path_tree), path, path_len,
+                          usb_monitor_lists_hub_port_cb, &hub_ports);
 
-    LIST_FOREACH(itr, &(ctx->hub_list), hub_next)
-        if (itr->hub_dev == hub)
-            return itr;
+    for (i = 0; i < hub_ports.num_ports; i++)
+        usb_monitor_lists_del_port(hub_ports.ports[i]);
 
-    return NULL;
+    return hub_ports.num_ports;
+}
+
+struct usb_hub* usb_monitor_lists_find_hub(struct usb_monitor_ctx *ctx,
+                                     libusb_device *hub)
+{
+    return usb_monitor_hash_find(&(ctx->hub_hash), (uintptr_t) hub);
 }
@@ -21,21 +21,46 @@
 #include "usb_monitor.h"
 #include <libusb-1.0/libusb.h>
 
-//Searches for the hub_device in hub_list and returns 1 if found, 0 otherwise
+//Searches for the hub_device in hub_list and returns the hub, or NULL
 struct usb_hub* usb_monitor_lists_find_hub(struct usb_monitor_ctx *ctx,
                                            libusb_device *hub);
 
-//Add hub to list/delete hub from list
+//Add hub to list/delete hub from list. hub_dev is used for indexing the hub,
+//so del_hub must be called before hub_dev is unreferenced
 void usb_monitor_lists_add_hub(struct usb_monitor_ctx *ctx, struct usb_hub *hub);
-void usb_monitor_lists_del_hub(struct usb_hub *hub);
+void usb_monitor_lists_del_hub(struct usb_monitor_ctx *ctx,
+                               struct usb_hub *hub);
 
-//Add port to list/delete port from list
+//Delete every port of hub from the port list. The ports are found in the path
+//tree, under the path of hub_dev, so this must be called before hub_dev is
+//unreferenced. Returns the number of ports that were deleted
+uint32_t usb_monitor_lists_del_hub_ports(struct usb_monitor_ctx *ctx,
+                                         struct usb_hub *hub);
+
+//Add port to list/delete port from list. The paths of the port are added
+//to/removed from the path hash and tree, so the paths of a port on the list
+//must not be changed without re-indexing the port
 void usb_monitor_lists_add_port(struct usb_monitor_ctx *ctx, struct usb_port *port);
 void usb_monitor_lists_del_port(struct usb_port *port);
 struct usb_port *usb_monitor_lists_find_port_path(struct usb_monitor_ctx *ctx,
                                                   uint8_t *path,
                                                   uint8_t path_len);
 
+//Call cb for every path that starts with prefix (i.e., all ports under the hub
+//at prefix, or the port at prefix), in topology order. Returns number of paths
+uint32_t usb_monitor_lists_foreach_port_path(struct usb_monitor_ctx *ctx,
+                                             uint8_t *prefix,
+                                             uint8_t prefix_len,
+                                             usb_path_tree_cb cb, void *data);
+
+//Key of a path in the path hash, same as the key of union usb_path
+uint64_t usb_monitor_lists_path_key(const uint8_t *path, uint8_t path_len);
+
+//(Re-)insert all paths of a port that is already on the list, for example after
+//a path has been added to or moved between ports
+void usb_monitor_lists_index_port(struct usb_monitor_ctx *ctx,
+                                  struct usb_port *port);
+
 //Add or delete port from timeout list
 void usb_monitor_lists_add_timeout(struct usb_monitor_ctx *ctx, struct usb_port *port);
 void usb_monitor_lists_del_timeout(struct usb_port *port);
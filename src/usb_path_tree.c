@@ -0,0 +1,254 @@
+/*
+ * Copyright 2015 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Usb Monitor. Usb Monitor is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * Usb Montior is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Usb Monitor. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "usb_path_tree.h"
+
+//Returns the link where a child with byte is, or should be inserted
+static struct usb_path_tree_node **usb_path_tree_link(
+        struct usb_path_tree_node *node, uint8_t byte)
+{
+    struct usb_path_tree_node **link = &(node->children);
+
+    while (*link && (*link)->byte < byte)
+        link = &((*link)->next);
+
+    return link;
+}
+
+static struct usb_path_tree_node *usb_path_tree_child(
+        struct usb_path_tree_node *node, uint8_t byte)
+{
+    struct usb_path_tree_node *child = *usb_path_tree_link(node, byte);
+
+    if (child && child->byte == byte)
+        return child;
+    else
+        return NULL;
+}
+
+//Returns the node of path, or NULL if there is no such node
+static struct usb_path_tree_node *usb_path_tree_walk(
+        struct usb_path_tree *tree, const uint8_t *path, uint8_t path_len)
+{
+    struct usb_path_tree_node *node = &(tree->root);
+    uint8_t i;
+
+    if (path_len > USB_PATH_TREE_MAX_DEPTH)
+        return NULL;
+
+    for (i = 0; i < path_len && node; i++)
+        node = usb_path_tree_child(node, path[i]);
+
+    return node;
+}
+
+void usb_path_tree_init(struct usb_path_tree *tree)
+{
+    memset(tree, 0, sizeof(struct usb_path_tree));
+}
+
+static void usb_path_tree_free_children(struct usb_path_tree_node *node)
+{
+    struct usb_path_tree_node *child;
+
+    while ((child = node->children)) {
+        node->children = child->next;
+        usb_path_tree_free_children(child);
+        free(child);
+    }
+}
+
+void usb_path_tree_destroy(struct usb_path_tree *tree)
+{
+    usb_path_tree_free_children(&(tree->root));
+    usb_path_tree_init(tree);
+}
+
+uint8_t usb_path_tree_insert(struct usb_path_tree *tree, const uint8_t *path,
+                             uint8_t path_len, void *value)
+{
+    struct usb_path_tree_node *node = &(tree->root), **link, *child;
+    uint8_t i;
+
+    if (!path_len || path_len > USB_PATH_TREE_MAX_DEPTH || !value)
+        return 1;
+
+    for (i = 0; i < path_len; i++) {
+        link = usb_path_tree_link(node, path[i]);
+
+        if (*link && (*link)->byte == path[i]) {
+            node = *link;
+            continue;
+        }
+
+        //Nodes created before a failed allocation are left in the tree. They
+        //are empty, so lookups and iteration are not affected
+        child = calloc(sizeof(struct usb_path_tree_node), 1);
+
+        if (child == NULL)
+            return 1;
+
+        child->byte = path[i];
+        child->next = *link;
+        *link = child;
+        node = child;
+    }
+
+    if (!node->value)
+        tree->num_values++;
+
+    node->value = value;
+    return 0;
+}
+
+void* usb_path_tree_find(struct usb_path_tree *tree, const uint8_t *path,
+                         uint8_t path_len)
+{
+    struct usb_path_tree_node *node = usb_path_tree_walk(tree, path, path_len);
+
+    return node ? node->value : NULL;
+}
+
+void* usb_path_tree_find_prefix(struct usb_path_tree *tree, const uint8_t *path,
+                                uint8_t path_len, uint8_t *match_len)
+{
+    struct usb_path_tree_node *node = &(tree->root);
+    void *value = NULL;
+    uint8_t i;
+
+    *match_len = 0;
+
+    if (path_len > USB_PATH_TREE_MAX_DEPTH)
+        path_len = USB_PATH_TREE_MAX_DEPTH;
+
+    for (i = 0; i < path_len; i++) {
+        if (!(node = usb_path_tree_child(node, path[i])))
+            break;
+
+        if (node->value) {
+            value = node->value;
+            *match_len = i + 1;
+        }
+    }
+
+    return value;
+}
+
+uint32_t usb_path_tree_foreach_prefix(struct usb_path_tree *tree,
+                                      const uint8_t *path, uint8_t path_len,
+                                      usb_path_tree_cb cb, void *data)
+{
+    struct usb_path_tree_node *node = &(tree->root);
+    uint32_t num_visited = 0;
+    uint8_t i;
+
+    if (path_len > USB_PATH_TREE_MAX_DEPTH)
+        path_len = USB_PATH_TREE_MAX_DEPTH;
+
+    for (i = 0; i < path_len; i++) {
+        if (!(node = usb_path_tree_child(node, path[i])))
+            break;
+
+        if (node->value) {
+            cb(path, i + 1, node->value, data);
+            num_visited++;
+        }
+    }
+
+    return num_visited;
+}
+
+void* usb_path_tree_remove(struct usb_path_tree *tree, const uint8_t *path,
+                           uint8_t path_len)
+{
+    struct usb_path_tree_node **links[USB_PATH_TREE_MAX_DEPTH];
+    struct usb_path_tree_node *node = &(tree->root);
+    void *value;
+    int8_t i;
+
+    if (!path_len || path_len > USB_PATH_TREE_MAX_DEPTH)
+        return NULL;
+
+    //Remember the link to every node on the path, so that nodes can be
+    //unlinked on the way back up
+    for (i = 0; i < path_len; i++) {
+        links[i] = usb_path_tree_link(node, path[i]);
+
+        if (!*links[i] || (*links[i])->byte != path[i])
+            return NULL;
+
+        node = *links[i];
+    }
+
+    if (!(value = node->value))
+        return NULL;
+
+    node->value = NULL;
+    tree->num_values--;
+
+    //Free nodes that neither store a value nor lead to one
+    for (i = path_len - 1; i >= 0; i--) {
+        node = *links[i];
+
+        if (node->value || node->children)
+            break;
+
+        *links[i] = node->next;
+        free(node);
+    }
+
+    return value;
+}
+
+static uint32_t usb_path_tree_visit(struct usb_path_tree_node *node,
+                                    uint8_t *path, uint8_t depth,
+                                    usb_path_tree_cb cb, void *data)
+{
+    struct usb_path_tree_node *child;
+    uint32_t num_visited = 0;
+
+    if (node->value) {
+        cb(path, depth, node->value, data);
+        num_visited++;
+    }
+
+    for (child = node->children; child; child = child->next) {
+        path[depth] = child->byte;
+        num_visited += usb_path_tree_visit(child, path, depth + 1, cb, data);
+    }
+
+    return num_visited;
+}
+
+uint32_t usb_path_tree_foreach(struct usb_path_tree *tree,
+                               const uint8_t *prefix, uint8_t prefix_len,
+                               usb_path_tree_cb cb, void *data)
+{
+    struct usb_path_tree_node *node = usb_path_tree_walk(tree, prefix,
+                                                         prefix_len);
+    uint8_t path[USB_PATH_TREE_MAX_DEPTH];
+
+    if (!node)
+        return 0;
+
+    if (prefix_len)
+        memcpy(path, prefix, prefix_len);
+
+    return usb_path_tree_visit(node, path, prefix_len, cb, data);
+}
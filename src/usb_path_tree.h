@@ -0,0 +1,85 @@
+/*
+ * Copyright 2015 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Usb Monitor. Usb Monitor is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * Usb Montior is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Usb Monitor. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef USB_PATH_TREE_H
+#define USB_PATH_TREE_H
+
+#include <stdint.h>
+
+//Bus number + max depth (7), same as USB_PATH_MAX
+#define USB_PATH_TREE_MAX_DEPTH 8
+
+//One node per byte of a path. Children are kept in a list sorted on byte, a
+//hub has at most a handful of ports so the lists are short
+struct usb_path_tree_node {
+    struct usb_path_tree_node *children;
+    struct usb_path_tree_node *next;
+    void *value;
+    uint8_t byte;
+};
+
+//Radix tree over USB paths (bus number followed by the port numbers, as
+//created by usb_helpers_fill_port_array()). All paths below a hub share the
+//hub's path as prefix, so every port under a hub is found by walking to the
+//hub's node and iterating over its subtree. Lookups touch one node per byte
+struct usb_path_tree {
+    struct usb_path_tree_node root;
+    uint32_t num_values;
+};
+
+//Called for every value in a subtree, in path order. The tree must not be
+//modified from the callback
+typedef void (*usb_path_tree_cb)(const uint8_t *path, uint8_t path_len,
+                                 void *value, void *data);
+
+void usb_path_tree_init(struct usb_path_tree *tree);
+
+//Free all nodes, the values are not touched. The tree is empty afterwards
+void usb_path_tree_destroy(struct usb_path_tree *tree);
+
+//Insert path, value is replaced if path is already in the tree. value can not
+//be NULL. Returns 0 on success, 1 if path is invalid or allocation failed
+uint8_t usb_path_tree_insert(struct usb_path_tree *tree, const uint8_t *path,
+                             uint8_t path_len, void *value);
+
+//Returns the value stored for path, or NULL
+void* usb_path_tree_find(struct usb_path_tree *tree, const uint8_t *path,
+                         uint8_t path_len);
+
+//Returns the value of the longest path in the tree that is a prefix of path (or
+//path itself), or NULL. Length of the match is stored in match_len
+void* usb_path_tree_find_prefix(struct usb_path_tree *tree, const uint8_t *path,
+                                uint8_t path_len, uint8_t *match_len);
+
+//Call cb for every value stored on the way to path, i.e., for every prefix of
+//path (including path itself) that is in the tree. The shortest prefix is
+//visited first. Returns the number of values visited
+uint32_t usb_path_tree_foreach_prefix(struct usb_path_tree *tree,
+                                      const uint8_t *path, uint8_t path_len,
+                                      usb_path_tree_cb cb, void *data);
+
+//Remove path from tree, nodes that are no longer needed are freed. Returns the
+//value that was stored, or NULL
+void* usb_path_tree_remove(struct usb_path_tree *tree, const uint8_t *path,
+                           uint8_t path_len);
+
+//Call cb for every value stored under prefix, including prefix itself. A
+//prefix_len of 0 iterates over the whole tree. Returns the number of values
+//visited
+uint32_t usb_path_tree_foreach(struct usb_path_tree *tree,
+                               const uint8_t *prefix, uint8_t prefix_len,
+                               usb_path_tree_cb cb, void *data);
+#endif
@@ -0,0 +1,171 @@
+/*
+ * Copyright 2015 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Usb Monitor. Usb Monitor is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * Usb Montior is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Usb Monitor. If not, see http://www.gnu.org/licenses/.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+
+#include "usb_sysfs.h"
+#include "usb_monitor.h"
+#include "usb_helpers.h"
+#include "usb_logging.h"
+
+//Devices are named <bus>-<port>.<port>...
+static uint8_t usb_sysfs_dev_name(struct usb_port *port, char *name,
+                                  size_t name_len)
+{
+    uint8_t path[USB_PATH_MAX];
+    uint8_t path_len, i;
+    int len;
+
+    usb_helpers_fill_port_array(port->dev, path, &path_len);
+
+    //A device on the bus itself is the root hub, which we never monitor
+    if (path_len < 2)
+        return 1;
+
+    len = snprintf(name, name_len, "%u-%u", path[0], path[1]);
+
+    for (i = 2; i < path_len && len < name_len; i++)
+        len += snprintf(name + len, name_len - len, ".%u", path[i]);
+
+    return len >= name_len;
+}
+
+static uint8_t usb_sysfs_open(struct usb_port *port, const char **attrs,
+                              uint8_t num_attrs)
+{
+    const char *root = port->ctx->sysfs_root ? port->ctx->sysfs_root :
+                                               DEFAULT_SYSFS_ROOT;
+    char dev_name[MAX_USB_PATH], attr_path[256];
+    uint8_t i;
+
+    if (usb_sysfs_dev_name(port, dev_name, sizeof(dev_name)))
+        return 1;
+
+    for (i = 0; i < num_attrs; i++) {
+        if (snprintf(attr_path, sizeof(attr_path), "%s/%s/%s", root, dev_name,
+                     attrs[i]) >= sizeof(attr_path))
+            break;
+
+        port->sysfs_fd[i] = open(attr_path, O_RDONLY | O_CLOEXEC);
+
+        if (port->sysfs_fd[i] < 0) {
+            USB_DEBUG_PRINT_SYSLOG(port->ctx, LOG_ERR,
+                    "Failed to open %s\n", attr_path);
+            break;
+        }
+    }
+
+    if (i == num_attrs)
+        return 0;
+
+    usb_sysfs_close(port);
+    return 1;
+}
+
+//Read the value of the attribute at fd. sysfs regenerates the content when
+//reading from offset 0, so the fd can be reused. Returns 1 if reading fails,
+//for example with ENODEV when the device is gone
+static uint8_t usb_sysfs_read(int32_t fd, char *buf, size_t buf_len)
+{
+    ssize_t len = pread(fd, buf, buf_len - 1, 0);
+
+    if (len < 0)
+        return 1;
+
+    buf[len] = '\0';
+    return 0;
+}
+
+//fds are the authorized and bConfigurationValue attributes
+static uint8_t usb_sysfs_check_state(const int32_t *fds)
+{
+    char buf[8];
+
+    if (usb_sysfs_read(fds[0], buf, sizeof(buf)) || atoi(buf) != 1)
+        return 1;
+
+    //bConfigurationValue is empty when the device is not configured
+    if (usb_sysfs_read(fds[1], buf, sizeof(buf)) || atoi(buf) < 1)
+        return 1;
+
+    return 0;
+}
+
+static uint8_t usb_sysfs_probe_urbnum(struct usb_port *port)
+{
+    static const char *attrs[] = {"urbnum", "authorized",
+                                  "bConfigurationValue"};
+    uint64_t urbnum, prev_urbnum = port->sysfs_urbnum;
+    char buf[32];
+
+    if (port->sysfs_fd[0] < 0 && usb_sysfs_open(port, attrs, 3))
+        return 1;
+
+    if (usb_sysfs_read(port->sysfs_fd[0], buf, sizeof(buf)))
+        return 1;
+
+    urbnum = strtoull(buf, NULL, 10);
+    port->sysfs_urbnum = urbnum;
+
+    //A device that is not authorized or configured is dead, no matter what
+    //urbnum says
+    if (usb_sysfs_check_state(port->sysfs_fd + 1))
+        return 1;
+
+    //The first probe has nothing to compare with. After that, every probe
+    //where no URBs have been submitted to the device counts as a failed ping,
+    //so the port is restarted after retrans_limit + 1 stalled probes in a row
+    return prev_urbnum && urbnum == prev_urbnum;
+}
+
+static uint8_t usb_sysfs_probe_state(struct usb_port *port)
+{
+    static const char *attrs[] = {"authorized", "bConfigurationValue"};
+
+    if (port->sysfs_fd[0] < 0 && usb_sysfs_open(port, attrs, 2))
+        return 1;
+
+    return usb_sysfs_check_state(port->sysfs_fd);
+}
+
+uint8_t usb_sysfs_probe(struct usb_port *port)
+{
+    if (!port->dev)
+        return 1;
+
+    if (port->probe_type == PROBE_TYPE_SYSFS_URBNUM)
+        return usb_sysfs_probe_urbnum(port);
+    else
+        return usb_sysfs_probe_state(port);
+}
+
+void usb_sysfs_close(struct usb_port *port)
+{
+    uint8_t i;
+
+    for (i = 0; i < USB_SYSFS_MAX_FDS; i++) {
+        if (port->sysfs_fd[i] >= 0)
+            close(port->sysfs_fd[i]);
+
+        port->sysfs_fd[i] = -1;
+    }
+
+    port->sysfs_urbnum = 0;
+}
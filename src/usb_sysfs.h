@@ -0,0 +1,41 @@
+/*
+ * Copyright 2015 Kristian Evensen <kristian.evensen@gmail.com>
+ *
+ * This file is part of Usb Monitor. Usb Monitor is free software: you can
+ * redistribute it and/or modify it under the terms of the Lesser GNU General
+ * Public License as published by the Free Software Foundation, either version 3
+ * of the License, or (at your option) any later version.
+ *
+ * Usb Montior is distributed in the hope that it will be useful, but WITHOUT ANY
+ * WARRANTY; without even the implied warranty of MERCHANTABILITY or FITNESS FOR
+ * A PARTICULAR PURPOSE. See the GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License along with
+ * Usb Monitor. If not, see http://www.gnu.org/licenses/.
+ */
+
+#ifndef USB_SYSFS_H
+#define USB_SYSFS_H
+
+#include <stdint.h>
+
+#define DEFAULT_SYSFS_ROOT "/sys/bus/usb/devices"
+
+struct usb_port;
+
+//Probe the device connected to port by reading its attributes in sysfs,
+//instead of sending a request to it. The attribute files are opened on first
+//use and kept open until usb_sysfs_close() is called, later probes only pread
+//the cached fds. Returns 0 if the device looks alive, 1 if not
+//
+//PROBE_TYPE_SYSFS_STATE: device must be authorized and configured
+//PROBE_TYPE_SYSFS_URBNUM: device must be authorized and configured, and
+//urbnum (the number of URBs submitted to the device) must have increased since
+//the last probe. The probe sends no URBs itself, so it is only meant for
+//devices with constant traffic (for example modems). An idle device fails every
+//probe, and is restarted when the ping retransmission limit is reached
+uint8_t usb_sysfs_probe(struct usb_port *port);
+
+//Close the cached attribute fds of port
+void usb_sysfs_close(struct usb_port *port);
+#endif
@@ -27,6 +27,7 @@
 #include "usb_helpers.h"
 #include "usb_monitor_lists.h"
 #include "usb_logging.h"
+#include "usb_monitor_callbacks.h"
 
 static int32_t ykush_update_port(struct usb_port *port, uint8_t cmd);
 
@@ -64,6 +65,7 @@ static void ykush_disable_cb(struct libusb_transfer *transfer)
 
     yport->enabled = 0;
     yport->msg_mode = IDLE;
+    usb_helpers_dequeue_ping((struct usb_port*) yport);
     yport->pwr_state = 0;
 }
 
@@ -137,6 +139,8 @@ static int32_t ykush_perform_transfer(struct ykush_port *yport,
         USB_DEBUG_PRINT_SYSLOG(yport->ctx, LOG_ERR,
                 "Failed to submit transfer\n");
         libusb_free_transfer(transfer);
+    } else {
+        usb_monitor_update_libusb_timeout(yport->ctx);
     }
 
     return retval;
@@ -183,14 +187,14 @@ static int32_t ykush_update_port(struct usb_port *port, uint8_t cmd)
     //we call this function, and unset when a reset is done. This guard is
     //needed when we add support for async reset notifications
     yport->msg_mode = RESET;
+    usb_helpers_dequeue_ping(port);
 
     //For asynchrnous resets (i.e., resets triggered by something else than our
     //code), we might get a reset notification while waiting to send the net
     //ping. We therefore need to make sure the port is removed from the timeout
     //list, since it does not make sense to try to send ping while resetting
     //device.
-    if (yport->timeout_next.le_next != NULL ||
-        yport->timeout_next.le_prev != NULL)
+    if (usb_monitor_lists_is_timeout_active((struct usb_port*) yport))
             usb_monitor_lists_del_timeout((struct usb_port*) yport);
     
     if (!yport->pwr_state)
@@ -294,9 +298,13 @@ static uint8_t ykush_configure_hub(struct usb_monitor_ctx *ctx,
         return 0;
 }
 
-static void ykush_release_memory(struct ykush_hub *yhub)
+static void ykush_release_memory(struct usb_monitor_ctx *ctx,
+                                 struct ykush_hub *yhub)
 {
-    uint8_t i = 0;
+    //Hub and ports are indexed on hub_dev and its path, so remove them before
+    //the device is released
+    usb_monitor_lists_del_hub(ctx, (struct usb_hub*) yhub);
+    usb_monitor_lists_del_hub_ports(ctx, (struct usb_hub*) yhub);
 
     //According to documentation, comm_handle is only populated if open() is
     //successfull
@@ -310,12 +318,6 @@ static void ykush_release_memory(struct ykush_hub *yhub)
     libusb_unref_device(yhub->hub_dev);
     libusb_unref_device(yhub->comm_dev);
 
-    for (i = 0; i < yhub->num_ports; i++) {
-        usb_helpers_release_port((struct usb_port*) &(yhub->port[i]));
-        usb_monitor_lists_del_port((struct usb_port*) &(yhub->port[i]));
-    }
-
-    usb_monitor_lists_del_hub((struct usb_hub*) yhub);
     free(yhub);
 }
 
@@ -352,7 +354,7 @@ static void ykush_add_device(libusb_context *ctx, libusb_device *device,
     if (!ykush_configure_hub(usbmon_ctx, yhub)) {
         USB_DEBUG_PRINT_SYSLOG(usbmon_ctx, LOG_ERR,
                 "YKUSH hub configuration failed\n");
-        ykush_release_memory(yhub);
+        ykush_release_memory(usbmon_ctx, yhub);
         return;
     }
 
@@ -375,7 +377,7 @@ static void ykush_del_device(libusb_context *ctx, libusb_device *device,
     }
 
     USB_DEBUG_PRINT_SYSLOG(usbmon_ctx, LOG_INFO, "Will remove YKUSH hub\n");
-    ykush_release_memory(yhub);
+    ykush_release_memory(usbmon_ctx, yhub);
 }
 
 int ykush_event_cb(libusb_context *ctx, libusb_device *device,